@@ -1,4 +1,8 @@
+#define _GNU_SOURCE	// splice()
+
 #include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <pthread.h>
 #include <errno.h> 
@@ -7,6 +11,10 @@
 #include <ctype.h>
 #include <sys/socket.h>
 #include <netdb.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <time.h>
 
 #include "gfclient.h"
 
@@ -23,7 +31,19 @@ typedef void (*headerFuncPtr)(void*, size_t, void*);
 #define BUFFSIZE    4096
 #define HOSTSIZE	128
 #define PATHSIZE  	256
-#define HEADERSIZE	128
+#define HEADERSIZE	256		// longest response header accepted
+#define REQHEADERSIZE	(PATHSIZE + 72)	// longest request: command, path, " <offset> <len>", KEEPALIVE, end marker
+#define CONN_POOL_SIZE	64		// idle keep-alive connections kept for reuse, per thread
+#define FREE_REQS_MAX	64		// released request handles a thread keeps for reuse
+#define PIPELINE_DEPTH	16		// max requests in flight on one connection
+#define SPLICE_PIPESIZE	(1 << 20)	// pipe buffer asked for when splicing a body, the kernel may give less
+#define SPLICE_MAX		(1 << 20)	// bytes moved per splice() call
+#define MULTI_RXSIZE	65536	// receive buffer of an event loop, shared by its requests
+#define MULTI_EVENTS	256		// epoll events handled per gfc_multi_perform
+#define RESOLVE_CACHE_SIZE	16	// servers whose addresses a thread remembers
+#define RESOLVE_MAX_ADDRS	8	// addresses kept per server
+#define RESOLVE_TTL_SEC		60	// getaddrinfo() doesn't tell the records' TTL, addresses are kept this long
+#define HE_DELAY_MS		250		// Happy Eyeballs: head start of a connection attempt before the next one begins
 
 static const char STAT_OK[]	   	 = "OK";
 static const char STAT_FILE[]	 = "FILE_NOT_FOUND";
@@ -32,18 +52,137 @@ static const char STAT_INVALID[] = "INVALID";
 
 // unchanging arguments for the client request
 static const char REQ_CMD[]    = "GETFILE GET ";
+static const char RSP_CMD[]    = "GETFILE ";
 static const char HEAD_END[]   = "\r\n\r\n";
+static const char KEEPALIVE[]  = " KEEPALIVE";	// persistent connection token, request and response
 static const int  REQ_CMD_LEN  = 12; 
+static const int  RSP_CMD_LEN  = 8; 
 static const int  HEAD_END_LEN = 4; 
+static const int  KEEPALIVE_LEN = 10; 
+
+// response status strings, matched by the header parser
+static const struct { const char* str; gfstatus_t status; } STAT_TABLE[] = 
+{
+	{ STAT_OK,		GF_OK },
+	{ STAT_FILE,	GF_FILE_NOT_FOUND },
+	{ STAT_ERROR,	GF_ERROR }
+};
+static const int STAT_TABLE_LEN = 3;
+
+// states of the response header parser
+enum
+{
+	PARSE_CMD = 0,		// "GETFILE "
+	PARSE_STATUS,		// <status>
+	PARSE_LENGTH,		// <fileLength>, only after OK
+	PARSE_TOKEN,		// optional tokens, i.e. KEEPALIVE
+	PARSE_END,			// "\r\n\r\n"
+	PARSE_DONE,
+	PARSE_ERROR
+};
 
-static char dataBuffer[BUFFSIZE] 	 	= {0};
+// results of one request/response exchange on a connection
+enum
+{
+	XFER_OK		=  0,
+	XFER_FAILED	= -1,
+	XFER_CLOSED = -2,	// connection closed before any response byte, i.e. a stale pooled connection
+	XFER_MORE	=  1	// response incomplete, waiting for more bytes
+};
+
+// where a request driven by a gfc_multi_t stands
+enum
+{
+	MULTI_IDLE = 0,		// not in an event loop
+	MULTI_SEND,			// connecting, or sending the request
+	MULTI_RECV,			// receiving the response
+	MULTI_DONE			// finished, waiting for gfc_multi_next
+};
 
 typedef struct gfchead_t
 {
 	gfstatus_t 	responseStatus;		
-	int 		fileLenBytes;
+	uint64_t	fileLenBytes;		// body bytes following the header
+	uint64_t	rangeOffset;		// where the body starts in the file, 0 unless a range was served
+	uint64_t	totalLenBytes;		// size of the whole file
+	BOOL		keepAlive;			// server agreed to keep the connection open
 } gfchead_t;
-static gfchead_t headStruct = {GF_INVALID, 0};
+
+// Purpose: resumable response header parser. Bytes are consumed where they were received, 
+// in chunks split at any point; only the match position and the pending number are kept.
+typedef struct gfc_parser_t
+{
+	int			state;
+	int			pos;				// chars of the current literal/token matched so far
+	unsigned	candidates;			// bitmask of STAT_TABLE entries (or tokens) still matching
+	int			numDigits;
+	uint64_t	value;				// number being parsed
+	BOOL		tokenDigits;		// current token is a number so far
+	int			numRange;			// number tokens after the length, <offset> then <totalLength>
+	int			headerLen;			// header bytes consumed so far
+} gfc_parser_t;
+
+// Purpose: received bytes not consumed yet. With pipelining, a chunk can end in the 
+// middle of the next response, so the rest is carried over to it.
+typedef struct gfc_rxbuf_t
+{
+	char*	data;
+	int		start;				// first unconsumed byte
+	int		len;				// number of unconsumed bytes
+} gfc_rxbuf_t;
+
+// Purpose: progress of a request in a gfc_multi_t event loop
+typedef struct gfc_async_t
+{
+	int		state;
+	int		sockFD;
+	int		txSent;					// request header bytes sent
+	BOOL	reused;					// connection came from the pool
+	BOOL	retried;				// already moved to a new connection once
+	BOOL	anyByte;				// any byte of the response received
+	int		result;					// once done: 0, or -1 like gfc_perform
+	int		attempt;				// server addresses tried so far on this connect
+	int		addrIdx;				// address being connected to
+	void*	arg;					// handed back by gfc_multi_next
+	struct gfcrequest_t* prev;		// running list, next is gfcrequest_t.next
+} gfc_async_t;
+
+// Purpose: idle persistent connections, keyed by server and port
+typedef struct gfc_conn_t
+{
+	char		server[HOSTSIZE];
+	uint16_t	port;
+	int			sockFD;
+	BOOL		inUse;				// slot holds an idle connection
+} gfc_conn_t;
+
+// Purpose: resolved addresses of a server, in the order connections try them
+typedef struct gfc_resolved_t
+{
+	char					server[HOSTSIZE];
+	struct sockaddr_storage	addrs[RESOLVE_MAX_ADDRS];
+	socklen_t				addrLens[RESOLVE_MAX_ADDRS];
+	int						numAddrs;			// 0 if the slot is unused
+	int						preferred;			// address that connected last, tried first
+	BOOL					confirmed;			// preferred is known to connect
+	time_t					expires;			// CLOCK_MONOTONIC seconds
+} gfc_resolved_t;
+
+// Purpose: everything a thread needs to perform requests without sharing anything 
+// with other threads, so gfc_perform takes no locks. Created on the thread's first 
+// request and released when the thread exits.
+typedef struct gfc_thread_t
+{
+	gfc_conn_t				connPool[CONN_POOL_SIZE];	// this thread's idle connections
+	struct gfcrequest_t*	freeReqs;					// released handles, linked through next
+	int						numFree;
+	gfc_resolved_t			resolved[RESOLVE_CACHE_SIZE];	// this thread's resolver cache
+	int						nextResolved;				// slot replaced next, round robin
+} gfc_thread_t;
+
+static __thread gfc_thread_t*	gfcThread;
+static pthread_key_t			gfcThreadKey;
+static pthread_once_t			gfcThreadOnce = PTHREAD_ONCE_INIT;
 
 
 // NOTE: this struct is used as an opaque pointer at the API/interface level. 
@@ -52,78 +191,352 @@ struct gfcrequest_t
 {
 	char	   		server[HOSTSIZE];		// the server name, i.e. "localhost"
 	char		    reqPath[PATHSIZE];		// the path of the file that is requested from the server
-	int				pathLen;				// lenght of the reqPath string	
+	int				pathLen;				// lenght of the reqPath string, >= PATHSIZE if the path didn't fit
 	uint16_t 		port;						
 	FILE*			writeFile;				// file handle for the file to be written upon server response
 	writeFuncPtr	writeFunc;				// function pointer for writing "writeFile"
-	int				rxBytes;				// actual number of bytes received (excluding the header)
-	char			header[HEADERSIZE];		// buffer storing the response header
-	headerFuncPtr	headerFunc;				// function pointer for header parsing
-	int				headerLen;				// length of the header
-	gfchead_t*		gfcHead;	
+	size_t			rxBytes;				// actual number of bytes received (excluding the header)
+	headerFuncPtr	headerFunc;				// optional callback, receives the raw header as it arrives
+	void*			headerArg;				// 3rd argument of headerFunc
+	gfc_parser_t	parser;					// response header parser state
+	gfchead_t		head;					// parsed response header of this request
+	BOOL			keepAlive;				// ask the server for a persistent connection
+	BOOL			hasRange;				// ask for rangeLen bytes starting at rangeOffset only
+	uint64_t		rangeOffset;
+	uint64_t		rangeLen;
+	BOOL			useWriteFD;				// the body goes to writeFD instead of writeFunc
+	int				writeFD;
+	off_t			writeOffset;			// where the first body byte goes in writeFD
+	gfc_async_t		async;					// state while driven by a gfc_multi_t
+	struct gfcrequest_t* next;				// free list of the thread that released it, or a gfc_multi_t list
 };
 
+// NOTE: an event loop driving many requests at once, one request per non-blocking 
+// connection. A response never leaves bytes behind for another on its connection, so 
+// all requests receive into the same buffer. Meant for a single thread; the connections 
+// are pooled in that thread's pool.
+struct gfc_multi_t
+{
+	int				epollFD;
+	int				numRunning;				// added and not done yet
+	gfcrequest_t*	running;				// linked through next and async.prev
+	gfcrequest_t*	doneHead;				// finished in order, linked through next
+	gfcrequest_t*	doneTail;
+	char			rxData[MULTI_RXSIZE];
+};
+typedef struct gfc_multi_t gfc_multi_t;
+
 
 //-------- Static Function Prototypes ----------//
 static int  gfc_SetUpTCPConnection(gfcrequest_t* gfr);
-static void gfc_sendHeader(gfcrequest_t* gfr, int socket);
-static void gfc_parseRxHeader(void* buffer, size_t buffLen, void* headerArg);
-static int  gfc_extractHeader(gfcrequest_t *gfr, char* buffPtr, int rxSize);
+static gfc_resolved_t* gfc_resolve(gfcrequest_t* gfr);
+static int  gfc_connectStart(gfc_resolved_t* resolved, int idx, uint16_t port);
+static int  gfc_buildHeader(gfcrequest_t* gfr, char* reqHeader);
+static int  gfc_sendHeader(gfcrequest_t* gfr, int socket);
+static int  gfc_consumeRx(gfcrequest_t* gfr, gfc_rxbuf_t* rx);
+static void gfc_parserInit(gfc_parser_t* parser, gfchead_t* head);
+static int  gfc_parseRxHeader(gfc_parser_t* parser, gfchead_t* head, const char* data, int len);
+static int  gfc_connect(gfcrequest_t *gfr, BOOL* reused);
+static int  gfc_pipeline(gfcrequest_t **gfrs, int count);
+static int  gfc_receiveResponse(gfcrequest_t *gfr, int socketFD, gfc_rxbuf_t* rx);
+static int  gfc_poolGet(gfcrequest_t* gfr);
+static void gfc_poolPut(gfcrequest_t* gfr, int socketFD);
+static int  gfc_writeBody(gfcrequest_t* gfr, char* data, size_t len, uint64_t pos);
+static int64_t gfc_spliceBody(gfcrequest_t* gfr, int socketFD, uint64_t pos, uint64_t len);
+static gfc_thread_t* gfc_thread();
+static void gfc_threadKeyInit();
+static void gfc_threadRelease(void* arg);
+static void gfc_poolClose(gfc_thread_t* thread);
+static int  gfc_multiStart(gfc_multi_t* multi, gfcrequest_t* gfr, BOOL mayReuse);
+static int  gfc_multiConnect(gfcrequest_t* gfr);
+static int  gfc_multiWatch(gfc_multi_t* multi, gfcrequest_t* gfr, int socketFD);
+static void gfc_multiRetry(gfc_multi_t* multi, gfcrequest_t* gfr);
+static void gfc_multiSend(gfc_multi_t* multi, gfcrequest_t* gfr);
+static void gfc_multiRecv(gfc_multi_t* multi, gfcrequest_t* gfr);
+static void gfc_multiDone(gfc_multi_t* multi, gfcrequest_t* gfr, int result, BOOL keep);
 
 
 //------------- SetUpTCPConnection -------------//
+// NOTE: Happy Eyeballs (RFC 8305). The server's addresses are tried in turn, each attempt 
+// getting a HE_DELAY_MS head start before the next one begins alongside it, or less if it 
+// fails sooner. The first to connect wins and the others are dropped, so an address that 
+// doesn't answer (i.e. IPv6 without a route) costs a fraction of a second, not a timeout.
 static int gfc_SetUpTCPConnection(gfcrequest_t* gfr)
 {
-    int socketFD     = 0;
-    int status       = 0;
-    
-    struct sockaddr_in  servAddr;   // server address
-    struct hostent*     server;     // host computer properties
-    
-    //---- socket creation
-    socketFD = socket(AF_INET, SOCK_STREAM, 0);
-    if (socketFD < 0)
-    {
-        fprintf(stderr, "%s @ %d: socket() failed\n", __FILE__, __LINE__);
-        return -1;              
-    }	
-
-    //---- server information creation
-    server = gethostbyname(gfr->server);
-    if (server == NULL)
-    {
-        fprintf(stderr, "%s @ %d: gethostbyname() failed\n", __FILE__, __LINE__);
-        return -1;               
-    }   
-
-    //---- server address
-    bzero( (char*)&servAddr, sizeof(servAddr) );
-    bcopy( (char*)server->h_addr, (char*)&servAddr.sin_addr.s_addr, server->h_length );
-    servAddr.sin_family         = AF_INET;
-    servAddr.sin_port           = htons(gfr->port);  
-
-    status = connect( socketFD, (struct sockaddr*)&servAddr, sizeof(servAddr) );
-    if (status < 0)
-    {
-        fprintf(stderr, "%s @ %d: connect() failed\n", __FILE__, __LINE__);
-        return -1;                       
-    }
-    
-    return socketFD;    
+	gfc_resolved_t* resolved;
+	struct pollfd pending[RESOLVE_MAX_ADDRS];	// attempts in flight
+	int  pendingIdx[RESOLVE_MAX_ADDRS];			// their addresses
+	int  numPending = 0;
+	int  next   = 0;							// attempts started
+	int  winner = -1;
+	int  socketFD = -1;
+	int  ready  = 0;
+	int  err    = 0;
+	int  i      = 0;
+	socklen_t errLen;
+
+	//---- server information creation
+	resolved = gfc_resolve(gfr);
+	if (resolved == NULL)
+	{
+		return -1;
+	}
+
+	while ( socketFD < 0 && (next < resolved->numAddrs || numPending > 0) )
+	{
+		// the next attempt begins
+		if (next < resolved->numAddrs)
+		{
+			i = (resolved->preferred + next) % resolved->numAddrs;
+			++next;
+			pending[numPending].fd     = gfc_connectStart(resolved, i, gfr->port);
+			pending[numPending].events = POLLOUT;
+			pendingIdx[numPending]     = i;
+			if (pending[numPending].fd < 0)
+				continue;
+			++numPending;
+		}
+
+		// head start of the latest attempt, or as long as it takes once all have begun
+		ready = poll(pending, numPending, (next < resolved->numAddrs) ? HE_DELAY_MS : -1);
+		if (ready <= 0)
+			continue;
+
+		// backwards, a failed attempt is replaced by the last one
+		for (i=numPending-1; i>=0; --i)
+		{
+			if (pending[i].revents == 0)
+				continue;
+			err    = 0;
+			errLen = sizeof(err);
+			if (socketFD < 0 && getsockopt(pending[i].fd, SOL_SOCKET, SO_ERROR, &err, &errLen) == 0 && err == 0)
+			{
+				socketFD = pending[i].fd;
+				winner   = pendingIdx[i];
+			}
+			else
+			{
+				close(pending[i].fd);
+			}
+			pending[i]    = pending[numPending - 1];
+			pendingIdx[i] = pendingIdx[numPending - 1];
+			--numPending;
+		}
+	}
+
+	// the losers
+	for (i=0; i<numPending; ++i)
+	{
+		close(pending[i].fd);
+	}
+
+	if (socketFD < 0)
+	{
+		fprintf(stderr, "%s @ %d: connect() failed\n", __FILE__, __LINE__);
+		resolved->expires = 0;		// look the server up again next time
+		return -1;
+	}
+
+	resolved->preferred = winner;
+	resolved->confirmed = TRUE;
+	fcntl(socketFD, F_SETFL, fcntl(socketFD, F_GETFL) & ~O_NONBLOCK);
+
+	return socketFD;
+}
+
+
+//------------- gfc_connectStart -------------//
+// begins a non-blocking connect to address idx, -1 if it failed right away
+static int gfc_connectStart(gfc_resolved_t* resolved, int idx, uint16_t port)
+{
+	struct sockaddr_storage addr = resolved->addrs[idx];
+	int socketFD = 0;
+
+	if (addr.ss_family == AF_INET6)
+		((struct sockaddr_in6*)&addr)->sin6_port = htons(port);
+	else
+		((struct sockaddr_in*)&addr)->sin_port = htons(port);
+
+	//---- socket creation
+	socketFD = socket(addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (socketFD < 0)
+	{
+		return -1;
+	}
+	if ( connect(socketFD, (struct sockaddr*)&addr, resolved->addrLens[idx]) < 0 && errno != EINPROGRESS )
+	{
+		close(socketFD);
+		return -1;
+	}
+
+	return socketFD;
+}
+
+
+//------------- gfc_resolve -------------//
+// NOTE: the server's addresses from this thread's cache, looked up with getaddrinfo() when 
+// missing or older than RESOLVE_TTL_SEC. They are stored in Happy Eyeballs order, the 
+// families alternating and starting with getaddrinfo's first choice (RFC 8305, 4). 
+// The cache is per thread, so it takes no lock. Returns NULL if the name doesn't resolve
+static gfc_resolved_t* gfc_resolve(gfcrequest_t* gfr)
+{
+	gfc_thread_t*    thread   = gfc_thread();
+	gfc_resolved_t*  resolved = NULL;
+	struct addrinfo  hints;
+	struct addrinfo* result;
+	struct addrinfo* cur;
+	struct addrinfo* first[RESOLVE_MAX_ADDRS];		// of the preferred family
+	struct addrinfo* other[RESOLVE_MAX_ADDRS];
+	struct timespec  now;
+	int numFirst = 0;
+	int numOther = 0;
+	int i = 0;
+	int status = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	for (i=0; i<RESOLVE_CACHE_SIZE; ++i)
+	{
+		if ( thread->resolved[i].numAddrs > 0 && strcmp(thread->resolved[i].server, gfr->server) == 0 )
+		{
+			resolved = &thread->resolved[i];
+			if (resolved->expires > now.tv_sec)
+				return resolved;
+			break;
+		}
+	}
+	if (resolved == NULL)
+	{
+		resolved = &thread->resolved[thread->nextResolved];
+		thread->nextResolved = (thread->nextResolved + 1) % RESOLVE_CACHE_SIZE;
+	}
+
+	memset( &hints, 0, sizeof(hints) );
+	hints.ai_family   = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags    = AI_ADDRCONFIG;
+	status = getaddrinfo(gfr->server, NULL, &hints, &result);
+	if (status != 0)
+	{
+		fprintf(stderr, "%s @ %d: getaddrinfo() failed, %s\n", __FILE__, __LINE__, gai_strerror(status));
+		resolved->numAddrs = 0;
+		return NULL;
+	}
+
+	for (cur = result; cur != NULL; cur = cur->ai_next)
+	{
+		if (cur->ai_family == result->ai_family && numFirst < RESOLVE_MAX_ADDRS)
+			first[numFirst++] = cur;
+		else if (cur->ai_family != result->ai_family && numOther < RESOLVE_MAX_ADDRS)
+			other[numOther++] = cur;
+	}
+
+	resolved->numAddrs = 0;
+	for (i=0; i<RESOLVE_MAX_ADDRS && resolved->numAddrs < RESOLVE_MAX_ADDRS; ++i)
+	{
+		cur = (i < numFirst) ? first[i] : NULL;
+		if (cur != NULL)
+		{
+			memcpy( &resolved->addrs[resolved->numAddrs], cur->ai_addr, cur->ai_addrlen );
+			resolved->addrLens[resolved->numAddrs++] = cur->ai_addrlen;
+		}
+		cur = (i < numOther && resolved->numAddrs < RESOLVE_MAX_ADDRS) ? other[i] : NULL;
+		if (cur != NULL)
+		{
+			memcpy( &resolved->addrs[resolved->numAddrs], cur->ai_addr, cur->ai_addrlen );
+			resolved->addrLens[resolved->numAddrs++] = cur->ai_addrlen;
+		}
+	}
+	freeaddrinfo(result);
+
+	strcpy(resolved->server, gfr->server);
+	resolved->preferred = 0;
+	resolved->confirmed = FALSE;
+	resolved->expires   = now.tv_sec + RESOLVE_TTL_SEC;
+
+	return resolved;
+}
+
+
+//------------ gfc_threadKeyInit -------------//
+static void gfc_threadKeyInit()
+{
+	pthread_key_create(&gfcThreadKey, gfc_threadRelease);
+}
+
+
+//------------ gfc_thread -------------//
+// the calling thread's state, created on first use
+static gfc_thread_t* gfc_thread()
+{
+	if (gfcThread == NULL)
+	{
+		pthread_once(&gfcThreadOnce, gfc_threadKeyInit);
+		gfcThread = calloc( 1, sizeof(gfc_thread_t) );
+		if (gfcThread == NULL)
+		{
+			fprintf(stderr, "%s @ %d: calloc() failed\n", __FILE__, __LINE__);
+			exit(EXIT_FAILURE);
+		}
+		pthread_setspecific(gfcThreadKey, gfcThread);
+	}
+
+	return gfcThread;
+}
+
+
+//------------ gfc_threadRelease -------------//
+// thread exit: closes the thread's idle connections and frees its handles
+static void gfc_threadRelease(void* arg)
+{
+	gfc_thread_t* thread = (gfc_thread_t*)arg;
+	gfcrequest_t* gfr;
+
+	gfc_poolClose(thread);
+	while (thread->freeReqs != NULL)
+	{
+		gfr = thread->freeReqs;
+		thread->freeReqs = gfr->next;
+		free(gfr);
+	}
+	free(thread);
+	gfcThread = NULL;
 }
 
 
 //------------ gfc_cleanup -------------//
+// NOTE: the handle goes to the free list of the calling thread, which need not be the 
+// thread that created it
 void gfc_cleanup(gfcrequest_t *gfr)
 {
-	free(gfr);
+	gfc_thread_t* thread = gfc_thread();
+
+	if (thread->numFree >= FREE_REQS_MAX)
+	{
+		free(gfr);
+		return;
+	}
+	gfr->next = thread->freeReqs;
+	thread->freeReqs = gfr;
+	thread->numFree++;
 }
 
 
 //------------ gfc_create -------------//
 gfcrequest_t *gfc_create()
 {
-	gfcrequest_t* gfr = malloc( sizeof(gfcrequest_t) );
+	gfc_thread_t* thread = gfc_thread();
+	gfcrequest_t* gfr    = thread->freeReqs;
+
+	if (gfr != NULL)
+	{
+		thread->freeReqs = gfr->next;
+		thread->numFree--;
+	}
+	else if ( NULL == (gfr = malloc( sizeof(gfcrequest_t) )) )
+	{
+		fprintf(stderr, "%s @ %d: malloc() failed\n", __FILE__, __LINE__);
+		exit(EXIT_FAILURE);
+	}
 	memset( gfr, 0, sizeof(gfcrequest_t) );
 
 	return gfr;
@@ -140,14 +553,22 @@ size_t gfc_get_bytesreceived(gfcrequest_t *gfr)
 //----------- gfc_get_filelen ---------//
 size_t gfc_get_filelen(gfcrequest_t *gfr)
 {
-    return (gfr->gfcHead->fileLenBytes);
+    return (gfr->head.fileLenBytes);
+}
+
+
+//----------- gfc_get_totallen ---------//
+// size of the whole file; differs from gfc_get_filelen() when a range was requested
+size_t gfc_get_totallen(gfcrequest_t *gfr)
+{
+    return (gfr->head.totalLenBytes);
 }
 
 
 //----------- gfc_get_status ---------//
 gfstatus_t gfc_get_status(gfcrequest_t *gfr)
 {
-    return (gfr->gfcHead->responseStatus);
+    return (gfr->head.responseStatus);
 }
 
 
@@ -158,184 +579,1035 @@ void gfc_global_init()
 
 
 //----------- gfc_global_cleanup ---------//
+// closes the calling thread's idle persistent connections; other threads' 
+// connections are closed when those threads exit
 void gfc_global_cleanup()
 {
+	if (gfcThread != NULL)
+	{
+		gfc_poolClose(gfcThread);
+	}
+}
+
+
+//----------- gfc_poolClose ---------//
+static void gfc_poolClose(gfc_thread_t* thread)
+{
+	int i = 0;
+
+	for (i=0; i<CONN_POOL_SIZE; ++i)
+	{
+		if (thread->connPool[i].inUse == TRUE)
+		{
+			close(thread->connPool[i].sockFD);
+			thread->connPool[i].inUse = FALSE;
+		}
+	}
 }
 
 
-static void gfc_sendHeader(gfcrequest_t* gfr, int socket)
+//----------- gfc_poolGet ---------//
+// takes an idle connection to the request's server out of the thread's pool, -1 if there is none
+static int gfc_poolGet(gfcrequest_t* gfr)
+{
+	gfc_conn_t* connPool = gfc_thread()->connPool;
+	int i = 0;
+
+	for (i=0; i<CONN_POOL_SIZE; ++i)
+	{
+		if ( connPool[i].inUse == TRUE && connPool[i].port == gfr->port && strcmp(connPool[i].server, gfr->server) == 0 )
+		{
+			connPool[i].inUse = FALSE;
+			return connPool[i].sockFD;
+		}
+	}
+
+	return -1;
+}
+
+
+//----------- gfc_poolPut ---------//
+// parks an idle connection in the thread's pool for reuse, or closes it if the pool is full
+static void gfc_poolPut(gfcrequest_t* gfr, int socketFD)
+{
+	gfc_conn_t* connPool = gfc_thread()->connPool;
+	int i = 0;
+
+	for (i=0; i<CONN_POOL_SIZE; ++i)
+	{
+		if (connPool[i].inUse == FALSE)
+		{
+			strcpy(connPool[i].server, gfr->server);
+			connPool[i].port   = gfr->port;
+			connPool[i].sockFD = socketFD;
+			connPool[i].inUse  = TRUE;
+			break;
+		}
+	}
+
+	if (i == CONN_POOL_SIZE)
+	{
+		close(socketFD);
+	}
+}
+
+
+//----------- gfc_sendHeader ---------//
+static int gfc_sendHeader(gfcrequest_t* gfr, int socket)
+{
+	char reqHeader[REQHEADERSIZE];
+	int  headLen = gfc_buildHeader(gfr, reqHeader);
+
+	if (headLen < 0)
+		return -1;
+
+	// transmit the request
+	return send(socket, &(reqHeader[0]), headLen, MSG_NOSIGNAL);
+}
+
+
+//----------- gfc_buildHeader ---------//
+// writes the request into reqHeader (REQHEADERSIZE bytes), returns its length; 
+// -1 if the path was too long to be kept
+static int gfc_buildHeader(gfcrequest_t* gfr, char* reqHeader)
 {
 	// build the request command, "GETFILE GET <pathToFile>
 	int  headIdx = 0;
-	char reqHeader[HEADERSIZE] = {0};
-	strcpy( &(reqHeader[headIdx]), REQ_CMD);
+
+	if (gfr->pathLen >= PATHSIZE)
+		return -1;
+
+	memcpy( &(reqHeader[headIdx]), REQ_CMD, REQ_CMD_LEN );
 	headIdx += REQ_CMD_LEN;
-	strcpy( &(reqHeader[headIdx]), gfr->reqPath );
+	memcpy( &(reqHeader[headIdx]), gfr->reqPath, gfr->pathLen );
 	headIdx += gfr->pathLen;
-	strcpy( &(reqHeader[headIdx]), HEAD_END );
+	if (gfr->hasRange == TRUE)
+	{
+		headIdx += snprintf( &(reqHeader[headIdx]), REQHEADERSIZE - headIdx, " %llu %llu", 
+							 (unsigned long long)gfr->rangeOffset, (unsigned long long)gfr->rangeLen );
+	}
+	if (gfr->keepAlive == TRUE)
+	{
+		memcpy( &(reqHeader[headIdx]), KEEPALIVE, KEEPALIVE_LEN );
+		headIdx += KEEPALIVE_LEN;
+	}
+	memcpy( &(reqHeader[headIdx]), HEAD_END, HEAD_END_LEN );
 	headIdx += HEAD_END_LEN;
-	
-	// transmit the request
-	send(socket, &(reqHeader[0]), headIdx, 0);
+
+	return headIdx;
+}
+
+
+//-------------- gfc_parserInit --------------//
+static void gfc_parserInit(gfc_parser_t* parser, gfchead_t* head)
+{
+	parser->state      = PARSE_CMD;
+	parser->pos        = 0;
+	parser->candidates = 0;
+	parser->numDigits  = 0;
+	parser->value      = 0;
+	parser->tokenDigits = TRUE;
+	parser->numRange   = 0;
+	parser->headerLen  = 0;
+
+	head->responseStatus = GF_INVALID;
+	head->fileLenBytes   = 0;
+	head->rangeOffset    = 0;
+	head->totalLenBytes  = 0;
+	head->keepAlive      = FALSE;
 }
 
 
 //-------------- gfc_parseRxHeader --------------//
-// makes use of strtok for separating strings based upon separator string
-// parses a "GETFILE <status> <fileLength>\r\n\r\n string
+// incrementally parses a "GETFILE <status> [<fileLength> [<offset> <totalLength>]] [KEEPALIVE]\r\n\r\n" header.
+// Consumes bytes until the header is complete (PARSE_DONE) or malformed (PARSE_ERROR) 
+// and returns the number of bytes consumed; the rest of data belongs to the body.
 // if status is FILE_NOT_FOUND or ERROR, no fileLength is sent
-static void gfc_parseRxHeader(void* buffer, size_t buffLen, void* headerArg)
+static int gfc_parseRxHeader(gfc_parser_t* parser, gfchead_t* head, const char* data, int len)
 {
-	char* curStr;
-	const char  key[]  = " \r\n";
+	int  i = 0;
+	int  k = 0;
+	char ch;
 
-	gfchead_t* head = (gfchead_t*)headerArg;
+	for (i=0; i<len && parser->state != PARSE_DONE && parser->state != PARSE_ERROR; ++i)
+	{
+		ch = data[i];
+		if (++parser->headerLen > HEADERSIZE)
+		{
+			parser->state = PARSE_ERROR;
+			break;
+		}
 
-	// initialize to default invalid case
-	head->fileLenBytes   = 0;
-	head->responseStatus = GF_INVALID;	
+		switch (parser->state)
+		{
+		case PARSE_CMD:
+			if (ch != RSP_CMD[parser->pos])
+			{
+				parser->state = PARSE_ERROR;
+			}
+			else if (++parser->pos == RSP_CMD_LEN)
+			{
+				parser->state      = PARSE_STATUS;
+				parser->pos        = 0;
+				parser->candidates = (1u << STAT_TABLE_LEN) - 1;
+			}
+			break;
 
-	// "GETFILE"
-	curStr = strtok( buffer, key );
-	if (curStr == NULL)
-	{
-		return;
+		case PARSE_STATUS:
+			if (ch == ' ' || ch == '\r')
+			{
+				// the status is the candidate that ends right here
+				for (k=0; k<STAT_TABLE_LEN; ++k)
+				{
+					if ( (parser->candidates & (1u << k)) && STAT_TABLE[k].str[parser->pos] == 0 )
+						break;
+				}
+				if (k == STAT_TABLE_LEN || (STAT_TABLE[k].status == GF_OK && ch == '\r'))
+				{
+					parser->state = PARSE_ERROR;
+					break;
+				}
+				head->responseStatus = STAT_TABLE[k].status;
+				parser->pos = (ch == '\r') ? 1 : 0;
+				if (ch == '\r')
+					parser->state = PARSE_END;
+				else
+					parser->state = (head->responseStatus == GF_OK) ? PARSE_LENGTH : PARSE_TOKEN;
+				parser->candidates  = 1;
+				parser->tokenDigits = TRUE;
+				break;
+			}
+			for (k=0; k<STAT_TABLE_LEN; ++k)
+			{
+				// NOTE: a candidate that already ended can't match, not even a NUL byte
+				if ( (parser->candidates & (1u << k)) && (STAT_TABLE[k].str[parser->pos] == 0 || STAT_TABLE[k].str[parser->pos] != ch) )
+					parser->candidates &= ~(1u << k);
+			}
+			if (parser->candidates == 0)
+				parser->state = PARSE_ERROR;
+			++parser->pos;
+			break;
+
+		case PARSE_LENGTH:
+			if (ch >= '0' && ch <= '9')
+			{
+				if ( parser->value > (UINT64_MAX - (ch - '0')) / 10 )
+				{
+					parser->state = PARSE_ERROR;
+					break;
+				}
+				parser->value = parser->value*10 + (ch - '0');
+				++parser->numDigits;
+			}
+			else if ( (ch == ' ' || ch == '\r') && parser->numDigits > 0 )
+			{
+				head->fileLenBytes = parser->value;
+				parser->pos   = (ch == '\r') ? 1 : 0;
+				parser->state = (ch == '\r') ? PARSE_END : PARSE_TOKEN;
+				parser->candidates  = 1;
+				parser->tokenDigits = TRUE;
+				parser->value       = 0;
+			}
+			else
+			{
+				parser->state = PARSE_ERROR;
+			}
+			break;
+
+		case PARSE_TOKEN:
+			// a token matches "KEEPALIVE" as long as candidates is set; the first two number 
+			// tokens describe a range; unknown tokens are skipped
+			if (ch == ' ' || ch == '\r')
+			{
+				if (parser->candidates != 0 && parser->pos == KEEPALIVE_LEN - 1)
+				{
+					head->keepAlive = TRUE;
+				}
+				else if (parser->tokenDigits == TRUE && parser->pos > 0 && parser->numRange < 2)
+				{
+					if (parser->numRange++ == 0)
+						head->rangeOffset = parser->value;
+					else
+						head->totalLenBytes = parser->value;
+				}
+				parser->candidates  = 1;
+				parser->tokenDigits = TRUE;
+				parser->value       = 0;
+				parser->pos   = (ch == '\r') ? 1 : 0;
+				parser->state = (ch == '\r') ? PARSE_END : PARSE_TOKEN;
+				break;
+			}
+			if (parser->pos >= KEEPALIVE_LEN - 1 || KEEPALIVE[parser->pos + 1] != ch)
+				parser->candidates = 0;
+			if (ch < '0' || ch > '9' || parser->value > (UINT64_MAX - (ch - '0')) / 10)
+				parser->tokenDigits = FALSE;
+			else
+				parser->value = parser->value*10 + (ch - '0');
+			++parser->pos;
+			break;
+
+		case PARSE_END:
+			if (ch != HEAD_END[parser->pos])
+			{
+				parser->state = PARSE_ERROR;
+			}
+			else if (++parser->pos == HEAD_END_LEN)
+			{
+				parser->state = PARSE_DONE;
+				// the body is the whole file, unless the server said otherwise
+				if (parser->numRange < 2)
+				{
+					head->rangeOffset   = 0;
+					head->totalLenBytes = head->fileLenBytes;
+				}
+			}
+			break;
+		}
 	}
 
-	// <status>
-	curStr = strtok( NULL, key );
-	if (curStr == NULL)
+	if (parser->state == PARSE_ERROR)
 	{
-		return;
-	}	
+		head->responseStatus = GF_INVALID;
+	}
+
+	return i;
+}
+
+
+//----------- gfc_perform ---------//
+// NOTE: with keep-alive enabled, an idle connection to the same server is reused when 
+// available. If the server already closed it, the request is retried once on a new connection.
+int gfc_perform(gfcrequest_t *gfr)
+{
+	return gfc_pipeline(&gfr, 1);
+}
+
 
-	// determine the status type
-	if ( strcmp(curStr, STAT_OK) == 0 )
+//----------- gfc_perform_batch ---------//
+// performs count requests to the same server over one persistent connection, writing up to 
+// PIPELINE_DEPTH requests back-to-back and consuming the responses in order. 
+// Returns -1 if any request failed, check each request's status for details.
+int gfc_perform_batch(gfcrequest_t **gfrs, int count)
+{
+	int i = 0;
+
+	for (i=0; i<count; ++i)
 	{
-		head->responseStatus = GF_OK;
+		gfrs[i]->keepAlive = TRUE;
 	}
-	else if ( strcmp(curStr, STAT_FILE) == 0 )
+
+	return gfc_pipeline(gfrs, count);
+}
+
+
+//----------- gfc_connect ---------//
+// reuses an idle keep-alive connection when allowed, otherwise opens a new one
+static int gfc_connect(gfcrequest_t *gfr, BOOL* reused)
+{
+	int socketFD = -1;
+
+	*reused = FALSE;
+	if (gfr->keepAlive == TRUE)
 	{
-		head->responseStatus = GF_FILE_NOT_FOUND;
-		return;
+		socketFD = gfc_poolGet(gfr);
+		if (socketFD >= 0)
+		{
+			*reused = TRUE;
+			return socketFD;
+		}
 	}
-	else if ( strcmp(curStr, STAT_ERROR) == 0 )
+
+	return gfc_SetUpTCPConnection(gfr);
+}
+
+
+//----------- gfc_pipeline ---------//
+// NOTE: requests only queue up behind each other when keep-alive is enabled for them. 
+// When the server does not keep the connection open, the requests it will never answer 
+// are sent again on a new connection; a failed request is given up, and the ones behind 
+// it are retried on a new connection.
+static int gfc_pipeline(gfcrequest_t **gfrs, int count)
+{
+	int  done   = 0;			// responses received
+	int  sent   = 0;			// requests sent on the current connection
+	int  failed = 0;
+	int  status = XFER_OK;
+	int  socketFD;
+	BOOL reused;
+	BOOL retried = FALSE;
+	gfc_rxbuf_t rx;
+	char rxData[BUFFSIZE];		// per call, requests may be performed from several threads at once
+
+	while (done < count)
 	{
-		head->responseStatus = GF_ERROR;
-		return;
+		// a request whose path didn't fit is never sent
+		if (gfrs[done]->pathLen >= PATHSIZE)
+		{
+			gfrs[done]->head.responseStatus = GF_INVALID;
+			++failed;
+			++done;
+			continue;
+		}
+
+		socketFD = gfc_connect(gfrs[done], &reused);
+		if (socketFD < 0)
+		{
+			failed += count - done;
+			break;
+		}
+
+		rx.data  = &rxData[0];
+		rx.start = 0;
+		rx.len   = 0;
+		sent     = done;
+		status   = XFER_OK;
+		while (done < count)
+		{
+			if (sent == done && gfrs[done]->pathLen >= PATHSIZE)
+			{
+				gfrs[done]->head.responseStatus = GF_INVALID;
+				++failed;
+				++done;
+				++sent;
+				continue;
+			}
+
+			// keep the pipeline full, up to a request that can't be sent
+			while ( sent < count && gfrs[sent]->pathLen < PATHSIZE && ( sent == done || 
+					( sent - done < PIPELINE_DEPTH && gfrs[sent]->keepAlive == TRUE && gfrs[sent - 1]->keepAlive == TRUE ) ) )
+			{
+				if (gfc_sendHeader(gfrs[sent], socketFD) < 0)
+					break;
+				++sent;
+			}
+			if (sent == done)
+			{
+				status = XFER_CLOSED;
+				break;
+			}
+
+			status = gfc_receiveResponse(gfrs[done], socketFD, &rx);
+			if (status != XFER_OK)
+				break;
+			++done;
+
+			// the server closes the connection after this response
+			if (gfrs[done - 1]->head.keepAlive == FALSE)
+				break;
+		}
+
+		// keep the connection only if the server agreed and everything sent on it was consumed
+		if ( status == XFER_OK && done > 0 && gfrs[done - 1]->keepAlive == TRUE && 
+			 gfrs[done - 1]->head.keepAlive == TRUE && sent == done && rx.len == 0 )
+			gfc_poolPut(gfrs[done - 1], socketFD);
+		else
+			close(socketFD);
+
+		if (status == XFER_CLOSED && reused == TRUE && retried == FALSE)
+		{
+			// stale pooled connection, try again on a new one
+			retried = TRUE;
+			continue;
+		}
+		if (status != XFER_OK)
+		{
+			++failed;
+			++done;
+		}
 	}
-	else
+
+	return (failed > 0) ? -1 : 0;
+}
+
+
+//----------- gfc_receiveResponse ---------//
+// receives one response; bytes beyond its body stay in rx for the next response
+static int gfc_receiveResponse(gfcrequest_t *gfr, int socketFD, gfc_rxbuf_t* rx)
+{
+	int64_t  moved     = 0;
+	int  curRxSize = 0;
+	int  status    = XFER_MORE;
+	BOOL anyByte   = FALSE;		// any byte of this response received
+	BOOL useSplice = gfr->useWriteFD;
+
+	gfr->rxBytes = 0;
+	gfc_parserInit(&gfr->parser, &gfr->head);
+
+	// receive the response in chunks
+	while(1)
 	{
-		return;
+		// header done and nothing buffered: the rest of the body goes socket -> pipe -> file
+		if (rx->len == 0 && useSplice == TRUE && gfr->parser.state == PARSE_DONE)
+		{
+			moved = gfc_spliceBody(gfr, socketFD, gfr->rxBytes, gfr->head.fileLenBytes - gfr->rxBytes);
+			if (moved < 0)
+			{
+				// not spliceable, receive it into the buffer instead
+				useSplice = FALSE;
+				continue;
+			}
+			gfr->rxBytes += moved;
+			return (gfr->rxBytes >= gfr->head.fileLenBytes) ? XFER_OK : XFER_FAILED;
+		}
+
+		if (rx->len == 0)
+		{
+			rx->start = 0;
+			curRxSize = recv( socketFD, rx->data, BUFFSIZE, 0 );  
+			if (curRxSize < 0)
+			{
+				if (anyByte == FALSE && (errno == ECONNRESET || errno == EPIPE))
+					return XFER_CLOSED;
+				fprintf(stderr, "%s @ %d: file recv()failed with %d\n", __FILE__, __LINE__, curRxSize);    
+				gfr->head.responseStatus = GF_INVALID;
+				return XFER_FAILED;
+			}		
+			else if (curRxSize == 0)
+			{
+				if (gfr->parser.state != PARSE_DONE)
+					gfr->head.responseStatus = GF_INVALID;
+				return (anyByte == FALSE) ? XFER_CLOSED : XFER_FAILED;
+			}		
+			rx->len = curRxSize;
+		}
+		anyByte = TRUE;
+
+		status = gfc_consumeRx(gfr, rx);
+		if (status != XFER_MORE)
+			return status;
 	}
+}
+
+
+//----------- gfc_consumeRx ---------//
+// feeds received bytes to the header parser, then the body to the writer. Bytes past the 
+// end of the body are left in rx. Returns XFER_OK once the response is complete, 
+// XFER_MORE while it needs more bytes
+static int gfc_consumeRx(gfcrequest_t* gfr, gfc_rxbuf_t* rx)
+{
+	uint64_t chunk = 0;
+	int      used  = 0;
 
-	// get the file length
-	curStr = strtok( NULL, key );
-	if (curStr == NULL)
+	// feed the header parser until the header is complete
+	if ( gfr->parser.state != PARSE_DONE )
 	{
-		head->responseStatus = GF_INVALID;	
-		return;
+		used = gfc_parseRxHeader(&gfr->parser, &gfr->head, &rx->data[rx->start], rx->len);
+		if (gfr->parser.state == PARSE_ERROR)
+		{
+			fprintf(stderr, "%s @ %d: invalid response\n", __FILE__, __LINE__); 
+			return XFER_FAILED;
+		}
+		if (gfr->headerFunc != NULL)
+		{
+			gfr->headerFunc( &rx->data[rx->start], used, gfr->headerArg );
+		}
+		rx->start += used;
+		rx->len   -= used;
+		if (gfr->parser.state != PARSE_DONE)
+			return XFER_MORE;
 	}	
 
-	head->fileLenBytes = atoi(curStr);
+	// never hand bytes past the end of the body to the writer
+	chunk = rx->len;
+	if (chunk > gfr->head.fileLenBytes - gfr->rxBytes)
+	{
+		chunk = gfr->head.fileLenBytes - gfr->rxBytes;
+	}
+
+	// write Rx data to a file
+	if (chunk > 0 && gfr->useWriteFD == TRUE)
+	{
+		if (gfc_writeBody(gfr, &rx->data[rx->start], chunk, gfr->rxBytes) < 0)
+			return XFER_FAILED;
+	}
+	else if (chunk > 0)
+	{
+		gfr->writeFunc( &rx->data[rx->start], chunk, gfr->writeFile );
+	}
+	rx->start += chunk;
+	rx->len   -= chunk;
+	gfr->rxBytes += chunk;
+
+	return (gfr->rxBytes >= gfr->head.fileLenBytes) ? XFER_OK : XFER_MORE;
 }
 
 
-//----------- gfc_perform ---------//
-int gfc_perform(gfcrequest_t *gfr)
+//----------- gfc_writeBody ---------//
+// writes body bytes received into the buffer to writeFD, pos bytes into the body
+static int gfc_writeBody(gfcrequest_t* gfr, char* data, size_t len, uint64_t pos)
 {
-	BOOL gotHeader = FALSE;	
-	BOOL rxFailed  = FALSE;
+	ssize_t written;
 
-	// set the callback details for response header parsing
-	gfc_set_headerfunc(gfr, gfc_parseRxHeader);
-	gfc_set_headerarg(gfr, (void*)&headStruct);
+	while (len > 0)
+	{
+		written = pwrite(gfr->writeFD, data, len, gfr->writeOffset + pos);
+		if (written < 0 && errno == EINTR)
+			continue;
+		if (written <= 0)
+		{
+			fprintf(stderr, "%s @ %d: pwrite() failed\n", __FILE__, __LINE__);
+			return -1;
+		}
+		data += written;
+		len  -= written;
+		pos  += written;
+	}
 
-	// connection setup
-	int socketFD =  gfc_SetUpTCPConnection(gfr);
-   if (socketFD < 0)
-   {
-	   return -1;
-   }
+	return 0;
+}
 
-	// send the request
-	gfc_sendHeader(gfr, socketFD);
 
-	// receive the response in chunks
-	char* buffPtr = &dataBuffer[0];
-	int curRxSize = 0;
-	int totalSize = 0;
-	while(1)
+//----------- gfc_spliceBody ---------//
+// NOTE: moves up to len body bytes from the socket into writeFD through a pipe, without 
+// copying them through user space. Never reads past the body, a pipelined response 
+// behind it stays in the socket. Returns the bytes moved, short if the connection or 
+// the write failed, or -1 if splice() doesn't work for these descriptors at all.
+static int64_t gfc_spliceBody(gfcrequest_t* gfr, int socketFD, uint64_t pos, uint64_t len)
+{
+	int pipeFD[2];
+	loff_t  offset = gfr->writeOffset + pos;
+	uint64_t moved = 0;
+	ssize_t inPipe, out;
+
+	if (len == 0)
 	{
-		buffPtr = &dataBuffer[0];
-		curRxSize = recv( socketFD, buffPtr, BUFFSIZE, 0 );  
-		printf("rx: %d ", curRxSize);
-	  	if (curRxSize < 0)
-    	{
-      	fprintf(stderr, "%s @ %d: file recv()failed with %d\n", __FILE__, __LINE__, curRxSize);    
-			gfr->gfcHead->responseStatus = GF_INVALID;
-			rxFailed = TRUE;
-			break;
-		}		
-		else if (curRxSize == 0)
+		return 0;
+	}
+	if (pipe2(pipeFD, O_CLOEXEC) < 0)
+	{
+		return -1;
+	}
+	fcntl(pipeFD[1], F_SETPIPE_SZ, SPLICE_PIPESIZE);
+
+	while (moved < len)
+	{
+		inPipe = splice(socketFD, NULL, pipeFD[1], NULL, 
+						(len - moved < SPLICE_MAX) ? len - moved : SPLICE_MAX, SPLICE_F_MOVE | SPLICE_F_MORE);
+		if (inPipe < 0 && errno == EINTR)
+			continue;
+		if (inPipe < 0 && errno == EINVAL && moved == 0)
 		{
-			rxFailed = TRUE;
+			close(pipeFD[0]);
+			close(pipeFD[1]);
+			return -1;
+		}
+		if (inPipe <= 0)
 			break;
-		}		
 
-		// check for the header
-		if ( gotHeader == FALSE)
+		// drain the pipe into the file
+		while (inPipe > 0)
 		{
-			curRxSize = gfc_extractHeader(gfr, buffPtr, curRxSize );
-			if (gfr->gfcHead->responseStatus == GF_INVALID)
+			out = splice(pipeFD[0], NULL, gfr->writeFD, &offset, inPipe, SPLICE_F_MOVE);
+			if (out < 0 && errno == EINTR)
+				continue;
+			if (out <= 0)
 			{
-				fprintf(stderr, "%s @ %d: invalid response\n", __FILE__, __LINE__); 
-				rxFailed = TRUE;  
-				break;
+				fprintf(stderr, "%s @ %d: splice() to the file failed\n", __FILE__, __LINE__);
+				close(pipeFD[0]);
+				close(pipeFD[1]);
+				return moved;
 			}
-			buffPtr += gfr->headerLen;
-			gotHeader = TRUE;
-		}	
+			inPipe -= out;
+			moved  += out;
+		}
+	}
+
+	close(pipeFD[0]);
+	close(pipeFD[1]);
+
+	return moved;
+}
+
+
+//----------- gfc_multi_create ---------//
+// returns NULL if the event loop can't be set up
+gfc_multi_t* gfc_multi_create()
+{
+	gfc_multi_t* multi = calloc( 1, sizeof(gfc_multi_t) );
+
+	if (multi == NULL)
+	{
+		fprintf(stderr, "%s @ %d: calloc() failed\n", __FILE__, __LINE__);
+		return NULL;
+	}
+	multi->epollFD = epoll_create1(EPOLL_CLOEXEC);
+	if (multi->epollFD < 0)
+	{
+		fprintf(stderr, "%s @ %d: epoll_create1() failed\n", __FILE__, __LINE__);
+		free(multi);
+		return NULL;
+	}
+
+	return multi;
+}
 
-		// write Rx data to a file
-		gfr->writeFunc( buffPtr, curRxSize, gfr->writeFile );
 
-		totalSize += curRxSize;
-		if (totalSize >= gfr->gfcHead->fileLenBytes)
+//----------- gfc_multi_cleanup ---------//
+// NOTE: requests still running are abandoned, their connections closed. The handles 
+// themselves stay with the caller, as do finished ones not taken by gfc_multi_next.
+void gfc_multi_cleanup(gfc_multi_t* multi)
+{
+	gfcrequest_t* gfr = multi->running;
+
+	while (gfr != NULL)
+	{
+		close(gfr->async.sockFD);
+		gfr->async.state = MULTI_IDLE;
+		gfr = gfr->next;
+	}
+	close(multi->epollFD);
+	free(multi);
+}
+
+
+//----------- gfc_multi_add ---------//
+// NOTE: starts the request in the event loop; it makes progress in gfc_multi_perform 
+// and calls its header and write callbacks from there. The request is handed back by 
+// gfc_multi_next once done, with arg. Returns -1 if it failed right away, it is still 
+// handed back then.
+int gfc_multi_add(gfc_multi_t* multi, gfcrequest_t* gfr, void* arg)
+{
+	gfr->async.arg     = arg;
+	gfr->async.retried = FALSE;
+	gfr->async.prev    = NULL;
+	gfr->next          = multi->running;
+	if (multi->running != NULL)
+		multi->running->async.prev = gfr;
+	multi->running = gfr;
+	multi->numRunning++;
+
+	return gfc_multiStart(multi, gfr, TRUE);
+}
+
+
+//----------- gfc_multi_perform ---------//
+// waits up to timeoutMs (-1 forever) for the connections to be ready and moves the 
+// requests along. Returns the number of requests still running, -1 if epoll failed
+int gfc_multi_perform(gfc_multi_t* multi, int timeoutMs)
+{
+	struct epoll_event events[MULTI_EVENTS];
+	gfcrequest_t* gfr;
+	int numEvents = 0;
+	int i = 0;
+
+	if (multi->numRunning == 0 && timeoutMs < 0)
+		return 0;
+
+	numEvents = epoll_wait(multi->epollFD, events, MULTI_EVENTS, timeoutMs);
+	if (numEvents < 0)
+	{
+		if (errno == EINTR)
+			return multi->numRunning;
+		fprintf(stderr, "%s @ %d: epoll_wait() failed\n", __FILE__, __LINE__);
+		return -1;
+	}
+
+	for (i=0; i<numEvents; ++i)
+	{
+		gfr = (gfcrequest_t*)events[i].data.ptr;
+		if (gfr->async.state == MULTI_SEND)
+			gfc_multiSend(multi, gfr);
+		else if (gfr->async.state == MULTI_RECV)
+			gfc_multiRecv(multi, gfr);
+	}
+
+	return multi->numRunning;
+}
+
+
+//----------- gfc_multi_next ---------//
+// takes the next finished request, NULL if there is none. result is 0 or -1 as 
+// gfc_perform would have returned, arg what the request was added with.
+gfcrequest_t* gfc_multi_next(gfc_multi_t* multi, int* result, void** arg)
+{
+	gfcrequest_t* gfr = multi->doneHead;
+
+	if (gfr == NULL)
+		return NULL;
+
+	multi->doneHead = gfr->next;
+	if (multi->doneHead == NULL)
+		multi->doneTail = NULL;
+	gfr->next        = NULL;
+	gfr->async.state = MULTI_IDLE;
+	if (result != NULL)
+		*result = gfr->async.result;
+	if (arg != NULL)
+		*arg = gfr->async.arg;
+
+	return gfr;
+}
+
+
+//----------- gfc_multiStart ---------//
+// puts the request on a pooled connection, or a new one that is still connecting.
+// Returns -1 if that failed, the request is done then
+static int gfc_multiStart(gfc_multi_t* multi, gfcrequest_t* gfr, BOOL mayReuse)
+{
+	int socketFD = -1;
+
+	gfr->rxBytes       = 0;
+	gfc_parserInit(&gfr->parser, &gfr->head);
+	gfr->async.state   = MULTI_SEND;
+	gfr->async.txSent  = 0;
+	gfr->async.anyByte = FALSE;
+	gfr->async.reused  = FALSE;
+	gfr->async.attempt = 0;
+
+	if (gfr->pathLen >= PATHSIZE)
+	{
+		return gfc_multiWatch(multi, gfr, -1);
+	}
+	if (mayReuse == TRUE && gfr->keepAlive == TRUE)
+	{
+		socketFD = gfc_poolGet(gfr);
+	}
+	if (socketFD >= 0)
+	{
+		// pooled connections are blocking for gfc_perform
+		gfr->async.reused = TRUE;
+		fcntl(socketFD, F_SETFL, fcntl(socketFD, F_GETFL) | O_NONBLOCK);
+	}
+	else
+	{
+		socketFD = gfc_multiConnect(gfr);
+	}
+
+	return gfc_multiWatch(multi, gfr, socketFD);
+}
+
+
+//----------- gfc_multiConnect ---------//
+// NOTE: begins a non-blocking connect to the next of the server's addresses, counting 
+// async.attempt from the preferred one, and tries them one after the other as they fail. 
+// Until an address is known to work, the first connect races them with Happy Eyeballs 
+// instead, blocking the loop for a moment, so that a dead address isn't waited out by 
+// every request in the loop.
+// Returns -1 once no address is left
+static int gfc_multiConnect(gfcrequest_t* gfr)
+{
+	gfc_resolved_t* resolved = gfc_resolve(gfr);
+	int socketFD = -1;
+
+	if (resolved == NULL)
+	{
+		return -1;
+	}
+
+	if (resolved->confirmed == FALSE && gfr->async.attempt == 0)
+	{
+		socketFD = gfc_SetUpTCPConnection(gfr);
+		if (socketFD >= 0)
 		{
-			break;
-		}		
+			gfr->async.addrIdx = resolved->preferred;
+			fcntl(socketFD, F_SETFL, fcntl(socketFD, F_GETFL) | O_NONBLOCK);
+		}
+		return socketFD;
 	}
 
-	close (socketFD);
-	gfr->rxBytes = totalSize;
+	for ( ; gfr->async.attempt < resolved->numAddrs; gfr->async.attempt++)
+	{
+		gfr->async.addrIdx = (resolved->preferred + gfr->async.attempt) % resolved->numAddrs;
+		socketFD = gfc_connectStart(resolved, gfr->async.addrIdx, gfr->port);
+		if (socketFD >= 0)
+			return socketFD;
+	}
+
+	fprintf(stderr, "%s @ %d: connect() failed\n", __FILE__, __LINE__);
+	resolved->expires = 0;		// look the server up again next time
+
+	return -1;
+}
+
+
+//----------- gfc_multiWatch ---------//
+// hands the request's connection to epoll. Returns -1 if there is none, the request is done then
+static int gfc_multiWatch(gfc_multi_t* multi, gfcrequest_t* gfr, int socketFD)
+{
+	struct epoll_event event;
 
-	if (rxFailed == TRUE)
+	gfr->async.sockFD = socketFD;
+	if (socketFD < 0)
+	{
+		gfc_multiDone(multi, gfr, -1, FALSE);
 		return -1;
+	}
 
-   return 0;
+	// writable once connected
+	event.events   = EPOLLOUT;
+	event.data.ptr = gfr;
+	if (epoll_ctl(multi->epollFD, EPOLL_CTL_ADD, socketFD, &event) < 0)
+	{
+		fprintf(stderr, "%s @ %d: epoll_ctl() failed\n", __FILE__, __LINE__);
+		gfc_multiDone(multi, gfr, -1, FALSE);
+		return -1;
+	}
+
+	return 0;
 }
 
 
-//-------------- gfc_extractHeader --------------//
-static int gfc_extractHeader(gfcrequest_t *gfr, char* buffPtr, int rxSize)
+//----------- gfc_multiRetry ---------//
+// the pooled connection had been closed by the server, start over once on a new one
+static void gfc_multiRetry(gfc_multi_t* multi, gfcrequest_t* gfr)
 {
-	for (int i=0; i<rxSize; ++i)
+	epoll_ctl(multi->epollFD, EPOLL_CTL_DEL, gfr->async.sockFD, NULL);
+	close(gfr->async.sockFD);
+	gfr->async.retried = TRUE;
+	gfc_multiStart(multi, gfr, FALSE);
+}
+
+
+//----------- gfc_multiSend ---------//
+// the connection is writable: the connect finished, or there is room for more of the request
+static void gfc_multiSend(gfc_multi_t* multi, gfcrequest_t* gfr)
+{
+	struct epoll_event event;
+	gfc_resolved_t* resolved;
+	char reqHeader[REQHEADERSIZE];
+	int  headLen = 0;
+	int  sent    = 0;
+	int  err     = 0;
+	socklen_t errLen = sizeof(err);
+
+	// the connect is over: on to the next address if it failed, else remember the one that works
+	if (gfr->async.txSent == 0 && gfr->async.reused == FALSE)
 	{
-		if (buffPtr[i] == '\r')
+		resolved = gfc_resolve(gfr);
+		if (getsockopt(gfr->async.sockFD, SOL_SOCKET, SO_ERROR, &err, &errLen) < 0 || err != 0)
 		{
-			gfr->headerLen = i + HEAD_END_LEN;
-			break;
+			if (resolved != NULL)
+				resolved->confirmed = FALSE;
+			epoll_ctl(multi->epollFD, EPOLL_CTL_DEL, gfr->async.sockFD, NULL);
+			close(gfr->async.sockFD);
+			gfr->async.attempt++;
+			gfc_multiWatch(multi, gfr, gfc_multiConnect(gfr));
+			return;
+		}
+		if (resolved != NULL && gfr->async.addrIdx < resolved->numAddrs)
+		{
+			resolved->preferred = gfr->async.addrIdx;
+			resolved->confirmed = TRUE;
+		}
+	}
+
+	headLen = gfc_buildHeader(gfr, reqHeader);
+	sent = send(gfr->async.sockFD, &reqHeader[gfr->async.txSent], headLen - gfr->async.txSent, MSG_NOSIGNAL);
+	if (sent < 0 && (errno == EAGAIN || errno == EINTR))
+	{
+		return;
+	}
+	if (sent < 0)
+	{
+		if (gfr->async.reused == TRUE && gfr->async.retried == FALSE)
+			gfc_multiRetry(multi, gfr);
+		else
+			gfc_multiDone(multi, gfr, -1, FALSE);
+		return;
+	}
+	gfr->async.txSent += sent;
+	if (gfr->async.txSent < headLen)
+	{
+		return;
+	}
+
+	// all sent, wait for the response
+	gfr->async.state = MULTI_RECV;
+	event.events   = EPOLLIN;
+	event.data.ptr = gfr;
+	if (epoll_ctl(multi->epollFD, EPOLL_CTL_MOD, gfr->async.sockFD, &event) < 0)
+	{
+		fprintf(stderr, "%s @ %d: epoll_ctl() failed\n", __FILE__, __LINE__);
+		gfc_multiDone(multi, gfr, -1, FALSE);
+	}
+}
+
+
+//----------- gfc_multiRecv ---------//
+// the connection is readable: takes one buffer of the response
+static void gfc_multiRecv(gfc_multi_t* multi, gfcrequest_t* gfr)
+{
+	gfc_rxbuf_t rx;
+	int curRxSize = 0;
+	int status    = XFER_MORE;
+
+	curRxSize = recv( gfr->async.sockFD, multi->rxData, MULTI_RXSIZE, 0 );
+	if (curRxSize < 0 && (errno == EAGAIN || errno == EINTR))
+	{
+		return;
+	}
+	if (curRxSize <= 0)
+	{
+		// closed before the response started: a stale pooled connection
+		if ( gfr->async.anyByte == FALSE && gfr->async.reused == TRUE && gfr->async.retried == FALSE && 
+			 (curRxSize == 0 || errno == ECONNRESET || errno == EPIPE) )
+		{
+			gfc_multiRetry(multi, gfr);
+			return;
+		}
+		if (curRxSize < 0)
+			fprintf(stderr, "%s @ %d: file recv()failed with %d\n", __FILE__, __LINE__, curRxSize);    
+		if (gfr->parser.state != PARSE_DONE)
+			gfr->head.responseStatus = GF_INVALID;
+		gfc_multiDone(multi, gfr, -1, FALSE);
+		return;
+	}
+	gfr->async.anyByte = TRUE;
+
+	rx.data  = multi->rxData;
+	rx.start = 0;
+	rx.len   = curRxSize;
+	status = gfc_consumeRx(gfr, &rx);
+	if (status == XFER_MORE)
+	{
+		return;
+	}
+
+	// keep the connection only if the server agreed and nothing followed the response
+	gfc_multiDone( multi, gfr, (status == XFER_OK) ? 0 : -1, 
+				   status == XFER_OK && gfr->keepAlive == TRUE && gfr->head.keepAlive == TRUE && rx.len == 0 );
+}
+
+
+//----------- gfc_multiDone ---------//
+// takes the request out of the event loop and queues it for gfc_multi_next
+static void gfc_multiDone(gfc_multi_t* multi, gfcrequest_t* gfr, int result, BOOL keep)
+{
+	int socketFD = gfr->async.sockFD;
+
+	if (socketFD >= 0)
+	{
+		epoll_ctl(multi->epollFD, EPOLL_CTL_DEL, socketFD, NULL);
+		if (keep == TRUE)
+		{
+			fcntl(socketFD, F_SETFL, fcntl(socketFD, F_GETFL) & ~O_NONBLOCK);
+			gfc_poolPut(gfr, socketFD);
+		}
+		else
+		{
+			close(socketFD);
 		}
 	}
-	// get the header
-	memcpy(gfr->header, buffPtr, gfr->headerLen);
-	// parse the received header
-	gfr->headerFunc( gfr->header, gfr->headerLen, gfr->gfcHead );
-	
-	rxSize  -= gfr->headerLen;
+	gfr->async.sockFD = -1;
+	gfr->async.state  = MULTI_DONE;
+	gfr->async.result = result;
 
-	return rxSize;
+	// off the running list
+	if (gfr->async.prev != NULL)
+		gfr->async.prev->next = gfr->next;
+	else
+		multi->running = gfr->next;
+	if (gfr->next != NULL)
+		gfr->next->async.prev = gfr->async.prev;
+	multi->numRunning--;
+
+	// onto the done list
+	gfr->next = NULL;
+	if (multi->doneTail != NULL)
+		multi->doneTail->next = gfr;
+	else
+		multi->doneHead = gfr;
+	multi->doneTail = gfr;
 }
 
 
@@ -343,23 +1615,46 @@ static int gfc_extractHeader(gfcrequest_t *gfr, char* buffPtr, int rxSize)
 // assigns the 3rd argument of the header callback function
 void gfc_set_headerarg(gfcrequest_t *gfr, void *headerarg)
 {
-	gfr->gfcHead = headerarg;
+	gfr->headerArg = headerarg;
 }
 
 
 //----------- gfc_set_headerfunc ---------//
-// assigns the header callback function to use
+// assigns the header callback function to use; it receives the raw response header, 
+// possibly in several pieces, as it arrives
 void gfc_set_headerfunc(gfcrequest_t *gfr, void (*headerfunc)(void*, size_t, void *))
 {
 	gfr->headerFunc = headerfunc;
 }
 
 
+//----------- gfc_set_range ---------//
+// requests len bytes of the file, starting at offset; the server clamps the range to the file
+void gfc_set_range(gfcrequest_t *gfr, size_t offset, size_t len)
+{
+	gfr->hasRange    = TRUE;
+	gfr->rangeOffset = offset;
+	gfr->rangeLen    = len;
+}
+
+
+//----------- gfc_set_keepalive ---------//
+// asks the server to keep the connection open, so later requests to the same server reuse it
+void gfc_set_keepalive(gfcrequest_t *gfr, int keepAlive)
+{
+	gfr->keepAlive = (keepAlive != 0) ? TRUE : FALSE;
+}
+
+
 //----------- gfc_set_path ---------//
+// NOTE: a path of PATHSIZE chars or more isn't kept, performing the request fails
 void gfc_set_path(gfcrequest_t *gfr, char* path)
 {
-	strcpy(gfr->reqPath, path);
-	gfr->pathLen = strlen(gfr->reqPath);
+	gfr->pathLen = strlen(path);
+	if (gfr->pathLen < PATHSIZE)
+		memcpy(gfr->reqPath, path, gfr->pathLen + 1);
+	else
+		gfr->reqPath[0] = '\0';
 }
 
 
@@ -377,6 +1672,18 @@ void gfc_set_server(gfcrequest_t *gfr, char* server)
 }
 
 
+//----------- gfc_set_writefd ---------//
+// NOTE: the body is written to fd, starting at offset, instead of being handed to the 
+// write callback. Whatever isn't already buffered with the header is spliced from the 
+// socket into the file, never passing through user space.
+void gfc_set_writefd(gfcrequest_t *gfr, int fd, off_t offset)
+{
+	gfr->useWriteFD  = TRUE;
+	gfr->writeFD     = fd;
+	gfr->writeOffset = offset;
+}
+
+
 //----------- gfc_set_writearg ---------//
 void gfc_set_writearg(gfcrequest_t *gfr, void *writearg)
 {
@@ -0,0 +1,421 @@
+// Fuzz and throughput driver for the response header parser.
+// gfc_parseRxHeader is static, so the client library is compiled into this file:
+//   gcc -std=gnu11 -O2 -g -pthread -fsanitize=address,undefined -o parser_fuzz parser_fuzz.c
+#include "gfclient.c"
+
+#include <getopt.h>
+
+#define USAGE                                                                 \
+"usage:\n"                                                                    \
+"  parser_fuzz [options]\n"                                                   \
+"options:\n"                                                                  \
+"  -h                  Show this help message\n"                              \
+"  -n [iterations]     Generated headers to check (Default: 200000)\n"       \
+"  -s [seed]           Random seed (Default: time)\n"                         \
+"  -b [headers]        Throughput run over this many headers, 0 skips it (Default: 1000000)\n"
+
+/* OPTIONS DESCRIPTOR ====================================================== */
+static struct option gLongOptions[] =
+{
+  {"iterations",    required_argument,      NULL,           'n'},
+  {"seed",          required_argument,      NULL,           's'},
+  {"bench",         required_argument,      NULL,           'b'},
+  {"help",          no_argument,            NULL,           'h'},
+  {NULL,            0,                      NULL,             0}
+};
+
+#define FUZZ_BUFSIZE	(4 * HEADERSIZE)
+#define FUZZ_BODY		"\x01body bytes, never part of the header\r\n\r\n"
+#define NSEC_PER_SEC	1000000000ULL
+
+// a generated response and what the parser has to make of it
+typedef struct fuzz_case_t
+{
+	char		data[FUZZ_BUFSIZE];
+	int			len;
+	int			headerLen;			// bytes up to and including "\r\n\r\n", valid cases only
+	BOOL		valid;
+	gfchead_t	expect;
+} fuzz_case_t;
+
+// outcome of feeding one case to the parser
+typedef struct fuzz_result_t
+{
+	int			state;
+	int			consumed;
+	gfchead_t	head;
+} fuzz_result_t;
+
+static uint64_t gRand;
+
+
+//------------ Usage -------------//
+static void Usage()
+{
+	fprintf(stdout, "%s", USAGE);
+}
+
+//------------ NowNs -------------//
+static uint64_t NowNs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+//------------ Rand -------------//
+// xorshift64*, deterministic for a given seed
+static uint64_t Rand()
+{
+	gRand ^= gRand >> 12;
+	gRand ^= gRand << 25;
+	gRand ^= gRand >> 27;
+
+	return gRand * 2685821657736338717ULL;
+}
+
+//------------ RandBelow -------------//
+static int RandBelow( int n )
+{
+	return (int)(Rand() % (uint64_t)n);
+}
+
+//------------ RandNumber -------------//
+// lengths of every magnitude, including the edges of uint64_t
+static uint64_t RandNumber()
+{
+	switch (RandBelow(4))
+	{
+	case 0:
+		return RandBelow(10);
+	case 1:
+		return UINT64_MAX - RandBelow(3);
+	default:
+		return Rand() >> RandBelow(64);
+	}
+}
+
+//------------ GenValid -------------//
+// a well-formed header the server could send, followed by body bytes
+static void GenValid( fuzz_case_t* fc )
+{
+	static const char* extra[] = { "", " X-UNKNOWN", " KEEPALIVEX", " KEEP", " 12ab" };
+	const char* status;
+	int len = 0;
+
+	memset( &fc->expect, 0, sizeof(gfchead_t) );
+	fc->expect.responseStatus = (gfstatus_t)RandBelow(3);
+	status = (fc->expect.responseStatus == GF_OK) ? STAT_OK :
+			 (fc->expect.responseStatus == GF_FILE_NOT_FOUND) ? STAT_FILE : STAT_ERROR;
+	len = snprintf( fc->data, FUZZ_BUFSIZE, "%s%s", RSP_CMD, status );
+
+	if (fc->expect.responseStatus == GF_OK)
+	{
+		fc->expect.fileLenBytes = RandNumber();
+		len += snprintf( &fc->data[len], FUZZ_BUFSIZE - len, " %llu", (unsigned long long)fc->expect.fileLenBytes );
+		if ( RandBelow(2) )
+		{
+			fc->expect.rangeOffset   = RandNumber();
+			fc->expect.totalLenBytes = RandNumber();
+			len += snprintf( &fc->data[len], FUZZ_BUFSIZE - len, " %llu %llu",
+							 (unsigned long long)fc->expect.rangeOffset, (unsigned long long)fc->expect.totalLenBytes );
+		}
+		else
+		{
+			fc->expect.totalLenBytes = fc->expect.fileLenBytes;
+		}
+	}
+	// unknown tokens anywhere after the length are skipped
+	len += snprintf( &fc->data[len], FUZZ_BUFSIZE - len, "%s", extra[RandBelow(5)] );
+	if ( RandBelow(2) )
+	{
+		fc->expect.keepAlive = TRUE;
+		len += snprintf( &fc->data[len], FUZZ_BUFSIZE - len, "%s", KEEPALIVE );
+	}
+	len += snprintf( &fc->data[len], FUZZ_BUFSIZE - len, "%s", HEAD_END );
+
+	fc->headerLen = len;
+	fc->valid     = (len <= HEADERSIZE);
+	len += snprintf( &fc->data[len], FUZZ_BUFSIZE - len, "%s", FUZZ_BODY );
+	fc->len = len;
+}
+
+//------------ Mutate -------------//
+// breaks a valid header: flipped, inserted, deleted or cut bytes,
+// a header longer than HEADERSIZE, or plain garbage
+static void Mutate( fuzz_case_t* fc )
+{
+	static const char alphabet[] = "GETFILOKNUDRAP 0123456789\r\n\x00\xff";
+	int i, n, pos;
+
+	fc->valid = FALSE;
+
+	switch (RandBelow(6))
+	{
+	case 0:		// flip bytes
+		for (n = 1 + RandBelow(3); n > 0; --n)
+		{
+			fc->data[RandBelow(fc->headerLen)] = alphabet[RandBelow(sizeof(alphabet) - 1)];
+		}
+		break;
+	case 1:		// insert a byte
+		pos = RandBelow(fc->headerLen);
+		memmove( &fc->data[pos + 1], &fc->data[pos], fc->len - pos );
+		fc->data[pos] = alphabet[RandBelow(sizeof(alphabet) - 1)];
+		++fc->len;
+		break;
+	case 2:		// delete a byte
+		pos = RandBelow(fc->headerLen);
+		memmove( &fc->data[pos], &fc->data[pos + 1], fc->len - pos - 1 );
+		--fc->len;
+		break;
+	case 3:		// cut the header short, the parser has to ask for more
+		fc->len = RandBelow(fc->headerLen);
+		break;
+	case 4:		// pad a token until the header is too long
+		pos = fc->headerLen - HEAD_END_LEN;
+		n   = HEADERSIZE - pos + 1 + RandBelow(16);
+		if (fc->len + n + 1 >= FUZZ_BUFSIZE)
+			n = FUZZ_BUFSIZE - fc->len - 2;
+		memmove( &fc->data[pos + n], &fc->data[pos], fc->len - pos );
+		fc->data[pos] = ' ';
+		memset( &fc->data[pos + 1], 'Z', n - 1 );
+		fc->len += n;
+		break;
+	default:	// garbage
+		fc->len = RandBelow(FUZZ_BUFSIZE);
+		for (i=0; i<fc->len; ++i)
+		{
+			fc->data[i] = (char)Rand();
+		}
+		break;
+	}
+}
+
+//------------ Feed -------------//
+// parses the case in chunks ending at the given split points, as recv() could deliver it
+static void Feed( fuzz_case_t* fc, const int* splits, int numSplits, fuzz_result_t* res )
+{
+	gfc_parser_t parser;
+	int start = 0;
+	int end   = 0;
+	int used  = 0;
+	int i     = 0;
+
+	gfc_parserInit( &parser, &res->head );
+	res->consumed = 0;
+
+	for (i=0; i<=numSplits && start < fc->len; ++i)
+	{
+		end  = (i < numSplits) ? splits[i] : fc->len;
+		used = gfc_parseRxHeader( &parser, &res->head, &fc->data[start], end - start );
+		res->consumed += used;
+		if (used < end - start || parser.state == PARSE_DONE || parser.state == PARSE_ERROR)
+			break;
+		start = end;
+	}
+	res->state = parser.state;
+}
+
+//------------ SameResult -------------//
+static int SameResult( fuzz_result_t* a, fuzz_result_t* b )
+{
+	return a->state == b->state && a->consumed == b->consumed &&
+		   a->head.responseStatus == b->head.responseStatus &&
+		   a->head.fileLenBytes == b->head.fileLenBytes && a->head.rangeOffset == b->head.rangeOffset &&
+		   a->head.totalLenBytes == b->head.totalLenBytes && a->head.keepAlive == b->head.keepAlive;
+}
+
+//------------ Report -------------//
+static void Report( const char* what, fuzz_case_t* fc, fuzz_result_t* res )
+{
+	int i;
+
+	fprintf(stderr, "%s @ %d: %s, state %d, consumed %d of %d, status %d, len %llu, range %llu/%llu, keepalive %d\n  ",
+			__FILE__, __LINE__, what, res->state, res->consumed, fc->len, res->head.responseStatus,
+			(unsigned long long)res->head.fileLenBytes, (unsigned long long)res->head.rangeOffset,
+			(unsigned long long)res->head.totalLenBytes, res->head.keepAlive);
+	for (i=0; i<fc->len && i<HEADERSIZE + 16; ++i)
+	{
+		fprintf(stderr, isprint((unsigned char)fc->data[i]) ? "%c" : "\\x%02x", (unsigned char)fc->data[i]);
+	}
+	fprintf(stderr, "\n");
+}
+
+//------------ CheckCase -------------//
+// parses the case in one piece, then at random split points and byte by byte;
+// every way of splitting has to give the same result. Returns 0 on a mismatch.
+static int CheckCase( fuzz_case_t* fc )
+{
+	fuzz_result_t whole, split;
+	int splits[FUZZ_BUFSIZE];
+	int numSplits = 0;
+	int i, pos;
+
+	Feed( fc, NULL, 0, &whole );
+
+	if (whole.consumed < 0 || whole.consumed > fc->len)
+	{
+		Report( "consumed out of bounds", fc, &whole );
+		return 0;
+	}
+	if (whole.state == PARSE_ERROR && whole.head.responseStatus != GF_INVALID)
+	{
+		Report( "malformed header not INVALID", fc, &whole );
+		return 0;
+	}
+	if (whole.state == PARSE_DONE && whole.consumed > HEADERSIZE)
+	{
+		Report( "header longer than HEADERSIZE accepted", fc, &whole );
+		return 0;
+	}
+	if (fc->valid)
+	{
+		if (whole.state != PARSE_DONE || whole.consumed != fc->headerLen ||
+			whole.head.responseStatus != fc->expect.responseStatus || whole.head.fileLenBytes != fc->expect.fileLenBytes ||
+			whole.head.rangeOffset != fc->expect.rangeOffset || whole.head.totalLenBytes != fc->expect.totalLenBytes ||
+			whole.head.keepAlive != fc->expect.keepAlive)
+		{
+			Report( "valid header misparsed", fc, &whole );
+			return 0;
+		}
+	}
+
+	// random, increasing split points
+	for (pos = 0; fc->len > 0; )
+	{
+		pos += 1 + RandBelow( 1 + fc->len / 4 );
+		if (pos >= fc->len)
+			break;
+		splits[numSplits++] = pos;
+	}
+	Feed( fc, splits, numSplits, &split );
+	if ( !SameResult(&whole, &split) )
+	{
+		Report( "random split changed the result", fc, &split );
+		return 0;
+	}
+
+	// one byte per call
+	for (i=1; i<fc->len; ++i)
+	{
+		splits[i - 1] = i;
+	}
+	Feed( fc, splits, fc->len > 0 ? fc->len - 1 : 0, &split );
+	if ( !SameResult(&whole, &split) )
+	{
+		Report( "byte by byte changed the result", fc, &split );
+		return 0;
+	}
+
+	return 1;
+}
+
+//------------ Bench -------------//
+// parses a typical keep-alive range response, whole and in 1-byte pieces
+static void Bench( long count )
+{
+	static const char header[] = "GETFILE OK 1048576 3145728 10485760 KEEPALIVE\r\n\r\n";
+	const int headerLen = sizeof(header) - 1;
+	gfc_parser_t parser;
+	gfchead_t    head;
+	uint64_t     started, ns;
+	uint64_t     check = 0;
+	long         n;
+	int          i;
+
+	started = NowNs();
+	for (n=0; n<count; ++n)
+	{
+		gfc_parserInit( &parser, &head );
+		gfc_parseRxHeader( &parser, &head, header, headerLen );
+		check += head.fileLenBytes;
+	}
+	ns = NowNs() - started;
+	fprintf(stdout, "whole:        %ld headers in %.3f s, %.1f ns/header, %.0f MB/s\n", count,
+			(double)ns / NSEC_PER_SEC, (double)ns / count, (double)count * headerLen * 1000 / ns);
+
+	started = NowNs();
+	for (n=0; n<count; ++n)
+	{
+		gfc_parserInit( &parser, &head );
+		for (i=0; i<headerLen; ++i)
+		{
+			gfc_parseRxHeader( &parser, &head, &header[i], 1 );
+		}
+		check += head.fileLenBytes;
+	}
+	ns = NowNs() - started;
+	fprintf(stdout, "byte by byte: %ld headers in %.3f s, %.1f ns/header, %.0f MB/s\n", count,
+			(double)ns / NSEC_PER_SEC, (double)ns / count, (double)count * headerLen * 1000 / ns);
+
+	if (check != (uint64_t)count * 2 * 1048576)
+		fprintf(stderr, "%s @ %d: benchmark header misparsed\n", __FILE__, __LINE__);
+}
+
+
+//------------------------------- Main --------------------------------------//
+int main(int argc, char **argv)
+{
+	fuzz_case_t fc;
+	long iterations = 200000;
+	long benchCount = 1000000;
+	long failures   = 0;
+	long malformed  = 0;
+	long n;
+
+  	int option_char = 0;
+
+	gRand = (uint64_t)time(NULL);
+
+  	// Parse and set command line arguments
+  	while ( (option_char = getopt_long(argc, argv, "n:s:b:h", gLongOptions, NULL)) != -1 )
+	{
+	    switch (option_char)
+		{
+		case 'n': // iterations
+			iterations = atol(optarg);
+			break;
+   	    case 's': // seed
+			gRand = strtoull(optarg, NULL, 0);
+			break;
+      	case 'b': // bench
+			benchCount = atol(optarg);
+			break;
+      	case 'h': // help
+			Usage();
+			exit(0);
+			break;
+      	default:
+			Usage();
+			exit(1);
+    	}
+  	}
+
+	if (gRand == 0)
+		gRand = 1;
+	fprintf(stdout, "seed %llu\n", (unsigned long long)gRand);
+
+	for (n=0; n<iterations; ++n)
+	{
+		GenValid( &fc );
+		// half the cases stay intact, the rest are broken in some way
+		if ( RandBelow(2) )
+		{
+			Mutate( &fc );
+			++malformed;
+		}
+		if ( !CheckCase(&fc) )
+		{
+			if (++failures >= 10)
+				break;
+		}
+	}
+	fprintf(stdout, "%ld cases, %ld mutated, %ld failed\n", n, malformed, failures);
+
+	if (benchCount > 0)
+		Bench( benchCount );
+
+	return failures ? 1 : 0;
+}
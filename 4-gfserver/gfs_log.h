@@ -0,0 +1,20 @@
+#ifndef __GFS_LOG_H__
+#define __GFS_LOG_H__
+
+// log levels; messages above GFS_LOG_LEVEL are compiled out. Build with -DGFS_LOG_LEVEL=LOG_DEBUG to see every request.
+enum
+{
+	LOG_ERROR = 0,
+	LOG_WARN,
+	LOG_INFO,
+	LOG_DEBUG
+};
+#ifndef GFS_LOG_LEVEL
+#define GFS_LOG_LEVEL	LOG_INFO
+#endif
+#define GFS_LOG(level, ...)	do { if ((level) <= GFS_LOG_LEVEL) gfs_log((level), __FILE__, __LINE__, __VA_ARGS__); } while (0)
+
+// queues a printf-style message for the server's log writer thread, see gfserver.c
+void gfs_log(int level, const char* file, int line, const char* fmt, ...);
+
+#endif // __GFS_LOG_H__
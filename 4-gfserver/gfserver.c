@@ -1,3 +1,4 @@
+#define _GNU_SOURCE	// accept4(), splice()
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -5,17 +6,65 @@
 #include <pthread.h>
 #include <errno.h> 
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <string.h>
 #include <ctype.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <fcntl.h>
 #include <netdb.h>
+#include <stdatomic.h>
+#include <inttypes.h>
+#include <stdarg.h>
+
+// the io_uring engine talks to the kernel directly, it only needs the uapi header
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define GFS_HAVE_URING	1
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+#endif
 
 #include "gfserver.h"
+#include "gfs_log.h"
 
 
 #define BUFFSIZE     4096
 #define PATHSIZE  	256
 #define HEADERSIZE	MAX_REQUEST_LEN
+#define RXBUFSIZE	1024	// per-connection receive buffer, holds a request and whatever is pipelined behind it
+#define REQ_MAX_LEN	(PATHSIZE + 64)	// longest request accepted, longer ones are malformed
+#define MAX_EVENTS	256
+#define CTX_POOL_SIZE	4096	// max number of connections served at the same time
+#define PIPESIZE	65536	// bytes moved per splice() when sendfile() is not usable
+#define CORK_MIN	65536	// file bodies of at least this size are sent with TCP_CORK set
+#define HEAD_BODY_MAX	65536	// body bytes sent together with the header, the rest follows on its own
+#define KEEPALIVE_TIMEOUT_MS	5000	// idle keep-alive connections are closed after this
+#define REQUEST_TIMEOUT_MS		3000	// a request has to be complete this long after its first byte
+#define SWEEP_INTERVAL_MS		1000	// how often the reactor looks for idle connections
+#define URING_ENTRIES	1024	// submission queue size of the io_uring engine
+#define URING_TX_ENTRIES	64		// submission queue size of a thread's response ring
+#define URING_TX_PAIRS	16		// file chunks spliced per io_uring_enter() of a response ring
+#define URING_PIPE_SIZE	(1 << 20)	// asked-for pipe capacity of a response ring, one file chunk each
+#define URING_COPY_MAX	65536	// file bodies up to this size are read into the response ring's buffer, not spliced
+#define STATS_PATH		"/__stats"	// request path answered with the server statistics, see gfserver_set_stats()
+#define STATS_BUFSIZE	4096
+#define STAT_SLOTS		256		// threads with statistics of their own, any further ones share the last slot
+#define PHASE_SUB_BITS	4		// 2^4 sub-buckets per power of 2, ~6% resolution
+#define PHASE_SUB_COUNT	(1 << PHASE_SUB_BITS)
+#define PHASE_HALF_COUNT	(PHASE_SUB_COUNT / 2)
+#define PHASE_MAX_BITS	32		// phase times up to 2^32 us
+#define PHASE_BUCKETS	(PHASE_SUB_COUNT + (PHASE_MAX_BITS - PHASE_SUB_BITS) * PHASE_HALF_COUNT)
+#define LOG_RING_SIZE	1024	// records buffered per thread, power of 2; more are dropped
+#define LOG_RECORD_LEN	240		// longest log line, longer ones are cut
+#define LOG_MAX_RINGS	256		// threads with a ring of their own, any further ones write directly
+#define LOG_IDLE_MS		20		// how long the log writer sleeps when there is nothing to write
+#define LOG_OUTBUFSIZE	16384	// records written to stderr with one write()
 
 typedef unsigned char  BOOL;
 enum
@@ -24,21 +73,200 @@ enum
 	TRUE
 };
 
-static char dataBuffer[BUFFSIZE] = {0};
-
 typedef ssize_t (*rxHandleFuncPtr)(gfcontext_t*, char*, void*);
 
+// life cycle of a connection context
+enum
+{
+	CTX_FREE = 0,		// on the pool's free list
+	CTX_READING,		// registered with the reactor, waiting for (the rest of) a request
+	CTX_HANDLER			// owned by the handler until the response is sent
+};
+
+// states of the request parser
+enum
+{
+	REQ_CMD = 0,		// "GETFILE GET "
+	REQ_PATH,			// <path>
+	REQ_TOKEN,			// optional tokens, i.e. <offset> <length> of a range and KEEPALIVE
+	REQ_END,			// "\r\n\r\n"
+	REQ_DONE,
+	REQ_ERROR
+};
+
+// connection engines, see gfserver_set_engine()
+enum
+{
+	GFS_ENGINE_EPOLL = 0,
+	GFS_ENGINE_URING
+};
+
+// io_uring completions that don't belong to a connection; anything else carries a gfcontext_t*
+enum
+{
+	URING_ACCEPT = 1,
+	URING_WAKE,
+	URING_TICK
+};
+
+// request phases timed by the server, in microseconds
+enum
+{
+	PHASE_PARSE = 0,	// accept, or the first byte of a keep-alive request, until the request is parsed
+	PHASE_DISPATCH,		// parsed until the handler is called
+	PHASE_QUEUE,		// handler called until a worker takes the request, see gfs_mark_dequeued()
+	PHASE_FIRSTBYTE,	// start of the request until the response header is sent
+	PHASE_TRANSFER,		// header sent until the response is complete
+	PHASE_TOTAL,		// start of the request until the response is complete
+	NUM_PHASES
+};
+
+// event counters
+enum
+{
+	CNT_CONNS = 0,		// accepted connections
+	CNT_OK,				// completed responses, by status
+	CNT_NOTFOUND,
+	CNT_ERROR,
+	CNT_MALFORMED,		// malformed requests, answered with FILE_NOT_FOUND
+	CNT_ABORTED,		// responses given up with gfs_abort()
+	CNT_TIMEOUTS,		// connections closed for being idle or too slow
+	CNT_BYTES,			// body bytes sent
+	NUM_COUNTERS
+};
+
+// Purpose: event loop state, one per acceptor thread. Each has its own listening socket 
+// (SO_REUSEPORT shards) and serves the connections accepted on it.
+// Workers hand finished keep-alive connections back through the lock-free resume stack 
+// and wake the loop through the eventfd.
+typedef struct gfs_reactor_t
+{
+	gfserver_t*				gfs;
+	pthread_t				thread;
+	int						epollFD;
+	int						wakeFD;
+	int						servSockFD;
+	_Atomic(gfcontext_t*)	resumeHead;
+} gfs_reactor_t;
+
+// Purpose: fixed-size pool of connection contexts, recycled through a lock-free free list.
+// The free list head packs an ABA tag (upper 32 bits) with "index + 1" of the first free context (lower 32 bits);
+// 0 in the lower half means the pool is exhausted.
+typedef struct gfs_ctxpool_t
+{
+	gfcontext_t*		ctxs;
+	int					size;
+	_Atomic uint64_t	freeHead;
+} gfs_ctxpool_t;
+
+// Purpose: statistics of one thread. Only its owner writes a slot (apart from the shared last one), 
+// with relaxed atomics that never contend; gfs_formatStats() adds the slots up when asked.
+typedef struct gfs_stats_t
+{
+	_Alignas(64) _Atomic uint64_t	counters[NUM_COUNTERS];
+	_Atomic uint64_t	phaseSum[NUM_PHASES];			// us
+	_Atomic uint64_t	phaseHist[NUM_PHASES][PHASE_BUCKETS];	// log-linear, see gfs_histIndex()
+} gfs_stats_t;
+
+typedef struct gfs_logrec_t
+{
+	int		len;
+	char	text[LOG_RECORD_LEN];
+} gfs_logrec_t;
+
+// Purpose: a thread's log records, on their way to stderr. The thread is the only producer 
+// and the log writer thread the only consumer, so head and tail are all the synchronization.
+typedef struct gfs_logring_t
+{
+	_Alignas(64) _Atomic unsigned	head;		// next record to write out, moved by the log writer
+	_Alignas(64) _Atomic unsigned	tail;		// next free record, moved by the owner
+	_Atomic uint64_t	dropped;				// records lost to a full ring
+	uint64_t			reported;				// drops the log writer has already reported
+	gfs_logrec_t		recs[LOG_RING_SIZE];
+} gfs_logring_t;
+
+#ifdef GFS_HAVE_URING
+// Purpose: an io_uring instance, set up and driven without liburing
+typedef struct gfs_uring_t
+{
+	int						ringFD;
+	char*					sqRing;
+	char*					cqRing;
+	_Atomic unsigned*		sqHead;
+	_Atomic unsigned*		sqTail;
+	unsigned				sqMask;
+	unsigned*				sqArray;
+	unsigned				sqEntries;
+	struct io_uring_sqe*	sqes;
+	_Atomic unsigned*		cqHead;
+	_Atomic unsigned*		cqTail;
+	unsigned				cqMask;
+	struct io_uring_cqe*	cqes;
+	size_t					sqSize;			// mapped sizes, see gfs_uringCleanup()
+	size_t					cqSize;
+	unsigned				toSubmit;		// queued, not yet submitted entries
+	BOOL					fixedBufs;		// the context pool is registered with the ring
+	uint64_t				wakeCount;		// target of the eventfd read
+	struct __kernel_timespec tick;			// sweep timer
+} gfs_uring_t;
+
+// fixed file slots of a response ring
+enum { TX_SLOT_SOCK = 0, TX_SLOT_PIPE_RD, TX_SLOT_PIPE_WR, TX_SLOTS };
+
+// Purpose: a thread's ring for sending responses, see gfs_txSend(). The connection being 
+// answered holds fixed file slot TX_SLOT_SOCK until its response is complete, file bodies 
+// are spliced through the pipe in the slots after it.
+typedef struct gfs_txring_t
+{
+	gfs_uring_t				ring;
+	gfcontext_t*			ctx;			// connection in TX_SLOT_SOCK, NULL if the slot is empty
+	int						sockFD;			// its descriptor when it was put there
+	int						slotFD;			// source of a queued slot update
+	int						noFD;			// -1, source of the update that empties the slot
+	int						pipeFD[2];
+	size_t					pipeSize;		// most bytes one splice into the pipe moves
+	int						numSqes;		// queued for the next gfs_txSubmit()
+	struct io_uring_sqe*	lastSqe;		// linked to the next one queued
+	int						res[URING_TX_ENTRIES];	// results of the last gfs_txSubmit(), by queue position
+	char					buf[URING_COPY_MAX];	// small file bodies, see gfs_txSendCopy()
+} gfs_txring_t;
+#endif
+
 static const char CMD[]			= "GETFILE ";
+static const char REQ_GET[]		= "GETFILE GET ";
 static const char STAT_OK[]	 	= "OK ";
 static const char STAT_FILE[]	= "FILE_NOT_FOUND";
 static const char STAT_ERROR[] 	= "ERROR";
 static const char HEAD_END[]   	= "\r\n\r\n";
+static const char KEEPALIVE[]	= " KEEPALIVE";	// persistent connection token, request and response
 
 static const int  CMD_LEN  	   	 = 8; 
+static const int  REQ_GET_LEN    = 12; 
 static const int  HEAD_END_LEN   = 4; 
 static const int  STAT_ERROR_LEN = 5; 
 static const int  STAT_FILE_LEN  = 14; 
 static const int  STAT_OK_LEN    = 3; 
+static const int  KEEPALIVE_LEN  = 10; 
+
+static const char* PHASE_NAMES[NUM_PHASES] = { "accept_to_parse", "parse_to_dispatch", "queue_wait", 
+											   "first_byte", "transfer", "total" };
+
+static gfs_stats_t			gfs_stats[STAT_SLOTS];
+static _Atomic int			gfs_numStats;
+static __thread gfs_stats_t*	gfs_myStats;		// this thread's slot, taken on first use
+
+static const char* LOG_NAMES[] = { "error", "warn", "info", "debug" };
+
+static _Atomic(gfs_logring_t*)	gfs_logRings[LOG_MAX_RINGS];
+static _Atomic int				gfs_numLogRings;
+static __thread gfs_logring_t*	gfs_myLog;			// this thread's ring, set up on first use
+static pthread_once_t			gfs_logOnce = PTHREAD_ONCE_INIT;
+static pthread_mutex_t			gfs_logLock = PTHREAD_MUTEX_INITIALIZER;	// the log writer vs. the final flush at exit
+
+#ifdef GFS_HAVE_URING
+static __thread gfs_txring_t*	gfs_myTx;			// this thread's response ring, set up on first use
+static __thread BOOL			gfs_myTxFailed;		// responses from this thread don't use io_uring
+#endif
 
 // NOTE: this struct is used as an opaque pointer at the API/interface level. 
 // This struct is a "handle".
@@ -49,80 +277,230 @@ struct gfserver_t
 	int				maxPending;					
 	rxHandleFuncPtr	handleFunc;
 	void*			handleArg;
+	gfs_ctxpool_t	ctxPool;
+	gfs_reactor_t*	reactors;
+	int				numReactors;			// acceptor/reactor threads, each with its own listening socket
+	int				engine;					// GFS_ENGINE_EPOLL or GFS_ENGINE_URING
+	BOOL			statsEnabled;			// answer STATS_PATH with the statistics
+	size_t			(*statsFunc)(char*, size_t);	// appends the handler's own statistics
 };
 
 // NOTE: this struct is used as an opaque pointer at the API/interface level. 
 // This struct is a "handle".
-// Purpose: contains contextual information for a particular connection and request
+// Purpose: contains contextual information for a particular connection and request.
+// One context per connection, drawn from the server's gfs_ctxpool_t and returned 
+// once the response has been completely sent, or on gfs_abort(). A keep-alive 
+// connection keeps its context and goes back to the reactor instead.
 struct gfcontext_t
 {
 	int 		clientSockFD;
-	char		reqPath[PATHSIZE];	// the path of the file that is requested from the server
-	int			pathLen;			// length of the reqPath string	
-	gfstatus_t  reqStatus;			//	the status of the current request
+	char		reqPath[PATHSIZE];		// the path of the file that is requested from the server
+	int			pathLen;				// length of the reqPath string	
+	gfstatus_t  reqStatus;				//	the status of the current request
+	char		rxBuf[RXBUFSIZE];		// received request bytes; the current request starts at rxBuf[0]
+	int			rxLen;					// number of valid bytes in rxBuf
+	int			reqLen;					// bytes of rxBuf parsed so far, pipelined requests follow them
+	int			parseState;				// REQ_CMD ... REQ_ERROR
+	int			parsePos;				// chars of the current literal/token matched so far
+	BOOL		tokenMatch;				// current token may still be KEEPALIVE
+	BOOL		tokenDigits;			// current token is a number so far
+	uint64_t	tokenValue;				// value of the current number token
+	int			numRange;				// number tokens seen, <offset> then <length>
+	BOOL		hasRange;				// the request asked for part of the file
+	uint64_t	rangeOffset;
+	uint64_t	rangeLen;
+	char		txHead[HEADERSIZE];		// response header, held back to go out with the first body bytes
+	int			txHeadLen;				// length of the pending header, 0 once it has been sent
+	size_t		fileLen;				// body length announced by gfs_sendheader()
+	size_t		bytesSent;				// body bytes sent so far
+	gfserver_t*	gfs;					// owning server, the context is returned to its pool
+	uint32_t	poolIdx;				// index of this context in the pool
+	_Atomic uint32_t nextFree;			// "index + 1" of the next free context, while on the free list
+	_Atomic int	state;					// CTX_FREE, CTX_READING or CTX_HANDLER
+	BOOL		keepAlive;				// client asked for a persistent connection
+	uint64_t	deadline;				// monotonic ms; a reading connection is closed after this
+	gfs_reactor_t* reactor;				// event loop the connection belongs to
+	gfcontext_t* nextResume;			// link in the reactor's resume stack
+	uint64_t	tStart;					// monotonic ns: accept, or the first byte of a later request
+	uint64_t	tParsed;				// request parsed
+	uint64_t	tDispatch;				// handed to the handler
+	uint64_t	tHead;					// response header sent
 };
-static gfcontext_t contextStruct = {0};
 
 
 //----------- Function Prototypes --------------//
 static int  gfs_SetUpTCPConnection(gfserver_t* gfs);
-static void gfs_parseRxHeader(void* buffer, size_t buffLen, gfcontext_t* gfc);
-static int  gfs_getRequest( char* buffPtr, int buffSize, int socket );
+static void gfs_parserInit(gfcontext_t* ctx);
+static BOOL gfs_parseRequest(gfcontext_t* ctx);
+static int  gfs_setNonBlocking(int socket, BOOL nonBlocking);
+static void gfs_acceptClients(gfserver_t* gfs, gfs_reactor_t* reactor);
+static void gfs_readRequest(gfserver_t* gfs, gfcontext_t* ctx);
+static void gfs_dispatchRequest(gfserver_t* gfs, gfcontext_t* ctx);
+static void gfs_handleRequest(gfserver_t* gfs, gfcontext_t* ctx);
+static void gfs_nextRequest(gfcontext_t* ctx);
+static void* gfs_reactorThread(void* arg);
+static void gfs_serveEpoll(gfserver_t* gfs, gfs_reactor_t* reactor);
+#ifdef GFS_HAVE_URING
+static void gfs_serveUring(gfserver_t* gfs, gfs_reactor_t* reactor);
+static gfs_txring_t* gfs_txRing(gfcontext_t* ctx);
+static void gfs_txRelease(gfs_txring_t* tx);
+static ssize_t gfs_txSend(gfs_txring_t* tx, gfcontext_t* ctx, char* data, size_t len);
+static int  gfs_txSendHead(gfs_txring_t* tx, gfcontext_t* ctx, int flags);
+static ssize_t gfs_txSendfile(gfs_txring_t* tx, gfcontext_t* ctx, int fileFD, off_t offset, size_t len);
+static ssize_t gfs_txSendCopy(gfs_txring_t* tx, gfcontext_t* ctx, int fileFD, off_t offset, size_t len);
+#endif
+static void gfs_closeConn(gfcontext_t* ctx);
+static void gfs_finishResponse(gfcontext_t* ctx);
+static void gfs_resumeConn(gfcontext_t* ctx);
+static void gfs_rearmConns(gfserver_t* gfs, gfs_reactor_t* reactor);
+static void gfs_sweepIdleConns(gfserver_t* gfs, gfs_reactor_t* reactor, uint64_t now);
+static uint64_t gfs_nowMs(void);
+static uint64_t gfs_nowNs(void);
+static void gfs_count(int counter, uint64_t n);
+static void gfs_timePhase(int phase, uint64_t from, uint64_t to);
+static void gfs_headerSent(gfcontext_t* ctx);
+static void gfs_serveStats(gfserver_t* gfs, gfcontext_t* ctx);
+static void gfs_logFlush(void);
+static int  gfs_poolInit(gfs_ctxpool_t* pool, gfserver_t* gfs, int size);
+static gfcontext_t* gfs_poolGet(gfs_ctxpool_t* pool);
+static void gfs_poolPut(gfs_ctxpool_t* pool, gfcontext_t* ctx);
+static ssize_t gfs_spliceFile(int sockFD, int fileFD, off_t offset, size_t len);
+static int  gfs_sendHead(gfcontext_t* ctx, int flags);
+static ssize_t gfs_buildHeader(gfcontext_t* ctx, gfstatus_t status, size_t file_len, BOOL ranged, size_t offset, size_t total);
+
+
+//------------------ gfs_parserInit ----------------------//
+static void gfs_parserInit(gfcontext_t* ctx)
+{
+	ctx->reqLen     = 0;
+	ctx->parseState = REQ_CMD;
+	ctx->parsePos   = 0;
+	ctx->tokenMatch = FALSE;
+	ctx->numRange   = 0;
+	ctx->hasRange   = FALSE;
+	ctx->pathLen    = 0;
+	ctx->reqPath[0] = 0;
+	ctx->reqStatus  = GF_FILE_NOT_FOUND;
+	ctx->keepAlive  = FALSE;
+}
 
 
-//------------------ gfs_parseRxHeader ----------------------//
-static void gfs_parseRxHeader(void* buffer, size_t buffLen, gfcontext_t* gfc)
+//------------------ gfs_parseRequest ----------------------//
+// NOTE: parses "GETFILE GET <path> [<offset> <length>] [KEEPALIVE]\r\n\r\n" incrementally. Picks up at 
+// rxBuf[reqLen], so every received byte is looked at once, however the request trickles in. 
+// Returns TRUE once the request is complete or known to be malformed, reqLen is then its length.
+static BOOL gfs_parseRequest(gfcontext_t* ctx)
 {
-	char* curStr;
-	const char  key[]  = " \r";
+	char ch;
 
-	// initialize to default case
-	gfc->pathLen   = 0;
-	gfc->reqStatus = GF_FILE_NOT_FOUND;	
+	while (ctx->reqLen < ctx->rxLen)
+	{
+		ch = ctx->rxBuf[ctx->reqLen++];
+		if (ctx->reqLen > REQ_MAX_LEN)
+		{
+			ctx->parseState = REQ_ERROR;
+			break;
+		}
 
-	fprintf(stderr, " rxHead: %s ", (char*)buffer);
+		switch (ctx->parseState)
+		{
+		case REQ_CMD:
+			if (ch != REQ_GET[ctx->parsePos])
+				ctx->parseState = REQ_ERROR;
+			else if (++ctx->parsePos == REQ_GET_LEN)
+				ctx->parseState = REQ_PATH;
+			break;
 
-	// "GETFILE"
-	curStr = strtok( buffer, key );
-	if (curStr == NULL)
-	{		
-		return;
-	}
-	else if ( strcmp(curStr, "GETFILE") != 0)
-	{
-		return;
-	}
+		case REQ_PATH:
+			// check for proper format; must have "/" in front
+			if (ctx->pathLen == 0 && ch != '/')
+			{
+				ctx->parseState = REQ_ERROR;
+			}
+			else if (ch == ' ' || ch == '\r')
+			{
+				ctx->reqPath[ctx->pathLen] = 0;
+				ctx->parsePos   = (ch == '\r') ? 1 : 0;
+				ctx->parseState = (ch == '\r') ? REQ_END : REQ_TOKEN;
+				ctx->tokenMatch  = TRUE;
+				ctx->tokenDigits = TRUE;
+				ctx->tokenValue  = 0;
+			}
+			else if (ctx->pathLen >= PATHSIZE - 1)
+			{
+				ctx->parseState = REQ_ERROR;
+			}
+			else
+			{
+				ctx->reqPath[ctx->pathLen++] = ch;
+			}
+			break;
 
-	// method = "GET"
-	curStr = strtok( NULL, key );
-	if (curStr == NULL)
-	{
-		return;
-	}	
-	else if ( strcmp(curStr, "GET") != 0)
-	{
-		return;
+		case REQ_TOKEN:
+			// the first two number tokens are a range, unknown tokens are skipped
+			if (ch == ' ' || ch == '\r')
+			{
+				if (ctx->tokenMatch == TRUE && ctx->parsePos == KEEPALIVE_LEN - 1)
+				{
+					ctx->keepAlive = TRUE;
+				}
+				else if (ctx->tokenDigits == TRUE && ctx->parsePos > 0 && ctx->numRange < 2)
+				{
+					if (ctx->numRange++ == 0)
+						ctx->rangeOffset = ctx->tokenValue;
+					else
+						ctx->rangeLen = ctx->tokenValue;
+				}
+				ctx->parsePos   = (ch == '\r') ? 1 : 0;
+				ctx->parseState = (ch == '\r') ? REQ_END : REQ_TOKEN;
+				ctx->tokenMatch  = TRUE;
+				ctx->tokenDigits = TRUE;
+				ctx->tokenValue  = 0;
+				break;
+			}
+			if (ctx->parsePos >= KEEPALIVE_LEN - 1 || KEEPALIVE[ctx->parsePos + 1] != ch)
+				ctx->tokenMatch = FALSE;
+			if (ch < '0' || ch > '9' || ctx->tokenValue > (UINT64_MAX - (ch - '0')) / 10)
+				ctx->tokenDigits = FALSE;
+			else
+				ctx->tokenValue = ctx->tokenValue*10 + (ch - '0');
+			++ctx->parsePos;
+			break;
+
+		case REQ_END:
+			if (ch != HEAD_END[ctx->parsePos])
+				ctx->parseState = REQ_ERROR;
+			else if (++ctx->parsePos == HEAD_END_LEN)
+				ctx->parseState = REQ_DONE;
+			break;
+		}
+
+		// an offset without a length is malformed
+		if (ctx->parseState == REQ_DONE && ctx->numRange == 1)
+		{
+			ctx->parseState = REQ_ERROR;
+		}
+		if (ctx->parseState == REQ_DONE)
+		{
+			ctx->hasRange  = (ctx->numRange == 2) ? TRUE : FALSE;
+			ctx->reqStatus = GF_OK;
+			return TRUE;
+		}
+		if (ctx->parseState == REQ_ERROR)
+			break;
 	}
 
-	// get the requested file path
-	curStr = strtok( NULL, key );
-	if (curStr == NULL)
-	{
-		return;
-	}	
-	// check for proper format; must have "\" in front
-	if (curStr[0] != 0x2F)	// Note: ox2F is ASCII for "\"
+	if (ctx->parseState == REQ_ERROR)
 	{
-		return;
+		// the rest of a malformed request can't be told apart from the next one
+		ctx->reqStatus = GF_FILE_NOT_FOUND;
+		ctx->keepAlive = FALSE;
+		ctx->pathLen   = 0;
+		ctx->reqPath[0] = 0;
+		return TRUE;
 	}
 
-	gfc->reqStatus = GF_OK;	
-	
-	gfc->pathLen = strlen(curStr);
-	memset(gfc->reqPath, 0, PATHSIZE); 
-	memcpy(gfc->reqPath, curStr, gfc->pathLen);
-	//printf("len: %d\n", gfc->pathLen);
-	//printf("reqPath: %s\n", gfc->reqPath);
+	return FALSE;
 }
 
 
@@ -144,11 +522,24 @@ static int gfs_SetUpTCPConnection(gfserver_t* gfs)
     
     //---- set socket options --> allow for socket reuse    
     status = setsockopt(socketFD, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
-	if (status < -1)
+	if (status < 0)
 	{
         fprintf(stderr, "%s @ %d: setsockopt() failed\n", __FILE__, __LINE__);
+        close(socketFD);
         return -1;       
 	}
+
+	//---- every acceptor binds its own socket to the port, the kernel spreads connections across them
+	if (gfs->numReactors > 1)
+	{
+		status = setsockopt(socketFD, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int));
+		if (status < 0)
+		{
+			fprintf(stderr, "%s @ %d: setsockopt(SO_REUSEPORT) failed\n", __FILE__, __LINE__);
+			close(socketFD);
+			return -1;       
+		}
+	}
     
 	//---- server address
 	bzero( (char*)&servAddr, sizeof(servAddr) );
@@ -161,6 +552,7 @@ static int gfs_SetUpTCPConnection(gfserver_t* gfs)
 	if (status < 0)
 	{
        fprintf(stderr, "%s @ %d: bind() failed, port %d\n", __FILE__, __LINE__, gfs->port);
+       close(socketFD);
        return -1;            
 	}
     
@@ -168,10 +560,82 @@ static int gfs_SetUpTCPConnection(gfserver_t* gfs)
 }
 
 
+//------------ gfs_poolInit -------------//
+static int gfs_poolInit(gfs_ctxpool_t* pool, gfserver_t* gfs, int size)
+{
+	int i = 0;
+
+	pool->ctxs = calloc( size, sizeof(gfcontext_t) );
+	if (pool->ctxs == NULL)
+	{
+		return -1;
+	}
+	pool->size = size;
+
+	// chain every context onto the free list
+	for (i=0; i<size; ++i)
+	{
+		pool->ctxs[i].gfs 	   = gfs;
+		pool->ctxs[i].poolIdx  = i;
+		atomic_init( &pool->ctxs[i].nextFree, (i + 1 < size) ? (uint32_t)(i + 2) : 0 );
+	}
+	atomic_init( &pool->freeHead, (size > 0) ? 1 : 0 );
+
+	return 0;
+}
+
+
+//------------ gfs_poolGet -------------//
+// NOTE: lock-free pop off the free list; returns NULL when every context is in use
+static gfcontext_t* gfs_poolGet(gfs_ctxpool_t* pool)
+{
+	uint64_t head = atomic_load( &pool->freeHead );
+	uint64_t newHead;
+	uint32_t idx;
+
+	do
+	{
+		idx = (uint32_t)head;
+		if (idx == 0)
+		{
+			return NULL;
+		}
+		newHead = ( ((head >> 32) + 1) << 32 ) | atomic_load_explicit( &pool->ctxs[idx - 1].nextFree, memory_order_relaxed );
+	} while ( !atomic_compare_exchange_weak( &pool->freeHead, &head, newHead ) );
+
+	gfcontext_t* ctx = &pool->ctxs[idx - 1];
+	ctx->clientSockFD = -1;
+	ctx->rxLen        = 0;
+	ctx->txHeadLen    = 0;
+	ctx->fileLen      = 0;
+	ctx->bytesSent    = 0;
+	gfs_parserInit(ctx);
+
+	return ctx;
+}
+
+
+//------------ gfs_poolPut -------------//
+// NOTE: lock-free push onto the free list, the ABA tag is bumped on every update
+static void gfs_poolPut(gfs_ctxpool_t* pool, gfcontext_t* ctx)
+{
+	uint64_t head = atomic_load( &pool->freeHead );
+	uint64_t newHead;
+
+	do
+	{
+		atomic_store_explicit( &ctx->nextFree, (uint32_t)head, memory_order_relaxed );
+		newHead = ( ((head >> 32) + 1) << 32 ) | (ctx->poolIdx + 1);
+	} while ( !atomic_compare_exchange_weak( &pool->freeHead, &head, newHead ) );
+}
+
+
 //------------ gfs_abort -------------//
 void gfs_abort(gfcontext_t* ctx)
 {
-	close(ctx->clientSockFD);
+	gfs_count(CNT_ABORTED, 1);
+	gfs_count(CNT_BYTES, ctx->bytesSent);
+	gfs_closeConn(ctx);
 }
 
 
@@ -186,25 +650,297 @@ gfserver_t* gfserver_create()
 
 
 //------------ gfs_send -------------//
+// NOTE: a header held back by gfs_sendheader() goes out in the same sendmsg() as the 
+// first body bytes, so a small file is a single segment. Only the first HEAD_BODY_MAX 
+// bytes ride along, so a large body doesn't hold up the header's send time.
+// The connection is closed and its context recycled once the whole body has been sent
 ssize_t gfs_send(gfcontext_t* ctx, void* data, size_t len)
 {
 	char* buffPtr = (char*)data;
+	size_t total  = 0;
+	size_t headSent = 0;
+	ssize_t bytesSent;
+	struct iovec iov[2];
+	struct msghdr msg;
+#ifdef GFS_HAVE_URING
+	gfs_txring_t* tx;
+#endif
+
+	if (len == 0)
+	{
+		return 0;
+	}
+#ifdef GFS_HAVE_URING
+	if (len <= INT32_MAX && (tx = gfs_txRing(ctx)) != NULL)
+	{
+		return gfs_txSend(tx, ctx, buffPtr, len);
+	}
+#endif
+
+	// header and body together, until the header is out
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov    = iov;
+	msg.msg_iovlen = 2;
+	while (ctx->txHeadLen > 0 && headSent < (size_t)ctx->txHeadLen)
+	{
+		iov[0].iov_base = &ctx->txHead[headSent];
+		iov[0].iov_len  = ctx->txHeadLen - headSent;
+		iov[1].iov_base = buffPtr;
+		iov[1].iov_len  = (len < HEAD_BODY_MAX) ? len : HEAD_BODY_MAX;
+		bytesSent = sendmsg(ctx->clientSockFD, &msg, MSG_NOSIGNAL);
+		if (bytesSent < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		headSent += bytesSent;
+	}
+	if (ctx->txHeadLen > 0)
+	{
+		total = headSent - ctx->txHeadLen;
+		ctx->txHeadLen = 0;
+		gfs_headerSent(ctx);
+	}
+
+	while (total < len)
+	{
+		bytesSent = send(ctx->clientSockFD, &buffPtr[total], len - total, MSG_NOSIGNAL);
+		if (bytesSent < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		total += bytesSent;
+	}
+
+	ctx->bytesSent += total;
+	if (ctx->bytesSent >= ctx->fileLen)
+	{
+		gfs_finishResponse(ctx);
+	}
+
+   return total;
+}
+
+
+//------------ gfs_sendHead -------------//
+// NOTE: sends a pending response header on its own; with MSG_MORE the kernel holds 
+// it back until the body follows
+static int gfs_sendHead(gfcontext_t* ctx, int flags)
+{
+	int total = 0;
+	ssize_t bytesSent;
+#ifdef GFS_HAVE_URING
+	gfs_txring_t* tx;
+
+	if ( (tx = gfs_txRing(ctx)) != NULL )
+	{
+		return gfs_txSendHead(tx, ctx, flags);
+	}
+#endif
+
+	while (total < ctx->txHeadLen)
+	{
+		bytesSent = send(ctx->clientSockFD, &ctx->txHead[total], ctx->txHeadLen - total, MSG_NOSIGNAL | flags);
+		if (bytesSent < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		total += bytesSent;
+	}
+	ctx->txHeadLen = 0;
+	gfs_headerSent(ctx);
+
+	return 0;
+}
+
+
+//------------ gfs_spliceFile -------------//
+// NOTE: fallback for gfs_sendfile(), moves file pages socket-ward through a pipe
+static ssize_t gfs_spliceFile(int sockFD, int fileFD, off_t offset, size_t len)
+{
+	int pipeFD[2];
+	size_t total = 0;
+	size_t chunk;
+	ssize_t inPipe, moved;
+
+	if (pipe2(pipeFD, O_CLOEXEC) < 0)
+	{
+		return -1;
+	}
+
+	while (total < len)
+	{
+		chunk  = (len - total < PIPESIZE) ? len - total : PIPESIZE;
+		inPipe = splice(fileFD, &offset, pipeFD[1], NULL, chunk, 
+						SPLICE_F_MOVE | ((total + chunk < len) ? SPLICE_F_MORE : 0));
+		if (inPipe < 0 && errno == EINTR)
+			continue;
+		if (inPipe <= 0)
+			break;
+
+		// drain the pipe into the socket
+		// NOTE: the last bytes of the body go without SPLICE_F_MORE, a small body isn't 
+		// corked and would otherwise wait for the kernel's autocork timer
+		while (inPipe > 0)
+		{
+			moved = splice(pipeFD[0], NULL, sockFD, NULL, inPipe, 
+							SPLICE_F_MOVE | ((total + inPipe < len) ? SPLICE_F_MORE : 0));
+			if (moved < 0 && errno == EINTR)
+				continue;
+			if (moved <= 0)
+			{
+				close(pipeFD[0]);
+				close(pipeFD[1]);
+				return -1;
+			}
+			inPipe -= moved;
+			total  += moved;
+		}
+	}
+
+	close(pipeFD[0]);
+	close(pipeFD[1]);
+
+	return total;
+}
+
+
+//------------ gfs_sendfile -------------//
+// NOTE: sends len bytes of fileFD, starting at offset, as (part of) the response body without 
+// copying them through user space. Uses sendfile(2), or splice(2) when the descriptor is not 
+// supported by sendfile; the io_uring engine splices through the thread's response ring instead.
+// Returns the number of body bytes sent, or -1 on a socket error.
+ssize_t gfs_sendfile(gfcontext_t* ctx, int fileFD, off_t offset, size_t len)
+{
+	size_t total = 0;
+	ssize_t bytesSent;
+	int cork = (len >= CORK_MIN) ? 1 : 0;
+	int off  = 0;
+#ifdef GFS_HAVE_URING
+	gfs_txring_t* tx;
+#endif
+
+	// nothing to send; an empty body already completed the response in gfs_sendheader()
+	if (len == 0)
+	{
+		return 0;
+	}
+#ifdef GFS_HAVE_URING
+	if ( (tx = gfs_txRing(ctx)) != NULL )
+	{
+		return gfs_txSendfile(tx, ctx, fileFD, offset, len);
+	}
+#endif
+
+	// large bodies: only full segments until the end of the file, the header rides along 
+	// with the first one. Small ones: the header waits for the body with MSG_MORE.
+	if (cork)
+	{
+		setsockopt(ctx->clientSockFD, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+	}
+	if (ctx->txHeadLen > 0 && gfs_sendHead(ctx, MSG_MORE) < 0)
+	{
+		return -1;
+	}
+
+	while (total < len)
+	{
+		bytesSent = sendfile(ctx->clientSockFD, fileFD, &offset, len - total);
+		if (bytesSent < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			if (errno != EINVAL && errno != ENOSYS)
+				return -1;
+
+			bytesSent = gfs_spliceFile(ctx->clientSockFD, fileFD, offset, len - total);
+			if (bytesSent < 0)
+				return -1;
+			total += bytesSent;
+			break;
+		}
+		else if (bytesSent == 0)
+		{
+			// file is shorter than announced
+			break;
+		}
+		total += bytesSent;
+	}
+
+	// flushes the last partial segment
+	if (cork)
+	{
+		setsockopt(ctx->clientSockFD, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+	}
 
-	int bytesSent = send(ctx->clientSockFD, buffPtr, len, 0);
+	ctx->bytesSent += total;
+	if (ctx->bytesSent >= ctx->fileLen)
+	{
+		gfs_finishResponse(ctx);
+	}
 
-   return bytesSent;
+	return total;
 }
 
 
 //------------ gfs_sendheader -------------//
 ssize_t gfs_sendheader(gfcontext_t* ctx, gfstatus_t status, size_t file_len)
+{
+	return gfs_buildHeader(ctx, status, file_len, FALSE, 0, 0);
+}
+
+
+//------------ gfs_sendheader_range -------------//
+// NOTE: answers a range request, "GETFILE OK <length> <offset> <totalLength>"; 
+// length is the number of body bytes that follow
+ssize_t gfs_sendheader_range(gfcontext_t* ctx, gfstatus_t status, size_t len, size_t offset, size_t total)
+{
+	return gfs_buildHeader(ctx, status, len, TRUE, offset, total);
+}
+
+
+//------------ gfs_get_range -------------//
+// returns 1 and the requested part of the file if the client asked for a range
+int gfs_get_range(gfcontext_t* ctx, size_t* offset, size_t* len)
+{
+	if (ctx->hasRange == FALSE)
+	{
+		return 0;
+	}
+
+	*offset = ctx->rangeOffset;
+	*len    = ctx->rangeLen;
+
+	return 1;
+}
+
+
+//------------ gfs_buildHeader -------------//
+// NOTE: a header announcing a body is not sent here; it is held in the context and goes 
+// out with the first body bytes from gfs_send()/gfs_sendfile()
+static ssize_t gfs_buildHeader(gfcontext_t* ctx, gfstatus_t status, size_t file_len, BOOL ranged, size_t offset, size_t total)
 {
 	ctx->reqStatus = status;
+	ctx->fileLen   = (status == GF_OK) ? file_len : 0;
+	ctx->bytesSent = 0;
+#ifdef GFS_HAVE_URING
+	// a new response always puts its socket into the fixed slot again, even if a 
+	// recycled context with the same descriptor number is still there
+	if (gfs_myTx != NULL)
+	{
+		gfs_myTx->sockFD = -1;
+	}
+#endif
 
 	// build the response command, "GETFILE <status> <fileLength> <end>
 	int  headIdx = 0;
-	char reqHeader[HEADERSIZE] = {0};
-	strcpy( &(reqHeader[headIdx]), CMD);
+	char* reqHeader = ctx->txHead;
+	memcpy( &(reqHeader[headIdx]), CMD, CMD_LEN );
 	headIdx += CMD_LEN;
 
 	int statusLen = STAT_OK_LEN;
@@ -219,107 +955,1928 @@ ssize_t gfs_sendheader(gfcontext_t* ctx, gfstatus_t status, size_t file_len)
 		statStr   = STAT_ERROR;
 		statusLen = STAT_ERROR_LEN;
 	}
-	strcpy( &(reqHeader[headIdx]), statStr );
+	memcpy( &(reqHeader[headIdx]), statStr, statusLen );
 	headIdx += statusLen;
 
 	// add the file length
 	if (status == GF_OK)
 	{
-		char fileLenStr[64] = {0};
-		sprintf( fileLenStr, "%lu", file_len);
-		int fileLenStrLen = strlen(fileLenStr);
-		strcpy( &(reqHeader[headIdx]), fileLenStr );
-		headIdx += fileLenStrLen;	
+		headIdx += snprintf( &(reqHeader[headIdx]), HEADERSIZE - headIdx, "%zu", file_len );
+		if (ranged == TRUE)
+		{
+			headIdx += snprintf( &(reqHeader[headIdx]), HEADERSIZE - headIdx, " %zu %zu", offset, total );
+		}
+	}
+
+	// acknowledge a persistent connection
+	if (ctx->keepAlive == TRUE)
+	{
+		memcpy( &(reqHeader[headIdx]), KEEPALIVE, KEEPALIVE_LEN );
+		headIdx += KEEPALIVE_LEN;
 	}
 
-	strcpy( &(reqHeader[headIdx]), HEAD_END );
+	memcpy( &(reqHeader[headIdx]), HEAD_END, HEAD_END_LEN );
 	headIdx += HEAD_END_LEN;
-	
-	//fprintf(stderr, " txHead: %s ", reqHeader);
-	// transmit the request
-	send(ctx->clientSockFD, &(reqHeader[0]), headIdx, 0);
+	ctx->txHeadLen = headIdx;
 
+	//fprintf(stderr, " txHead: %.*s ", headIdx, reqHeader);
+	// no body follows, so transmit the header now and the response is complete
+	if (ctx->fileLen == 0)
+	{
+		if (gfs_sendHead(ctx, 0) < 0)
+		{
+			ctx->keepAlive = FALSE;
+		}
+		gfs_finishResponse(ctx);
+	}
 
    return 0;
 }
 
 
-//------------ gfserver_serve -------------//
-void gfserver_serve(gfserver_t* gfs)
+//------------ gfs_setNonBlocking -------------//
+static int gfs_setNonBlocking(int socket, BOOL nonBlocking)
+{
+	int flags = fcntl(socket, F_GETFL, 0);
+	if (flags < 0)
+	{
+		return -1;
+	}
+
+	if (nonBlocking == TRUE)
+		flags |= O_NONBLOCK;
+	else
+		flags &= ~O_NONBLOCK;
+
+	return fcntl(socket, F_SETFL, flags);
+}
+
+
+//------------ gfs_closeConn -------------//
+// NOTE: closing the socket also removes it from the epoll interest list
+static void gfs_closeConn(gfcontext_t* ctx)
+{
+#ifdef GFS_HAVE_URING
+	// a closed socket must not stay behind in this thread's fixed file table
+	if (gfs_myTx != NULL && gfs_myTx->ctx == ctx)
+	{
+		gfs_txRelease(gfs_myTx);
+	}
+#endif
+	close(ctx->clientSockFD);
+	ctx->clientSockFD = -1;
+	atomic_store( &ctx->state, CTX_FREE );
+	gfs_poolPut(&ctx->gfs->ctxPool, ctx);
+}
+
+
+//------------ gfs_finishResponse -------------//
+// NOTE: called once a response has been completely sent
+static void gfs_finishResponse(gfcontext_t* ctx)
+{
+	uint64_t now = gfs_nowNs();
+
+	gfs_timePhase(PHASE_TRANSFER, ctx->tHead, now);
+	gfs_timePhase(PHASE_TOTAL, ctx->tStart, now);
+	gfs_count( (ctx->reqStatus == GF_OK) ? CNT_OK : (ctx->reqStatus == GF_FILE_NOT_FOUND) ? CNT_NOTFOUND : CNT_ERROR, 1 );
+	gfs_count(CNT_BYTES, ctx->bytesSent);
+
+	if (ctx->keepAlive == TRUE)
+		gfs_resumeConn(ctx);
+	else
+		gfs_closeConn(ctx);
+}
+
+
+//------------ gfs_resumeConn -------------//
+// NOTE: may run on any thread; pushes the connection onto the reactor's resume stack 
+// and wakes the reactor, which re-registers it for the next request
+static void gfs_resumeConn(gfcontext_t* ctx)
 {
+	gfs_reactor_t* reactor = ctx->reactor;
+	gfcontext_t*   head    = atomic_load( &reactor->resumeHead );
+	uint64_t	   one     = 1;
 
-	int servSockFD = gfs_SetUpTCPConnection(gfs);
-	if (servSockFD < 0)
+	do
 	{
-	   exit(1);
-	}  
+		ctx->nextResume = head;
+	} while ( !atomic_compare_exchange_weak( &reactor->resumeHead, &head, ctx ) );
 
-	struct sockaddr_in clientAddr;
-	socklen_t clientLen = sizeof(clientAddr);
+	if (write(reactor->wakeFD, &one, sizeof(one)) < 0)
+	{
+		GFS_LOG(LOG_ERROR, "eventfd write() failed");
+	}
+}
 
-	// can't fail for a valid socket
-	listen(servSockFD, gfs->maxPending);
 
-	while(1)
+//------------ gfs_rearmConns -------------//
+// NOTE: reactor side of gfs_resumeConn(). Requests the client pipelined behind the 
+// finished one are either already in rxBuf, or reported by epoll right after EPOLL_CTL_ADD.
+static void gfs_rearmConns(gfserver_t* gfs, gfs_reactor_t* reactor)
+{
+	struct epoll_event event;
+	uint64_t count;
+	gfcontext_t* ctx;
+	gfcontext_t* next;
+
+	if (read(reactor->wakeFD, &count, sizeof(count)) < 0 && errno != EAGAIN)
 	{
-		// blocks until a client connects
-		contextStruct.clientSockFD = accept(servSockFD, (struct sockaddr*)&clientAddr, &clientLen);
-		if (contextStruct.clientSockFD < 0)
-		{
-			fprintf(stderr, "%s @ %d: accept() failed\n", __FILE__, __LINE__);
-		}
+		GFS_LOG(LOG_ERROR, "eventfd read() failed");
+	}
 
-		// received the request
-		char* buffPtr = &dataBuffer[0];
-		int 	size 	  = gfs_getRequest( buffPtr, BUFFSIZE, contextStruct.clientSockFD );
+	// take the whole stack at once, the reactor is the only consumer
+	ctx = atomic_exchange( &reactor->resumeHead, NULL );
+	for ( ; ctx != NULL; ctx = next)
+	{
+		next = ctx->nextResume;
 
-		//int size = recv( contextStruct.clientSockFD, buffPtr, BUFFSIZE, 0 );
-		//fprintf(stderr, " size: %d\n", size );
+		gfs_nextRequest(ctx);
+		gfs_setNonBlocking(ctx->clientSockFD, TRUE);
 
-		// parse the request
-		gfs_parseRxHeader(buffPtr, size, &contextStruct);
-		fprintf(stderr, " status: %d\n", contextStruct.reqStatus );
-		if (contextStruct.reqStatus == GF_FILE_NOT_FOUND)
+		event.events   = EPOLLIN | EPOLLRDHUP | EPOLLET;
+		event.data.ptr = ctx;
+		if (epoll_ctl(reactor->epollFD, EPOLL_CTL_ADD, ctx->clientSockFD, &event) < 0)
 		{
-			fprintf(stderr, " malformed request ");
-			gfs_sendheader(&contextStruct, contextStruct.reqStatus, 0);	
+			GFS_LOG(LOG_ERROR, "epoll_ctl() failed");
+			gfs_closeConn(ctx);
+			continue;
 		}
-		else
+
+		// serve a request that is already buffered right away
+		if (ctx->rxLen > 0)
 		{
-			// get the data and send the response
-			int status = gfs->handleFunc( &contextStruct, contextStruct.reqPath, gfs->handleArg );
-			if (status < 0)
-			{
-				fprintf(stderr, " file handler failed ");
-			}
+			gfs_readRequest(gfs, ctx);
 		}
 	}
 }
 
 
-//------------ gfs_getRequest -------------//
-// NOTE: this function makes sure an entire request is received, before progressing to the Rx header parser
-static int gfs_getRequest( char* buffPtr, int buffSize, int socket )
+//------------ gfs_nextRequest -------------//
+// NOTE: drops the finished request, keeps whatever was received behind it
+static void gfs_nextRequest(gfcontext_t* ctx)
 {
-	int   size = 0;
-	char* ch; 
+	ctx->rxLen -= ctx->reqLen;
+	memmove(ctx->rxBuf, &ctx->rxBuf[ctx->reqLen], ctx->rxLen);
+	ctx->fileLen   = 0;
+	ctx->bytesSent = 0;
+	gfs_parserInit(ctx);
+	ctx->deadline  = gfs_nowMs() + ( (ctx->rxLen > 0) ? REQUEST_TIMEOUT_MS : KEEPALIVE_TIMEOUT_MS );
+	ctx->tStart    = (ctx->rxLen > 0) ? gfs_nowNs() : 0;
+	atomic_store( &ctx->state, CTX_READING );
+}
+
+
+//------------ gfs_sweepIdleConns -------------//
+// NOTE: only the reactor moves a context out of CTX_READING, so those can be closed safely here
+static void gfs_sweepIdleConns(gfserver_t* gfs, gfs_reactor_t* reactor, uint64_t now)
+{
+	int i = 0;
+	gfcontext_t* ctx;
+
+	for (i=0; i<gfs->ctxPool.size; ++i)
+	{
+		ctx = &gfs->ctxPool.ctxs[i];
+		if ( atomic_load( &ctx->state ) == CTX_READING && ctx->reactor == reactor && now >= ctx->deadline )
+		{
+			gfs_count(CNT_TIMEOUTS, 1);
+			gfs_closeConn(ctx);
+		}
+	}
+}
+
+
+//------------ gfs_nowMs -------------//
+static uint64_t gfs_nowMs(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+//------------ gfs_nowNs -------------//
+static uint64_t gfs_nowNs(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+//------------ gfs_acceptClients -------------//
+// NOTE: the listening socket is edge-triggered, so accept until the backlog is drained
+static void gfs_acceptClients(gfserver_t* gfs, gfs_reactor_t* reactor)
+{
+	struct epoll_event event;
+	struct sockaddr_in clientAddr;
+	socklen_t clientLen;
+	int clientSockFD;
+
+	while (1)
+	{
+		clientLen    = sizeof(clientAddr);
+		clientSockFD = accept4(reactor->servSockFD, (struct sockaddr*)&clientAddr, &clientLen, SOCK_NONBLOCK);
+		if (clientSockFD < 0)
+		{
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+			{
+				GFS_LOG(LOG_ERROR, "accept() failed");
+			}
+			if (errno == EINTR)
+				continue;
+			return;
+		}
+
+		gfcontext_t* ctx = gfs_poolGet(&gfs->ctxPool);
+		if (ctx == NULL)
+		{
+			GFS_LOG(LOG_WARN, "out of connection contexts");
+			close(clientSockFD);
+			continue;
+		}
+		ctx->clientSockFD = clientSockFD;
+		ctx->reactor      = reactor;
+		ctx->deadline     = gfs_nowMs() + REQUEST_TIMEOUT_MS;
+		ctx->tStart       = gfs_nowNs();
+		atomic_store( &ctx->state, CTX_READING );
+		gfs_count(CNT_CONNS, 1);
+
+		event.events   = EPOLLIN | EPOLLRDHUP | EPOLLET;
+		event.data.ptr = ctx;
+		if (epoll_ctl(reactor->epollFD, EPOLL_CTL_ADD, clientSockFD, &event) < 0)
+		{
+			GFS_LOG(LOG_ERROR, "epoll_ctl() failed");
+			gfs_closeConn(ctx);
+		}
+	}
+}
+
+
+//------------ gfs_readRequest -------------//
+// NOTE: drains the socket until EAGAIN (edge-triggered), dispatching as soon as the 
+// request parser is done with the request. The read deadline is set by the first byte
+// of a request and not extended by later ones, so a client trickling its request in
+// can't hold on to the connection.
+static void gfs_readRequest(gfserver_t* gfs, gfcontext_t* ctx)
+{
+	int size = 0;
 
 	while (1)
 	{
-		size = recv( socket, buffPtr, buffSize, 0 );
 		// determine if the whole request has been received
-		ch = strchr(buffPtr, '\r');
-		if (ch != NULL)
+		if ( gfs_parseRequest(ctx) == TRUE )
 		{
-			break;
+			ctx->tParsed = gfs_nowNs();
+			gfs_dispatchRequest(gfs, ctx);
+			return;
+		}
+
+		// can't happen as long as REQ_MAX_LEN fits into rxBuf, the parser gives up first
+		if (ctx->rxLen >= RXBUFSIZE)
+		{
+			gfs_closeConn(ctx);
+			return;
+		}
+
+		size = recv( ctx->clientSockFD, &ctx->rxBuf[ctx->rxLen], RXBUFSIZE - ctx->rxLen, 0 );
+		if (size < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+			{
+				gfs_closeConn(ctx);
+			}
+			return;
+		}
+		else if (size == 0)
+		{
+			// client went away before completing its request
+			gfs_closeConn(ctx);
+			return;
+		}
+
+		// an idle keep-alive connection starts a new request
+		if (ctx->rxLen == 0)
+		{
+			ctx->deadline = gfs_nowMs() + REQUEST_TIMEOUT_MS;
+			ctx->tStart   = gfs_nowNs();
+		}
+		ctx->rxLen += size;
+	}
+}
+
+
+//------------ gfs_dispatchRequest -------------//
+// NOTE: the socket leaves the reactor and is switched back to blocking mode, 
+// so the handler can keep using gfs_send() as before
+static void gfs_dispatchRequest(gfserver_t* gfs, gfcontext_t* ctx)
+{
+	epoll_ctl(ctx->reactor->epollFD, EPOLL_CTL_DEL, ctx->clientSockFD, NULL);
+	gfs_setNonBlocking(ctx->clientSockFD, FALSE);
+	gfs_handleRequest(gfs, ctx);
+}
+
+
+//------------ gfs_handleRequest -------------//
+// NOTE: hands a parsed request to the handler, or answers a malformed one
+static void gfs_handleRequest(gfserver_t* gfs, gfcontext_t* ctx)
+{
+	atomic_store( &ctx->state, CTX_HANDLER );
+
+	ctx->tDispatch = gfs_nowNs();
+	ctx->tHead     = 0;
+	gfs_timePhase(PHASE_PARSE, ctx->tStart, ctx->tParsed);
+	gfs_timePhase(PHASE_DISPATCH, ctx->tParsed, ctx->tDispatch);
+
+	GFS_LOG(LOG_DEBUG, "request %s, status %d", ctx->reqPath, ctx->reqStatus);
+	if (ctx->reqStatus == GF_FILE_NOT_FOUND)
+	{
+		GFS_LOG(LOG_DEBUG, "malformed request");
+		gfs_count(CNT_MALFORMED, 1);
+		gfs_sendheader(ctx, ctx->reqStatus, 0);	
+	}
+	else if (gfs->statsEnabled == TRUE && strcmp(ctx->reqPath, STATS_PATH) == 0)
+	{
+		gfs_serveStats(gfs, ctx);
+	}
+	else
+	{
+		// get the data and send the response; the handler owns the context from here on
+		int status = gfs->handleFunc( ctx, ctx->reqPath, gfs->handleArg );
+		if (status < 0)
+		{
+			GFS_LOG(LOG_WARN, "file handler failed");
+		}
+	}
+}
+
+
+//------------ gfs_statsSlot -------------//
+// NOTE: the calling thread's statistics slot
+static gfs_stats_t* gfs_statsSlot(void)
+{
+	int idx;
+
+	if (gfs_myStats == NULL)
+	{
+		idx = atomic_fetch_add( &gfs_numStats, 1 );
+		gfs_myStats = &gfs_stats[ (idx < STAT_SLOTS) ? idx : STAT_SLOTS - 1 ];
+	}
+
+	return gfs_myStats;
+}
+
+
+//------------ gfs_count -------------//
+static void gfs_count(int counter, uint64_t n)
+{
+	atomic_fetch_add_explicit( &gfs_statsSlot()->counters[counter], n, memory_order_relaxed );
+}
+
+
+//------------ gfs_histIndex -------------//
+// NOTE: values below PHASE_SUB_COUNT have a bucket each, above that every power of 2 
+// is split into PHASE_HALF_COUNT buckets
+static int gfs_histIndex(uint64_t value)
+{
+	int msb = 63 - __builtin_clzll( value | 1 );
+	int shift;
+
+	if (value < PHASE_SUB_COUNT)
+		return (int)value;
+	if (msb >= PHASE_MAX_BITS)
+		return PHASE_BUCKETS - 1;
+
+	shift = msb - PHASE_SUB_BITS + 1;
+	return PHASE_SUB_COUNT + (shift - 1) * PHASE_HALF_COUNT + (int)(value >> shift) - PHASE_HALF_COUNT;
+}
+
+
+//------------ gfs_histValue -------------//
+// NOTE: middle of the values counted in a bucket
+static uint64_t gfs_histValue(int index)
+{
+	int shift;
+	uint64_t sub;
+
+	if (index < PHASE_SUB_COUNT)
+		return index;
+
+	shift = (index - PHASE_SUB_COUNT) / PHASE_HALF_COUNT + 1;
+	sub   = (index - PHASE_SUB_COUNT) % PHASE_HALF_COUNT + PHASE_HALF_COUNT;
+
+	return (sub << shift) + ( (1ULL << shift) >> 1 );
+}
+
+
+//------------ gfs_timePhase -------------//
+// NOTE: a phase whose start wasn't seen (0) isn't counted
+static void gfs_timePhase(int phase, uint64_t from, uint64_t to)
+{
+	gfs_stats_t* stats = gfs_statsSlot();
+	uint64_t us;
+
+	if (from == 0 || to < from)
+	{
+		return;
+	}
+
+	us = (to - from) / 1000;
+	atomic_fetch_add_explicit( &stats->phaseSum[phase], us, memory_order_relaxed );
+	atomic_fetch_add_explicit( &stats->phaseHist[phase][gfs_histIndex(us)], 1, memory_order_relaxed );
+}
+
+
+//------------ gfs_headerSent -------------//
+static void gfs_headerSent(gfcontext_t* ctx)
+{
+	ctx->tHead = gfs_nowNs();
+	gfs_timePhase(PHASE_FIRSTBYTE, ctx->tStart, ctx->tHead);
+}
+
+
+//------------ gfs_mark_dequeued -------------//
+// NOTE: a handler that queues requests for worker threads calls this when a worker 
+// takes one, to time the queue wait
+void gfs_mark_dequeued(gfcontext_t* ctx)
+{
+	gfs_timePhase(PHASE_QUEUE, ctx->tDispatch, gfs_nowNs());
+}
+
+
+//------------ gfs_formatStats -------------//
+// NOTE: adds up every thread's slot. Slots are read while their owners keep counting, 
+// so a report may be off by the requests in flight, never more.
+static size_t gfs_formatStats(gfserver_t* gfs, char* buf, size_t size)
+{
+	uint64_t hist[PHASE_BUCKETS];
+	uint64_t counters[NUM_COUNTERS] = { 0 };
+	uint64_t count, sum, seen, pct[4];
+	int numSlots = atomic_load( &gfs_numStats );
+	int slot, phase, i, p;
+	size_t len = 0;
+	static const double PCTS[4] = { 50.0, 90.0, 99.0, 99.9 };
+
+	if (numSlots > STAT_SLOTS)
+		numSlots = STAT_SLOTS;
+
+	for (slot=0; slot<numSlots; ++slot)
+	{
+		for (i=0; i<NUM_COUNTERS; ++i)
+			counters[i] += atomic_load_explicit( &gfs_stats[slot].counters[i], memory_order_relaxed );
+	}
+	len += snprintf( &buf[len], size - len, 
+				"connections %" PRIu64 "\nok %" PRIu64 "\nfile_not_found %" PRIu64 "\nerror %" PRIu64 "\nmalformed %" PRIu64 
+				"\naborted %" PRIu64 "\ntimeouts %" PRIu64 "\nbytes_sent %" PRIu64 "\n",
+				counters[CNT_CONNS], counters[CNT_OK], counters[CNT_NOTFOUND], counters[CNT_ERROR],
+				counters[CNT_MALFORMED], counters[CNT_ABORTED], counters[CNT_TIMEOUTS], counters[CNT_BYTES] );
+	len += snprintf( &buf[len], size - len, "%-18s %10s %10s %10s %10s %10s %10s\n", 
+				"phase_us", "count", "mean", "p50", "p90", "p99", "p99.9" );
+
+	for (phase=0; phase<NUM_PHASES && len < size; ++phase)
+	{
+		memset( hist, 0, sizeof(hist) );
+		count = 0;
+		sum   = 0;
+		for (slot=0; slot<numSlots; ++slot)
+		{
+			sum += atomic_load_explicit( &gfs_stats[slot].phaseSum[phase], memory_order_relaxed );
+			for (i=0; i<PHASE_BUCKETS; ++i)
+				hist[i] += atomic_load_explicit( &gfs_stats[slot].phaseHist[phase][i], memory_order_relaxed );
+		}
+		for (i=0; i<PHASE_BUCKETS; ++i)
+			count += hist[i];
+
+		// percentiles are the middle of the bucket they fall into
+		for (p=0; p<4; ++p)
+		{
+			seen = 0;
+			for (i=0; i<PHASE_BUCKETS - 1; ++i)
+			{
+				seen += hist[i];
+				if ( seen > 0 && (double)seen >= PCTS[p] / 100.0 * count )
+					break;
+			}
+			pct[p] = (count > 0) ? gfs_histValue(i) : 0;
+		}
+
+		len += snprintf( &buf[len], size - len, "%-18s %10" PRIu64 " %10" PRIu64 " %10" PRIu64 " %10" PRIu64 " %10" PRIu64 " %10" PRIu64 "\n", 
+					PHASE_NAMES[phase], count, (count > 0) ? sum / count : 0, pct[0], pct[1], pct[2], pct[3] );
+	}
+	if (gfs->statsFunc != NULL && len < size)
+	{
+		len += gfs->statsFunc( &buf[len], size - len );
+	}
+
+	return (len < size) ? len : size - 1;
+}
+
+
+//------------ gfs_serveStats -------------//
+// NOTE: answers STATS_PATH on the reactor thread, the report is small
+static void gfs_serveStats(gfserver_t* gfs, gfcontext_t* ctx)
+{
+	char buf[STATS_BUFSIZE];
+	size_t len = gfs_formatStats(gfs, buf, sizeof(buf));
+
+	gfs_sendheader(ctx, GF_OK, len);
+	if (gfs_send(ctx, buf, len) < 0)
+	{
+		gfs_abort(ctx);
+	}
+}
+
+
+//------------ gfs_logRing -------------//
+// NOTE: the calling thread's log ring, NULL once every ring is taken
+static gfs_logring_t* gfs_logRing(void)
+{
+	int idx;
+
+	if (gfs_myLog == NULL)
+	{
+		idx = atomic_fetch_add( &gfs_numLogRings, 1 );
+		if (idx >= LOG_MAX_RINGS)
+			return NULL;
+
+		gfs_myLog = (gfs_logring_t*)aligned_alloc( 64, sizeof(gfs_logring_t) );
+		if (gfs_myLog == NULL)
+			return NULL;
+		memset( gfs_myLog, 0, sizeof(gfs_logring_t) );
+		atomic_store( &gfs_logRings[idx], gfs_myLog );
+	}
+
+	return gfs_myLog;
+}
+
+
+//------------ gfs_logWrite -------------//
+// NOTE: a failed write to stderr is not reported anywhere, the output is lost
+static void gfs_logWrite(const char* buf, size_t len)
+{
+	ssize_t bytesWritten;
+
+	while (len > 0)
+	{
+		bytesWritten = write(STDERR_FILENO, buf, len);
+		if (bytesWritten < 0 && errno == EINTR)
+			continue;
+		if (bytesWritten <= 0)
+			return;
+		buf += bytesWritten;
+		len -= bytesWritten;
+	}
+}
+
+
+//------------ gfs_logDrain -------------//
+// NOTE: writes out everything that is in the rings; returns the number of records written.
+// Called with gfs_logLock held.
+static int gfs_logDrain(void)
+{
+	char out[LOG_OUTBUFSIZE];
+	size_t outLen = 0;
+	int numRings = atomic_load( &gfs_numLogRings );
+	int written = 0;
+	int i;
+	unsigned head, tail;
+	uint64_t dropped;
+	gfs_logring_t* ring;
+	gfs_logrec_t*  rec;
+
+	if (numRings > LOG_MAX_RINGS)
+		numRings = LOG_MAX_RINGS;
+
+	for (i=0; i<numRings; ++i)
+	{
+		ring = atomic_load( &gfs_logRings[i] );
+		if (ring == NULL)
+			continue;
+
+		head = atomic_load_explicit( &ring->head, memory_order_relaxed );
+		tail = atomic_load_explicit( &ring->tail, memory_order_acquire );
+		for ( ; head != tail; ++head, ++written)
+		{
+			if (outLen + LOG_RECORD_LEN > sizeof(out))
+			{
+				gfs_logWrite(out, outLen);
+				outLen = 0;
+			}
+			rec = &ring->recs[head & (LOG_RING_SIZE - 1)];
+			memcpy( &out[outLen], rec->text, rec->len );
+			outLen += rec->len;
+		}
+		atomic_store_explicit( &ring->head, head, memory_order_release );
+
+		dropped = atomic_load_explicit( &ring->dropped, memory_order_relaxed );
+		if (dropped != ring->reported && outLen + 64 <= sizeof(out))
+		{
+			outLen += snprintf( &out[outLen], sizeof(out) - outLen, "log: %" PRIu64 " records dropped\n", dropped - ring->reported );
+			ring->reported = dropped;
+		}
+	}
+
+	gfs_logWrite(out, outLen);
+
+	return written;
+}
+
+
+//------------ gfs_logThread -------------//
+// NOTE: the log writer; sleeps LOG_IDLE_MS whenever the rings are empty
+static void* gfs_logThread(void* arg)
+{
+	struct timespec idle = { 0, LOG_IDLE_MS * 1000000L };
+	int written;
+
+	while (1)
+	{
+		pthread_mutex_lock( &gfs_logLock );
+		written = gfs_logDrain();
+		pthread_mutex_unlock( &gfs_logLock );
+
+		if (written == 0)
+			nanosleep(&idle, NULL);
+	}
+
+	return NULL;
+}
+
+
+//------------ gfs_logFlush -------------//
+// NOTE: writes out what is left in the rings when the process exits
+static void gfs_logFlush(void)
+{
+	pthread_mutex_lock( &gfs_logLock );
+	gfs_logDrain();
+	pthread_mutex_unlock( &gfs_logLock );
+}
+
+
+//------------ gfs_logStart -------------//
+static void gfs_logStart(void)
+{
+	pthread_t thread;
+	pthread_attr_t attr;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&thread, &attr, gfs_logThread, NULL) != 0)
+	{
+		fprintf(stderr, "%s @ %d: pthread_create() failed, logging stays synchronous\n", __FILE__, __LINE__);
+	}
+	pthread_attr_destroy(&attr);
+	atexit(gfs_logFlush);
+}
+
+
+//------------ gfs_log -------------//
+// NOTE: use through GFS_LOG(), which drops messages above GFS_LOG_LEVEL at compile time.
+// Formats the message into the calling thread's ring and returns, the log writer thread 
+// does the write(). Never blocks: if the ring is full the message is dropped and counted.
+void gfs_log(int level, const char* file, int line, const char* fmt, ...)
+{
+	gfs_logring_t* ring;
+	char*    text;
+	char     local[LOG_RECORD_LEN];
+	unsigned tail;
+	int      len;
+	va_list  args;
+
+	pthread_once( &gfs_logOnce, gfs_logStart );
+
+	ring = gfs_logRing();
+	if (ring != NULL)
+	{
+		tail = atomic_load_explicit( &ring->tail, memory_order_relaxed );
+		if (tail - atomic_load_explicit( &ring->head, memory_order_acquire ) >= LOG_RING_SIZE)
+		{
+			atomic_fetch_add_explicit( &ring->dropped, 1, memory_order_relaxed );
+			return;
+		}
+		text = ring->recs[tail & (LOG_RING_SIZE - 1)].text;
+	}
+	else
+	{
+		text = local;
+	}
+
+	// "<file> @ <line>: <level>: <message>\n", cut to LOG_RECORD_LEN
+	len = snprintf( text, LOG_RECORD_LEN, "%s @ %d: %s: ", file, line, LOG_NAMES[level] );
+	if (len < LOG_RECORD_LEN)
+	{
+		va_start(args, fmt);
+		len += vsnprintf( &text[len], LOG_RECORD_LEN - len, fmt, args );
+		va_end(args);
+	}
+	if (len > LOG_RECORD_LEN - 2)
+		len = LOG_RECORD_LEN - 2;
+	text[len++] = '\n';
+
+	// more threads than rings, write it ourselves
+	if (ring == NULL)
+	{
+		gfs_logWrite(text, len);
+		return;
+	}
+
+	ring->recs[tail & (LOG_RING_SIZE - 1)].len = len;
+	atomic_store_explicit( &ring->tail, tail + 1, memory_order_release );
+}
+
+
+//------------ gfserver_serve -------------//
+// NOTE: the calling thread runs the first reactor, the others get a thread of their own.
+// All of them share the context pool and the handler.
+void gfserver_serve(gfserver_t* gfs)
+{
+	int i = 0;
+
+	if (gfs->numReactors < 1)
+	{
+		gfs->numReactors = 1;
+	}
+
+	if (gfs_poolInit(&gfs->ctxPool, gfs, CTX_POOL_SIZE) < 0)
+	{
+		fprintf(stderr, "%s @ %d: context pool allocation failed\n", __FILE__, __LINE__);
+		exit(1);
+	}
+
+	gfs->reactors = calloc( gfs->numReactors, sizeof(gfs_reactor_t) );
+	if (gfs->reactors == NULL)
+	{
+		fprintf(stderr, "%s @ %d: reactor allocation failed\n", __FILE__, __LINE__);
+		exit(1);
+	}
+
+	// bind all listening sockets up front, so a port conflict stops the server right away
+	for (i=0; i<gfs->numReactors; ++i)
+	{
+		gfs->reactors[i].gfs        = gfs;
+		gfs->reactors[i].servSockFD = gfs_SetUpTCPConnection(gfs);
+		if (gfs->reactors[i].servSockFD < 0)
+		{
+		   exit(1);
+		}  
+
+		// can't fail for a valid socket
+		listen(gfs->reactors[i].servSockFD, gfs->maxPending);
+	}
+
+	for (i=1; i<gfs->numReactors; ++i)
+	{
+		if (pthread_create( &gfs->reactors[i].thread, NULL, gfs_reactorThread, &gfs->reactors[i] ) != 0)
+		{
+			fprintf(stderr, "%s @ %d: pthread_create() failed\n", __FILE__, __LINE__);
+			exit(1);
 		}
-		buffPtr += size;
 	}
 
-	return size;
+	gfs_reactorThread(&gfs->reactors[0]);
+}
+
+
+//------------ gfs_reactorThread -------------//
+static void* gfs_reactorThread(void* arg)
+{
+	gfs_reactor_t* reactor = (gfs_reactor_t*)arg;
+
+#ifdef GFS_HAVE_URING
+	if (reactor->gfs->engine == GFS_ENGINE_URING)
+	{
+		// only returns if the kernel doesn't support io_uring
+		gfs_serveUring(reactor->gfs, reactor);
+		fprintf(stderr, "%s @ %d: io_uring not available, using epoll\n", __FILE__, __LINE__);
+	}
+#endif
+
+	gfs_serveEpoll(reactor->gfs, reactor);
+
+	return NULL;
 }
 
 
+//------------ gfs_serveEpoll -------------//
+// NOTE: edge-triggered epoll reactor, one per acceptor thread. The listening socket and every client 
+// still sending its request are non-blocking, so a slow client never stalls the others.
+// Keep-alive connections come back to the reactor when their response is done, and are 
+// closed after KEEPALIVE_TIMEOUT_MS without a new request, connections sending a request
+// after REQUEST_TIMEOUT_MS.
+static void gfs_serveEpoll(gfserver_t* gfs, gfs_reactor_t* reactor)
+{
+	struct epoll_event event;
+	struct epoll_event events[MAX_EVENTS];
+	int numEvents = 0;
+	int i = 0;
+	uint64_t now, nextSweep;
+
+	gfs_setNonBlocking(reactor->servSockFD, TRUE);
+
+	reactor->epollFD = epoll_create1(0);
+	reactor->wakeFD  = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	atomic_init( &reactor->resumeHead, NULL );
+	if (reactor->epollFD < 0 || reactor->wakeFD < 0)
+	{
+		fprintf(stderr, "%s @ %d: epoll_create1()/eventfd() failed\n", __FILE__, __LINE__);
+		exit(1);
+	}
+
+	// the listening socket (NULL) and the wake-up eventfd (the reactor itself) carry no connection state
+	event.events   = EPOLLIN | EPOLLET;
+	event.data.ptr = NULL;
+	if (epoll_ctl(reactor->epollFD, EPOLL_CTL_ADD, reactor->servSockFD, &event) < 0)
+	{
+		fprintf(stderr, "%s @ %d: epoll_ctl() failed\n", __FILE__, __LINE__);
+		exit(1);
+	}
+	event.events   = EPOLLIN;
+	event.data.ptr = reactor;
+	if (epoll_ctl(reactor->epollFD, EPOLL_CTL_ADD, reactor->wakeFD, &event) < 0)
+	{
+		fprintf(stderr, "%s @ %d: epoll_ctl() failed\n", __FILE__, __LINE__);
+		exit(1);
+	}
+
+	nextSweep = gfs_nowMs() + SWEEP_INTERVAL_MS;
+	while(1)
+	{
+		numEvents = epoll_wait(reactor->epollFD, events, MAX_EVENTS, SWEEP_INTERVAL_MS);
+		if (numEvents < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "%s @ %d: epoll_wait() failed\n", __FILE__, __LINE__);
+			exit(1);
+		}
+
+		for (i=0; i<numEvents; ++i)
+		{
+			void* ptr = events[i].data.ptr;
+			if (ptr == NULL)
+			{
+				gfs_acceptClients(gfs, reactor);
+			}
+			else if (ptr == (void*)reactor)
+			{
+				gfs_rearmConns(gfs, reactor);
+			}
+			else if (events[i].events & EPOLLERR)
+			{
+				gfs_closeConn((gfcontext_t*)ptr);
+			}
+			else
+			{
+				gfs_readRequest(gfs, (gfcontext_t*)ptr);
+			}
+		}
+
+		now = gfs_nowMs();
+		if (now >= nextSweep)
+		{
+			gfs_sweepIdleConns(gfs, reactor, now);
+			nextSweep = now + SWEEP_INTERVAL_MS;
+		}
+	}
+}
+
+
+
+#ifdef GFS_HAVE_URING
+//------------ gfs_uringSetup -------------//
+// NOTE: sets up a ring with plain syscalls (no liburing) and maps its queues
+static int gfs_uringSetup(gfs_uring_t* ring, unsigned entries)
+{
+	struct io_uring_params params;
+	size_t sqSize, cqSize;
+
+	memset(&params, 0, sizeof(params));
+	ring->ringFD = syscall(__NR_io_uring_setup, entries, &params);
+	if (ring->ringFD < 0)
+	{
+		return -1;
+	}
+
+	sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	cqSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		sqSize = cqSize = (sqSize > cqSize) ? sqSize : cqSize;
+	}
+
+	ring->sqRing = mmap(NULL, sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ringFD, IORING_OFF_SQ_RING);
+	if (ring->sqRing == MAP_FAILED)
+	{
+		close(ring->ringFD);
+		return -1;
+	}
+	ring->cqRing = ring->sqRing;
+	if ( !(params.features & IORING_FEAT_SINGLE_MMAP) )
+	{
+		ring->cqRing = mmap(NULL, cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ringFD, IORING_OFF_CQ_RING);
+		if (ring->cqRing == MAP_FAILED)
+		{
+			munmap(ring->sqRing, sqSize);
+			close(ring->ringFD);
+			return -1;
+		}
+	}
+	ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, 
+					  MAP_SHARED | MAP_POPULATE, ring->ringFD, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+	{
+		if (ring->cqRing != ring->sqRing)
+			munmap(ring->cqRing, cqSize);
+		munmap(ring->sqRing, sqSize);
+		close(ring->ringFD);
+		return -1;
+	}
+
+	ring->sqHead    = (_Atomic unsigned*)(ring->sqRing + params.sq_off.head);
+	ring->sqTail    = (_Atomic unsigned*)(ring->sqRing + params.sq_off.tail);
+	ring->sqMask    = *(unsigned*)(ring->sqRing + params.sq_off.ring_mask);
+	ring->sqArray   = (unsigned*)(ring->sqRing + params.sq_off.array);
+	ring->sqEntries = params.sq_entries;
+	ring->cqHead    = (_Atomic unsigned*)(ring->cqRing + params.cq_off.head);
+	ring->cqTail    = (_Atomic unsigned*)(ring->cqRing + params.cq_off.tail);
+	ring->cqMask    = *(unsigned*)(ring->cqRing + params.cq_off.ring_mask);
+	ring->cqes      = (struct io_uring_cqe*)(ring->cqRing + params.cq_off.cqes);
+	ring->sqSize    = sqSize;
+	ring->cqSize    = cqSize;
+	ring->toSubmit  = 0;
+
+	return 0;
+}
+
+
+//------------ gfs_uringCleanup -------------//
+static void gfs_uringCleanup(gfs_uring_t* ring)
+{
+	munmap(ring->sqes, ring->sqEntries * sizeof(struct io_uring_sqe));
+	if (ring->cqRing != ring->sqRing)
+		munmap(ring->cqRing, ring->cqSize);
+	munmap(ring->sqRing, ring->sqSize);
+	close(ring->ringFD);
+}
+
+
+//------------ gfs_uringEnter -------------//
+// NOTE: submits everything queued so far, waiting for at least minComplete completions
+static int gfs_uringEnter(gfs_uring_t* ring, unsigned minComplete)
+{
+	int status = 0;
+
+	do
+	{
+		status = syscall(__NR_io_uring_enter, ring->ringFD, ring->toSubmit, minComplete, 
+						 (minComplete > 0) ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	} while (status < 0 && errno == EINTR);
+
+	if (status > 0)
+	{
+		ring->toSubmit = ((unsigned)status >= ring->toSubmit) ? 0 : ring->toSubmit - status;
+	}
+
+	return status;
+}
+
+
+//------------ gfs_uringGetSqe -------------//
+// NOTE: the submission queue is only flushed when it is full, otherwise 
+// everything queued during one loop iteration goes to the kernel in one call
+static struct io_uring_sqe* gfs_uringGetSqe(gfs_uring_t* ring, uint64_t userData)
+{
+	struct io_uring_sqe* sqe;
+	unsigned tail = atomic_load_explicit(ring->sqTail, memory_order_relaxed);
+
+	while (tail - atomic_load_explicit(ring->sqHead, memory_order_acquire) >= ring->sqEntries)
+	{
+		gfs_uringEnter(ring, 0);
+	}
+
+	ring->sqArray[tail & ring->sqMask] = tail & ring->sqMask;
+	sqe = &ring->sqes[tail & ring->sqMask];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->user_data = userData;
+
+	atomic_store_explicit(ring->sqTail, tail + 1, memory_order_release);
+	++ring->toSubmit;
+
+	return sqe;
+}
+
+
+//------------ gfs_uringRecv -------------//
+// NOTE: with registered buffers the recv lands in the context pool, which is one fixed buffer
+static void gfs_uringRecv(gfs_uring_t* ring, gfcontext_t* ctx)
+{
+	struct io_uring_sqe* sqe = gfs_uringGetSqe(ring, (uint64_t)(uintptr_t)ctx);
+
+	sqe->opcode = (ring->fixedBufs == TRUE) ? IORING_OP_READ_FIXED : IORING_OP_RECV;
+	sqe->fd     = ctx->clientSockFD;
+	sqe->addr   = (uint64_t)(uintptr_t)&ctx->rxBuf[ctx->rxLen];
+	sqe->len    = RXBUFSIZE - ctx->rxLen;
+	sqe->buf_index = 0;
+}
+
+
+//------------ gfs_uringAccept -------------//
+static void gfs_uringAccept(gfs_uring_t* ring, int servSockFD)
+{
+	struct io_uring_sqe* sqe = gfs_uringGetSqe(ring, URING_ACCEPT);
+
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd     = servSockFD;
+}
+
+
+//------------ gfs_uringWake -------------//
+static void gfs_uringWake(gfs_uring_t* ring, int wakeFD)
+{
+	struct io_uring_sqe* sqe = gfs_uringGetSqe(ring, URING_WAKE);
+
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd     = wakeFD;
+	sqe->addr   = (uint64_t)(uintptr_t)&ring->wakeCount;
+	sqe->len    = sizeof(ring->wakeCount);
+}
+
+
+//------------ gfs_uringTick -------------//
+static void gfs_uringTick(gfs_uring_t* ring)
+{
+	struct io_uring_sqe* sqe = gfs_uringGetSqe(ring, URING_TICK);
+
+	ring->tick.tv_sec  = SWEEP_INTERVAL_MS / 1000;
+	ring->tick.tv_nsec = (SWEEP_INTERVAL_MS % 1000) * 1000000;
+	sqe->opcode = IORING_OP_TIMEOUT;
+	sqe->addr   = (uint64_t)(uintptr_t)&ring->tick;
+	sqe->len    = 1;
+}
+
+
+//------------ gfs_uringRequest -------------//
+// NOTE: parses what has been received so far, then either dispatches the request or receives more
+static void gfs_uringRequest(gfserver_t* gfs, gfs_uring_t* ring, gfcontext_t* ctx)
+{
+	if ( gfs_parseRequest(ctx) == TRUE )
+	{
+		ctx->tParsed = gfs_nowNs();
+		gfs_handleRequest(gfs, ctx);
+	}
+	else if (ctx->rxLen >= RXBUFSIZE)
+	{
+		gfs_closeConn(ctx);
+	}
+	else
+	{
+		gfs_uringRecv(ring, ctx);
+	}
+}
+
+
+//------------ gfs_txPipe -------------//
+// NOTE: the pipe file bodies are spliced through, as large as the kernel lets us have it
+static int gfs_txPipe(gfs_txring_t* tx)
+{
+	int size;
+
+	if (pipe2(tx->pipeFD, O_CLOEXEC) < 0)
+	{
+		return -1;
+	}
+
+	size = fcntl(tx->pipeFD[1], F_SETPIPE_SZ, URING_PIPE_SIZE);
+	if (size < 0)
+		size = fcntl(tx->pipeFD[1], F_GETPIPE_SZ);
+	tx->pipeSize = (size > 0) ? size : PIPESIZE;
+
+	return 0;
+}
+
+
+//------------ gfs_txRing -------------//
+// NOTE: the calling thread's response ring if the server runs the io_uring engine, set up on 
+// first use; NULL means this thread sends with plain send()/sendfile()
+static gfs_txring_t* gfs_txRing(gfcontext_t* ctx)
+{
+	gfs_txring_t* tx;
+	int fds[TX_SLOTS];
+
+	if (gfs_myTx != NULL || ctx->gfs->engine != GFS_ENGINE_URING || gfs_myTxFailed == TRUE)
+	{
+		return gfs_myTx;
+	}
+
+	// only tried once per thread
+	gfs_myTxFailed = TRUE;
+	tx = calloc(1, sizeof(gfs_txring_t));
+	if (tx == NULL)
+	{
+		return NULL;
+	}
+	if (gfs_uringSetup(&tx->ring, URING_TX_ENTRIES) < 0)
+	{
+		free(tx);
+		return NULL;
+	}
+	if (gfs_txPipe(tx) < 0)
+	{
+		gfs_uringCleanup(&tx->ring);
+		free(tx);
+		return NULL;
+	}
+
+	fds[TX_SLOT_SOCK]    = -1;
+	fds[TX_SLOT_PIPE_RD] = tx->pipeFD[0];
+	fds[TX_SLOT_PIPE_WR] = tx->pipeFD[1];
+	if (syscall(__NR_io_uring_register, tx->ring.ringFD, IORING_REGISTER_FILES, fds, TX_SLOTS) < 0)
+	{
+		GFS_LOG(LOG_WARN, "no fixed files for the response ring, responses go out with send()");
+		close(tx->pipeFD[0]);
+		close(tx->pipeFD[1]);
+		gfs_uringCleanup(&tx->ring);
+		free(tx);
+		return NULL;
+	}
+
+	tx->sockFD = -1;
+	tx->noFD   = -1;
+	gfs_myTx       = tx;
+	gfs_myTxFailed = FALSE;
+
+	return tx;
+}
+
+
+//------------ gfs_txDisable -------------//
+// NOTE: this thread goes back to plain send()/sendfile() for good
+static void gfs_txDisable(gfs_txring_t* tx)
+{
+	close(tx->pipeFD[0]);
+	close(tx->pipeFD[1]);
+	gfs_uringCleanup(&tx->ring);
+	free(tx);
+
+	gfs_myTx       = NULL;
+	gfs_myTxFailed = TRUE;
+}
+
+
+//------------ gfs_txSqe -------------//
+// NOTE: queues an entry linked to the one queued before it; slot is a fixed file or -1
+static struct io_uring_sqe* gfs_txSqe(gfs_txring_t* tx, int opcode, int slot)
+{
+	struct io_uring_sqe* sqe;
+
+	if (tx->lastSqe != NULL)
+	{
+		tx->lastSqe->flags |= IOSQE_IO_LINK;
+	}
+
+	sqe = gfs_uringGetSqe(&tx->ring, tx->numSqes++);
+	sqe->opcode = opcode;
+	sqe->fd     = slot;
+	if (slot >= 0)
+	{
+		sqe->flags = IOSQE_FIXED_FILE;
+	}
+	tx->lastSqe = sqe;
+
+	return sqe;
+}
+
+
+//------------ gfs_txAttach -------------//
+// NOTE: queues the update that puts the connection into TX_SLOT_SOCK, unless it is there 
+// already. Returns its queue position, or -1 if nothing was queued.
+static int gfs_txAttach(gfs_txring_t* tx, gfcontext_t* ctx)
+{
+	struct io_uring_sqe* sqe;
+
+	if (tx->ctx == ctx && tx->sockFD == ctx->clientSockFD)
+	{
+		return -1;
+	}
+
+	tx->slotFD = ctx->clientSockFD;
+	sqe = gfs_txSqe(tx, IORING_OP_FILES_UPDATE, -1);
+	sqe->addr = (uint64_t)(uintptr_t)&tx->slotFD;
+	sqe->len  = 1;
+	sqe->off  = TX_SLOT_SOCK;
+
+	tx->ctx    = ctx;
+	tx->sockFD = ctx->clientSockFD;
+
+	return tx->numSqes - 1;
+}
+
+
+//------------ gfs_txDetach -------------//
+// NOTE: queues the update that empties TX_SLOT_SOCK at the end of a response, see gfs_txDetached()
+static int gfs_txDetach(gfs_txring_t* tx)
+{
+	struct io_uring_sqe* sqe = gfs_txSqe(tx, IORING_OP_FILES_UPDATE, -1);
+
+	sqe->addr = (uint64_t)(uintptr_t)&tx->noFD;
+	sqe->len  = 1;
+	sqe->off  = TX_SLOT_SOCK;
+
+	return tx->numSqes - 1;
+}
+
+
+//------------ gfs_txDetached -------------//
+// NOTE: the slot is emptied right away if the queued update didn't run
+static void gfs_txDetached(gfs_txring_t* tx, int detach)
+{
+	if (detach < 0)
+	{
+		return;
+	}
+
+	if (tx->res[detach] >= 0)
+	{
+		tx->ctx    = NULL;
+		tx->sockFD = -1;
+	}
+	else
+	{
+		gfs_txRelease(tx);
+	}
+}
+
+
+//------------ gfs_txRelease -------------//
+// NOTE: empties TX_SLOT_SOCK without a round trip through the ring
+static void gfs_txRelease(gfs_txring_t* tx)
+{
+	struct io_uring_files_update update;
+
+	if (tx->ctx == NULL)
+	{
+		return;
+	}
+
+	memset(&update, 0, sizeof(update));
+	update.offset = TX_SLOT_SOCK;
+	update.fds    = (uint64_t)(uintptr_t)&tx->noFD;
+	if (syscall(__NR_io_uring_register, tx->ring.ringFD, IORING_REGISTER_FILES_UPDATE, &update, 1) < 0)
+	{
+		GFS_LOG(LOG_ERROR, "fixed file update failed, %s", strerror(errno));
+	}
+
+	tx->ctx    = NULL;
+	tx->sockFD = -1;
+}
+
+
+//------------ gfs_txSendSqe -------------//
+static int gfs_txSendSqe(gfs_txring_t* tx, const char* buf, size_t len, int flags)
+{
+	struct io_uring_sqe* sqe = gfs_txSqe(tx, IORING_OP_SEND, TX_SLOT_SOCK);
+
+	sqe->addr      = (uint64_t)(uintptr_t)buf;
+	sqe->len       = len;
+	sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL | flags;
+
+	return tx->numSqes - 1;
+}
+
+
+//------------ gfs_txSubmit -------------//
+// NOTE: submits the queued chain and waits for all of it; tx->res[] holds the results.
+// Returns -1 if the ring failed, it is gone then.
+static int gfs_txSubmit(gfs_txring_t* tx)
+{
+	struct io_uring_cqe* cqe;
+	unsigned head;
+	int reaped = 0;
+
+	tx->lastSqe = NULL;
+	while (reaped < tx->numSqes)
+	{
+		// NOTE: an entry the kernel refused to take leaves toSubmit behind
+		if (gfs_uringEnter(&tx->ring, tx->numSqes - reaped) < 0 || tx->ring.toSubmit > 0)
+		{
+			GFS_LOG(LOG_ERROR, "io_uring_enter() failed, responses go out with send() from now on");
+			gfs_txDisable(tx);
+			return -1;
+		}
+
+		head = atomic_load_explicit(tx->ring.cqHead, memory_order_relaxed);
+		while (head != atomic_load_explicit(tx->ring.cqTail, memory_order_acquire))
+		{
+			cqe = &tx->ring.cqes[head & tx->ring.cqMask];
+			tx->res[cqe->user_data] = cqe->res;
+			atomic_store_explicit(tx->ring.cqHead, ++head, memory_order_release);
+			++reaped;
+		}
+	}
+	tx->numSqes = 0;
+
+	return 0;
+}
+
+
+//------------ gfs_txRest -------------//
+// NOTE: a send of the ring that came back short, or was cancelled because an earlier one 
+// in its chain did, is finished with plain send()
+static int gfs_txRest(gfcontext_t* ctx, int res, const char* buf, size_t len, int flags)
+{
+	size_t total = (res > 0) ? res : 0;
+	ssize_t bytesSent;
+
+	if (res < 0 && res != -ECANCELED)
+	{
+		errno = -res;
+		return -1;
+	}
+
+	while (total < len)
+	{
+		bytesSent = send(ctx->clientSockFD, &buf[total], len - total, MSG_NOSIGNAL | flags);
+		if (bytesSent < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		total += bytesSent;
+	}
+
+	return 0;
+}
+
+
+//------------ gfs_txSend -------------//
+// NOTE: gfs_send() for the io_uring engine. The connection goes into the thread's fixed 
+// file slot, the pending header (MSG_MORE) and the body follow as linked sends, and the 
+// slot is emptied again once the body is complete: one io_uring_enter() per call.
+static ssize_t gfs_txSend(gfs_txring_t* tx, gfcontext_t* ctx, char* data, size_t len)
+{
+	BOOL done   = (ctx->bytesSent + len >= ctx->fileLen) ? TRUE : FALSE;
+	int  head   = -1;
+	int  detach = -1;
+	int  attach, body;
+
+	attach = gfs_txAttach(tx, ctx);
+	if (ctx->txHeadLen > 0)
+	{
+		head = gfs_txSendSqe(tx, ctx->txHead, ctx->txHeadLen, MSG_MORE);
+	}
+	body = gfs_txSendSqe(tx, data, len, 0);
+	if (done == TRUE)
+	{
+		detach = gfs_txDetach(tx);
+	}
+
+	if (gfs_txSubmit(tx) < 0)
+	{
+		return -1;
+	}
+	if (attach >= 0 && tx->res[attach] < 0)
+	{
+		// nothing has run, the kernel can't update fixed files from the ring
+		gfs_txDisable(tx);
+		return gfs_send(ctx, data, len);
+	}
+
+	if (head >= 0)
+	{
+		if (gfs_txRest(ctx, tx->res[head], ctx->txHead, ctx->txHeadLen, MSG_MORE) < 0)
+		{
+			gfs_txRelease(tx);
+			return -1;
+		}
+		ctx->txHeadLen = 0;
+		gfs_headerSent(ctx);
+	}
+	if (gfs_txRest(ctx, tx->res[body], data, len, 0) < 0)
+	{
+		gfs_txRelease(tx);
+		return -1;
+	}
+	gfs_txDetached(tx, detach);
+
+	ctx->bytesSent += len;
+	if (ctx->bytesSent >= ctx->fileLen)
+	{
+		gfs_finishResponse(ctx);
+	}
+
+	return len;
+}
+
+
+//------------ gfs_txSendHead -------------//
+// NOTE: gfs_sendHead() for the io_uring engine; a header without a body completes the response
+static int gfs_txSendHead(gfs_txring_t* tx, gfcontext_t* ctx, int flags)
+{
+	int detach = -1;
+	int attach, head;
+
+	attach = gfs_txAttach(tx, ctx);
+	head   = gfs_txSendSqe(tx, ctx->txHead, ctx->txHeadLen, flags);
+	if (ctx->fileLen == 0)
+	{
+		detach = gfs_txDetach(tx);
+	}
+
+	if (gfs_txSubmit(tx) < 0)
+	{
+		return -1;
+	}
+	if (attach >= 0 && tx->res[attach] < 0)
+	{
+		gfs_txDisable(tx);
+		return gfs_sendHead(ctx, flags);
+	}
+
+	if (gfs_txRest(ctx, tx->res[head], ctx->txHead, ctx->txHeadLen, flags) < 0)
+	{
+		gfs_txRelease(tx);
+		return -1;
+	}
+	ctx->txHeadLen = 0;
+	gfs_headerSent(ctx);
+	gfs_txDetached(tx, detach);
+
+	return 0;
+}
+
+
+//------------ gfs_txDrain -------------//
+// NOTE: what a broken chain left in the pipe goes to the socket with plain splice()
+static int gfs_txDrain(gfs_txring_t* tx, gfcontext_t* ctx, size_t inPipe)
+{
+	ssize_t moved;
+
+	while (inPipe > 0)
+	{
+		moved = splice(tx->pipeFD[0], NULL, ctx->clientSockFD, NULL, inPipe, SPLICE_F_MOVE);
+		if (moved < 0 && errno == EINTR)
+			continue;
+		if (moved <= 0)
+			return -1;
+		inPipe -= moved;
+	}
+
+	return 0;
+}
+
+
+//------------ gfs_txResetPipe -------------//
+// NOTE: after a socket error the pipe may still hold body bytes, a new one takes its slots
+static void gfs_txResetPipe(gfs_txring_t* tx)
+{
+	struct io_uring_files_update update;
+
+	close(tx->pipeFD[0]);
+	close(tx->pipeFD[1]);
+	if (gfs_txPipe(tx) < 0)
+	{
+		tx->pipeFD[0] = tx->pipeFD[1] = -1;
+		gfs_txDisable(tx);
+		return;
+	}
+
+	memset(&update, 0, sizeof(update));
+	update.offset = TX_SLOT_PIPE_RD;
+	update.fds    = (uint64_t)(uintptr_t)tx->pipeFD;
+	if (syscall(__NR_io_uring_register, tx->ring.ringFD, IORING_REGISTER_FILES_UPDATE, &update, 2) < 0)
+	{
+		gfs_txDisable(tx);
+	}
+}
+
+
+//------------ gfs_txSendCopy -------------//
+// NOTE: a small file body is read into the ring's buffer and sent from there, linked behind 
+// the pending header. io_uring hands every splice to a worker thread, a read of cached 
+// pages and a send both complete inline, and copying a few pages costs less than the hop.
+static ssize_t gfs_txSendCopy(gfs_txring_t* tx, gfcontext_t* ctx, int fileFD, off_t offset, size_t len)
+{
+	struct io_uring_sqe* sqe;
+	BOOL done   = (ctx->bytesSent + len >= ctx->fileLen) ? TRUE : FALSE;
+	int  head   = -1;
+	int  detach = -1;
+	int  attach, rd, body, got;
+	ssize_t bytesRead;
+
+	attach = gfs_txAttach(tx, ctx);
+	if (ctx->txHeadLen > 0)
+	{
+		head = gfs_txSendSqe(tx, ctx->txHead, ctx->txHeadLen, MSG_MORE);
+	}
+	sqe = gfs_txSqe(tx, IORING_OP_READ, -1);
+	sqe->fd   = fileFD;
+	sqe->addr = (uint64_t)(uintptr_t)tx->buf;
+	sqe->len  = len;
+	sqe->off  = offset;
+	rd   = tx->numSqes - 1;
+	body = gfs_txSendSqe(tx, tx->buf, len, 0);
+	if (done == TRUE)
+	{
+		detach = gfs_txDetach(tx);
+	}
+
+	if (gfs_txSubmit(tx) < 0)
+	{
+		return -1;
+	}
+	if (attach >= 0 && tx->res[attach] < 0)
+	{
+		gfs_txDisable(tx);
+		return gfs_sendfile(ctx, fileFD, offset, len);
+	}
+
+	if (head >= 0)
+	{
+		if (gfs_txRest(ctx, tx->res[head], ctx->txHead, ctx->txHeadLen, MSG_MORE) < 0)
+		{
+			gfs_txRelease(tx);
+			return -1;
+		}
+		ctx->txHeadLen = 0;
+		gfs_headerSent(ctx);
+	}
+
+	// a short or cancelled read is finished here, the send behind it was cancelled then
+	got = tx->res[rd];
+	if (got < 0 && got != -ECANCELED)
+	{
+		gfs_txRelease(tx);
+		return -1;
+	}
+	got = (got > 0) ? got : 0;
+	while ((size_t)got < len)
+	{
+		bytesRead = pread(fileFD, &tx->buf[got], len - got, offset + got);
+		if (bytesRead < 0 && errno == EINTR)
+			continue;
+		if (bytesRead < 0)
+		{
+			gfs_txRelease(tx);
+			return -1;
+		}
+		if (bytesRead == 0)
+		{
+			// file is shorter than announced
+			break;
+		}
+		got += bytesRead;
+	}
+
+	if (gfs_txRest(ctx, tx->res[body], tx->buf, got, 0) < 0)
+	{
+		gfs_txRelease(tx);
+		return -1;
+	}
+	gfs_txDetached(tx, detach);
+	if ((size_t)got < len)
+	{
+		gfs_txRelease(tx);
+	}
+
+	ctx->bytesSent += got;
+	if (ctx->bytesSent >= ctx->fileLen)
+	{
+		gfs_finishResponse(ctx);
+	}
+
+	return got;
+}
+
+
+//------------ gfs_txSendfile -------------//
+// NOTE: gfs_sendfile() for the io_uring engine, large bodies. Each chunk is a linked pair of splices, file 
+// into the pipe and pipe into the socket, both ends in fixed file slots; up to URING_TX_PAIRS 
+// pairs go to the kernel with one io_uring_enter(), behind the pending header. A pair that 
+// comes back short breaks the chain: what it left in the pipe is drained right away and the 
+// next round starts at the first byte not sent.
+static ssize_t gfs_txSendfile(gfs_txring_t* tx, gfcontext_t* ctx, int fileFD, off_t offset, size_t len)
+{
+	struct io_uring_sqe* sqe;
+	size_t chunk[URING_TX_PAIRS];
+	size_t total = 0;
+	size_t queued;
+	BOOL done = (ctx->bytesSent + len >= ctx->fileLen) ? TRUE : FALSE;
+	BOOL eof  = FALSE;
+	int attach, head, first, detach, numPairs, inPipe, moved, i;
+
+	if (len <= URING_COPY_MAX)
+	{
+		return gfs_txSendCopy(tx, ctx, fileFD, offset, len);
+	}
+
+	while (total < len && eof == FALSE)
+	{
+		attach = gfs_txAttach(tx, ctx);
+		head   = -1;
+		detach = -1;
+		if (ctx->txHeadLen > 0)
+		{
+			head = gfs_txSendSqe(tx, ctx->txHead, ctx->txHeadLen, MSG_MORE);
+		}
+
+		first  = tx->numSqes;
+		queued = total;
+		for (numPairs = 0; numPairs < URING_TX_PAIRS && queued < len; ++numPairs)
+		{
+			chunk[numPairs] = (len - queued < tx->pipeSize) ? len - queued : tx->pipeSize;
+
+			sqe = gfs_txSqe(tx, IORING_OP_SPLICE, TX_SLOT_PIPE_WR);
+			sqe->splice_fd_in  = fileFD;
+			sqe->splice_off_in = offset + queued;
+			sqe->off           = (uint64_t)-1;
+			sqe->len           = chunk[numPairs];
+			sqe->splice_flags  = SPLICE_F_MOVE;
+			queued += chunk[numPairs];
+
+			// NOTE: SPLICE_F_MORE up to the last chunk, see gfs_spliceFile()
+			sqe = gfs_txSqe(tx, IORING_OP_SPLICE, TX_SLOT_SOCK);
+			sqe->splice_fd_in  = TX_SLOT_PIPE_RD;
+			sqe->splice_off_in = (uint64_t)-1;
+			sqe->off           = (uint64_t)-1;
+			sqe->len           = chunk[numPairs];
+			sqe->splice_flags  = SPLICE_F_MOVE | SPLICE_F_FD_IN_FIXED | ((queued < len) ? SPLICE_F_MORE : 0);
+		}
+		if (done == TRUE && queued == len)
+		{
+			detach = gfs_txDetach(tx);
+		}
+
+		if (gfs_txSubmit(tx) < 0)
+		{
+			return -1;
+		}
+		if (attach >= 0 && tx->res[attach] < 0)
+		{
+			gfs_txDisable(tx);
+			return gfs_sendfile(ctx, fileFD, offset, len);
+		}
+
+		if (head >= 0)
+		{
+			if (gfs_txRest(ctx, tx->res[head], ctx->txHead, ctx->txHeadLen, MSG_MORE) < 0)
+			{
+				gfs_txRelease(tx);
+				return -1;
+			}
+			ctx->txHeadLen = 0;
+			gfs_headerSent(ctx);
+		}
+
+		for (i=0; i<numPairs; ++i)
+		{
+			inPipe = tx->res[first + 2*i];
+			moved  = tx->res[first + 2*i + 1];
+			if (inPipe == moved && inPipe > 0)
+			{
+				total += inPipe;
+				continue;
+			}
+
+			// the chain broke here, the rest of this round was cancelled
+			if (inPipe == -ECANCELED)
+				break;
+			if (inPipe < 0)
+			{
+				gfs_txRelease(tx);
+				return -1;
+			}
+			if (inPipe == 0)
+			{
+				// file is shorter than announced
+				eof = TRUE;
+				break;
+			}
+			if ( (moved < 0 && moved != -ECANCELED) || 
+				 gfs_txDrain(tx, ctx, inPipe - ((moved > 0) ? moved : 0)) < 0 )
+			{
+				gfs_txRelease(tx);
+				gfs_txResetPipe(tx);
+				return -1;
+			}
+			total += inPipe;
+			break;
+		}
+		gfs_txDetached(tx, detach);
+	}
+
+	// a short file ends the response as far as this thread is concerned
+	if (done == TRUE || eof == TRUE)
+	{
+		gfs_txRelease(tx);
+	}
+
+	ctx->bytesSent += total;
+	if (ctx->bytesSent >= ctx->fileLen)
+	{
+		gfs_finishResponse(ctx);
+	}
+
+	return total;
+}
+
+
+//------------ gfs_serveUring -------------//
+// NOTE: io_uring engine for one acceptor thread, same connection life cycle as gfs_serveEpoll().
+// Accepts, request receives, keep-alive wake-ups and the idle sweep timer are all
+// completions of one ring; everything queued while handling a batch of completions 
+// is submitted with the next wait, so a busy loop costs one syscall per batch.
+// Sockets stay blocking, the kernel polls them for us, and the handler gets them as is;
+// its responses go out through a ring of the sending thread, see gfs_txSend().
+// Returns only if the ring can't be set up.
+static void gfs_serveUring(gfserver_t* gfs, gfs_reactor_t* reactor)
+{
+	gfs_uring_t ring;
+	struct io_uring_cqe* cqe;
+	struct iovec pool;
+	gfcontext_t* ctx;
+	gfcontext_t* next;
+	uint64_t userData, now;
+	unsigned head;
+	int res, i;
+
+	if (gfs_uringSetup(&ring, URING_ENTRIES) < 0)
+	{
+		return;
+	}
+
+	// the whole context pool is one registered buffer, receives go straight into rxBuf
+	pool.iov_base  = gfs->ctxPool.ctxs;
+	pool.iov_len   = gfs->ctxPool.size * sizeof(gfcontext_t);
+	ring.fixedBufs = ( syscall(__NR_io_uring_register, ring.ringFD, IORING_REGISTER_BUFFERS, &pool, 1) == 0 ) ? TRUE : FALSE;
+
+	reactor->epollFD = -1;
+	reactor->wakeFD  = eventfd(0, EFD_CLOEXEC);
+	atomic_init( &reactor->resumeHead, NULL );
+	if (reactor->wakeFD < 0)
+	{
+		fprintf(stderr, "%s @ %d: eventfd() failed\n", __FILE__, __LINE__);
+		exit(1);
+	}
+
+	gfs_uringAccept(&ring, reactor->servSockFD);
+	gfs_uringWake(&ring, reactor->wakeFD);
+	gfs_uringTick(&ring);
+
+	while(1)
+	{
+		if (gfs_uringEnter(&ring, 1) < 0)
+		{
+			fprintf(stderr, "%s @ %d: io_uring_enter() failed\n", __FILE__, __LINE__);
+			exit(1);
+		}
+
+		head = atomic_load_explicit(ring.cqHead, memory_order_relaxed);
+		while (head != atomic_load_explicit(ring.cqTail, memory_order_acquire))
+		{
+			cqe      = &ring.cqes[head & ring.cqMask];
+			userData = cqe->user_data;
+			res      = cqe->res;
+			atomic_store_explicit(ring.cqHead, ++head, memory_order_release);
+
+			if (userData == URING_ACCEPT)
+			{
+				if (res >= 0)
+				{
+					ctx = gfs_poolGet(&gfs->ctxPool);
+					if (ctx == NULL)
+					{
+						GFS_LOG(LOG_WARN, "out of connection contexts");
+						close(res);
+					}
+					else
+					{
+						ctx->clientSockFD = res;
+						ctx->reactor      = reactor;
+						ctx->deadline     = gfs_nowMs() + REQUEST_TIMEOUT_MS;
+						ctx->tStart       = gfs_nowNs();
+						atomic_store( &ctx->state, CTX_READING );
+						gfs_count(CNT_CONNS, 1);
+						gfs_uringRecv(&ring, ctx);
+					}
+				}
+				gfs_uringAccept(&ring, reactor->servSockFD);
+			}
+			else if (userData == URING_WAKE)
+			{
+				// take the whole resume stack, see gfs_rearmConns()
+				ctx = atomic_exchange( &reactor->resumeHead, NULL );
+				for ( ; ctx != NULL; ctx = next)
+				{
+					next = ctx->nextResume;
+					gfs_nextRequest(ctx);
+					gfs_uringRequest(gfs, &ring, ctx);
+				}
+				gfs_uringWake(&ring, reactor->wakeFD);
+			}
+			else if (userData == URING_TICK)
+			{
+				// a pending receive can't be taken back, shutdown() completes it with 0 bytes instead
+				now = gfs_nowMs();
+				for (i=0; i<gfs->ctxPool.size; ++i)
+				{
+					ctx = &gfs->ctxPool.ctxs[i];
+					if ( atomic_load( &ctx->state ) == CTX_READING && ctx->reactor == reactor && now >= ctx->deadline )
+					{
+						gfs_count(CNT_TIMEOUTS, 1);
+						shutdown(ctx->clientSockFD, SHUT_RDWR);
+						ctx->deadline = UINT64_MAX;
+					}
+				}
+				gfs_uringTick(&ring);
+			}
+			else
+			{
+				ctx = (gfcontext_t*)(uintptr_t)userData;
+				if (res == -EINTR || res == -EAGAIN)
+				{
+					gfs_uringRecv(&ring, ctx);
+				}
+				else if (res <= 0)
+				{
+					// error, client went away, or shut down by the sweep
+					gfs_closeConn(ctx);
+				}
+				else
+				{
+					// an idle keep-alive connection starts a new request
+					if (ctx->rxLen == 0)
+					{
+						ctx->deadline = gfs_nowMs() + REQUEST_TIMEOUT_MS;
+						ctx->tStart   = gfs_nowNs();
+					}
+					ctx->rxLen += res;
+					gfs_uringRequest(gfs, &ring, ctx);
+				}
+			}
+		}
+	}
+}
+#endif
+
+
+//------------ gfserver_set_engine -------------//
+// selects the connection engine: "epoll" (default) or "uring"; returns -1 if unknown or not built in
+int gfserver_set_engine(gfserver_t* gfs, const char* name)
+{
+	if (strcmp(name, "epoll") == 0)
+	{
+		gfs->engine = GFS_ENGINE_EPOLL;
+		return 0;
+	}
+#ifdef GFS_HAVE_URING
+	if (strcmp(name, "uring") == 0)
+	{
+		gfs->engine = GFS_ENGINE_URING;
+		return 0;
+	}
+#endif
+
+	return -1;
+}
+
+
+//------------ gfserver_get_maxconnections -------------//
+// NOTE: the most connections the server serves at once, each one has at most one request 
+// with the handler; a handler that queues requests can size its queue with this
+int gfserver_get_maxconnections(gfserver_t* gfs)
+{
+	return CTX_POOL_SIZE;
+}
+
+
+//------------ gfserver_set_stats -------------//
+// NOTE: with stats enabled, a request for STATS_PATH ("/__stats") is answered with the 
+// server's counters and request phase latencies instead of going to the handler
+void gfserver_set_stats(gfserver_t* gfs, int enable)
+{
+	gfs->statsEnabled = (enable) ? TRUE : FALSE;
+}
+
+
+//------------ gfserver_set_statsfunc -------------//
+// NOTE: statsFunc(buf, size) appends the handler's own statistics to the report and returns their length
+void gfserver_set_statsfunc(gfserver_t* gfs, size_t (*statsFunc)(char*, size_t))
+{
+	gfs->statsFunc = statsFunc;
+}
+
+
+//------------ gfserver_set_acceptors -------------//
+// number of acceptor/reactor threads, each listening on its own SO_REUSEPORT socket
+void gfserver_set_acceptors(gfserver_t* gfs, int numAcceptors)
+{
+	gfs->numReactors = (numAcceptors > 0) ? numAcceptors : 1;
+}
+
 
 //------------ gfserver_set_handlerarg -------------//
 void gfserver_set_handlerarg(gfserver_t* gfs, void* arg)
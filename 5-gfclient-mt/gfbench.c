@@ -0,0 +1,327 @@
+#include <errno.h>
+#include <getopt.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "workload.h"
+#include "gfclient.h"
+#include "histogram.h"
+
+#define USAGE                                                                 \
+"usage:\n"                                                                    \
+"  gfbench [options]\n"                                                       \
+"options:\n"                                                                  \
+"  -h                  Show this help message\n"                              \
+"  -s [server_addr]    Server address (Default: localhost)\n"                 \
+"  -p [server_port]    Server port (Default: 8080)\n"                         \
+"  -w [workload_path]  Path to workload file (Default: workload.txt)\n"       \
+"  -c [connections]    Concurrent clients, one thread each (Default: 1)\n"    \
+"  -D [seconds]        Duration of the run (Default: 10)\n"                   \
+"  -r [rate]           Open loop: total requests per second, 0 is closed loop (Default: 0)\n" \
+"  -k                  Keep connections to the server open between requests\n" \
+"  -j                  Print the report as JSON\n"
+
+/* OPTIONS DESCRIPTOR ====================================================== */
+static struct option gLongOptions[] =
+{
+  {"server",        required_argument,      NULL,           's'},
+  {"port",          required_argument,      NULL,           'p'},
+  {"workload-path", required_argument,      NULL,           'w'},
+  {"connections",   required_argument,      NULL,           'c'},
+  {"duration",      required_argument,      NULL,           'D'},
+  {"rate",          required_argument,      NULL,           'r'},
+  {"keep-alive",    no_argument,            NULL,           'k'},
+  {"json",          no_argument,            NULL,           'j'},
+  {"help",          no_argument,            NULL,           'h'},
+  {NULL,            0,                      NULL,             0}
+};
+
+
+#define MAX_PATHS		1024		// workload paths loaded up front
+#define NSEC_PER_SEC	1000000000ULL
+
+char 		    *server    = "localhost";
+unsigned short port 	   = 8080;
+int			   keepAlive   = 0;			// reuse persistent connections to the server
+double		   rate        = 0;			// open loop requests per second, all clients together
+int			   durationSec = 10;
+int			   numClients  = 1;
+
+static char*	paths[MAX_PATHS];
+static int		numPaths;
+
+//-------- externs from gfclient.c
+// requests a persistent connection that later requests to the same server can reuse
+extern void gfc_set_keepalive(gfcrequest_t *gfr, int keepAlive);
+
+
+//----------------- Client Type ------------------//
+typedef struct client
+{
+	int			id;
+	pthread_t	thread;
+	histogram_t	hist;
+	uint64_t	requests;
+	uint64_t	errors;
+	uint64_t	bytes;
+} client_t;
+
+static _Atomic uint64_t	nextPath;		// round-robin position in the workload
+static uint64_t			startNs;
+static uint64_t			endNs;
+
+
+//------------ Usage -------------//
+static void Usage()
+{
+	fprintf(stdout, "%s", USAGE);
+}
+
+//------------ NowNs -------------//
+static uint64_t NowNs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+//------------ SleepUntil -------------//
+static void SleepUntil( uint64_t ns )
+{
+	struct timespec ts;
+
+	ts.tv_sec  = ns / NSEC_PER_SEC;
+	ts.tv_nsec = ns % NSEC_PER_SEC;
+	while ( clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR )
+		;
+}
+
+/* Callbacks ========================================================= */
+// the body is only counted, never stored
+static void writecb(void* data, size_t data_len, void *arg)
+{
+	*(uint64_t*)arg += data_len;
+}
+
+
+//----------- Client Thread: clientFunc ---------------//
+// NOTE: closed loop sends the next request as soon as the previous one is done.
+// Open loop sends on a fixed schedule, and measures latency from the scheduled
+// start, so a stalled server shows up in the percentiles instead of just
+// slowing the clients down (no coordinated omission).
+static void* clientFunc( void* arg )
+{
+	client_t* client = (client_t*)arg;
+	uint64_t  interval = 0;
+	uint64_t  scheduled, now, received;
+	gfcrequest_t* gfr;
+	char* path;
+
+	if (rate > 0)
+	{
+		interval = (uint64_t)( NSEC_PER_SEC / rate );
+	}
+
+	// spread the open-loop clients over one interval
+	scheduled = startNs + interval * client->id / numClients;
+
+	while (1)
+	{
+		if (rate > 0)
+		{
+			SleepUntil(scheduled);
+		}
+		else
+		{
+			scheduled = NowNs();
+		}
+		if (scheduled >= endNs)
+			break;
+
+		path = paths[ atomic_fetch_add( &nextPath, 1 ) % numPaths ];
+		received = 0;
+
+		gfr = gfc_create();
+		gfc_set_server(gfr, server);
+		gfc_set_path(gfr, path);
+		gfc_set_port(gfr, port);
+		gfc_set_writefunc(gfr, writecb);
+		gfc_set_writearg(gfr, &received);
+		gfc_set_keepalive(gfr, keepAlive);
+
+		if ( 0 > gfc_perform(gfr) ||
+			 gfc_get_status(gfr) == GF_INVALID || gfc_get_status(gfr) == GF_ERROR ||
+			 gfc_get_bytesreceived(gfr) != gfc_get_filelen(gfr) )
+		{
+			++client->errors;
+		}
+		gfc_cleanup(gfr);
+
+		now = NowNs();
+		HistRecord( &client->hist, (now - scheduled) / 1000 );
+		++client->requests;
+		client->bytes += received;
+
+		if (rate > 0)
+		{
+			scheduled += interval;
+		}
+	}
+
+	return NULL;
+}
+
+
+//------------ Report -------------//
+static void Report( client_t* clients, int numClients, int json )
+{
+	histogram_t all;
+	uint64_t requests = 0;
+	uint64_t errors   = 0;
+	uint64_t bytes    = 0;
+	double   elapsed  = (double)(NowNs() - startNs) / NSEC_PER_SEC;
+	int i = 0;
+
+	HistInit(&all);
+	for (i=0; i<numClients; ++i)
+	{
+		HistMerge(&all, &clients[i].hist);
+		requests += clients[i].requests;
+		errors   += clients[i].errors;
+		bytes    += clients[i].bytes;
+	}
+
+	if (json)
+	{
+		fprintf(stdout, "{\"connections\": %d, \"rate\": %.1f, \"keepalive\": %d, \"seconds\": %.3f, "
+				"\"requests\": %llu, \"errors\": %llu, \"bytes\": %llu, \"rps\": %.1f, \"mbps\": %.2f, "
+				"\"latency_us\": {\"min\": %llu, \"mean\": %.1f, \"p50\": %llu, \"p90\": %llu, "
+				"\"p99\": %llu, \"p99.9\": %llu, \"max\": %llu}}\n",
+				numClients, rate, keepAlive, elapsed,
+				(unsigned long long)requests, (unsigned long long)errors, (unsigned long long)bytes,
+				requests / elapsed, bytes / elapsed / (1 << 20),
+				(unsigned long long)all.min, (all.total > 0) ? all.sum / all.total : 0.0,
+				(unsigned long long)HistPercentile(&all, 50.0), (unsigned long long)HistPercentile(&all, 90.0),
+				(unsigned long long)HistPercentile(&all, 99.0), (unsigned long long)HistPercentile(&all, 99.9),
+				(unsigned long long)all.max);
+		return;
+	}
+
+	fprintf(stdout, "%d connections, %s, %s, %.2f s\n", numClients,
+			(rate > 0) ? "open loop" : "closed loop", keepAlive ? "keep-alive" : "one connection per request", elapsed);
+	if (rate > 0)
+	{
+		fprintf(stdout, "  target:      %.1f req/s\n", rate);
+	}
+	fprintf(stdout, "  requests:    %llu (%llu errors)\n", (unsigned long long)requests, (unsigned long long)errors);
+	fprintf(stdout, "  throughput:  %.1f req/s, %.2f MB/s\n", requests / elapsed, bytes / elapsed / (1 << 20));
+	fprintf(stdout, "  latency (us) min %llu  mean %.1f  p50 %llu  p90 %llu  p99 %llu  p99.9 %llu  max %llu\n",
+			(unsigned long long)all.min, (all.total > 0) ? all.sum / all.total : 0.0,
+			(unsigned long long)HistPercentile(&all, 50.0), (unsigned long long)HistPercentile(&all, 90.0),
+			(unsigned long long)HistPercentile(&all, 99.0), (unsigned long long)HistPercentile(&all, 99.9),
+			(unsigned long long)all.max);
+}
+
+
+//------------------------------- Main --------------------------------------//
+int main(int argc, char **argv)
+{
+	char *workload_path = "workload.txt";
+	client_t* clients;
+
+  	int i;
+  	int option_char = 0;
+	int json        = 0;
+
+  	// Parse and set command line arguments
+  	while ( (option_char = getopt_long(argc, argv, "s:p:w:c:D:r:kjh", gLongOptions, NULL)) != -1 )
+	{
+	    switch (option_char)
+		{
+		case 's': // server
+			server = optarg;
+			break;
+   	    case 'p': // port
+			port = atoi(optarg);
+			break;
+      	case 'w': // workload-path
+			workload_path = optarg;
+			break;
+      	case 'c': // connections
+			numClients = atoi(optarg);
+			if (numClients < 1)
+				numClients = 1;
+			break;
+      	case 'D': // duration
+			durationSec = atoi(optarg);
+			if (durationSec < 1)
+				durationSec = 1;
+			break;
+      	case 'r': // open loop rate
+			rate = atof(optarg);
+			if (rate < 0)
+				rate = 0;
+			break;
+      	case 'k': // keep-alive
+			keepAlive = 1;
+			break;
+      	case 'j': // json report
+			json = 1;
+			break;
+      	case 'h': // help
+			Usage();
+			exit(0);
+			break;
+      	default:
+			Usage();
+			exit(1);
+    	}
+  	}
+
+	if( EXIT_SUCCESS != workload_init(workload_path))
+	{
+		fprintf(stderr, "Unable to load workload file %s.\n", workload_path);
+    	exit(EXIT_FAILURE);
+  	}
+
+	// the workload module isn't thread-safe, take a snapshot of its paths
+	for (numPaths = 0; numPaths < MAX_PATHS; ++numPaths)
+	{
+		paths[numPaths] = workload_get_path();
+	}
+
+  	gfc_global_init();
+
+	// every client gets rate / numClients of the load
+	rate /= numClients;
+
+	clients = (client_t*)calloc( numClients, sizeof(client_t) );
+	startNs = NowNs();
+	endNs   = startNs + (uint64_t)durationSec * NSEC_PER_SEC;
+	for (i=0; i<numClients; ++i)
+	{
+		clients[i].id = i;
+		HistInit( &clients[i].hist );
+		pthread_create( &clients[i].thread, NULL, clientFunc, &clients[i] );
+	}
+
+	for (i=0; i<numClients; ++i)
+	{
+		pthread_join( clients[i].thread, NULL );
+	}
+
+	rate *= numClients;
+	Report( clients, numClients, json );
+	free( clients );
+
+  	gfc_global_cleanup();
+
+	return 0;
+}
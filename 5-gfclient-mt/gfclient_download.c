@@ -1,21 +1,39 @@
+#define _GNU_SOURCE	// O_DIRECT
+
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/resource.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <time.h>
+#include <math.h>
+#include <stdatomic.h>
 #include <pthread.h>
 
 #include "workload.h"
 #include "gfclient.h"
+#include "histogram.h"
 
 #define USAGE                                                                 \
 "usage:\n"                                                                    \
 "  webclient [options]\n"                                                     \
 "options:\n"                                                                  \
 "  -h                  Show this help message\n"                              \
+"  -k                  Keep connections to the server open between requests\n" \
+"  -d [depth]          Pipeline up to depth requests per connection (Default: 1)\n" \
+"  -x [segments]       Fetch large files in segments over parallel connections (Default: 1)\n" \
+"  -R [retries]        Keep partial files and resume them up to retries times (Default: 0)\n" \
+"  -B [backoff_ms]     Delay before the first retry, doubled on every retry (Default: 100)\n" \
+"  -r [rate]           Open loop: start requests on a schedule of rate per second, 0 is closed loop (Default: 0)\n" \
+"  -a [arrival]        Open loop schedule, const or poisson (Default: const)\n" \
+"  -W [writers]        Threads writing the downloads to disk (Default: 1)\n"  \
+"  -z                  Splice the bodies from the socket to the files, bypassing the writers\n" \
+"  -e [downloads]      Event loop: each thread runs up to downloads at once, 0 is blocking (Default: 0)\n" \
 "  -n [num_requests]   Requests download per thread (Default: 1)\n"           \
 "  -p [server_port]    Server port (Default: 8080)\n"                         \
 "  -s [server_addr]    Server address (Default: 0.0.0.0)\n"                   \
@@ -30,6 +48,16 @@ static struct option gLongOptions[] =
   {"workload-path", required_argument,      NULL,           'w'},
   {"nthreads",      required_argument,      NULL,           't'},
   {"nrequests",     required_argument,      NULL,           'n'},
+  {"keep-alive",    no_argument,            NULL,           'k'},
+  {"pipeline",      required_argument,      NULL,           'd'},
+  {"segments",      required_argument,      NULL,           'x'},
+  {"retries",       required_argument,      NULL,           'R'},
+  {"backoff",       required_argument,      NULL,           'B'},
+  {"rate",          required_argument,      NULL,           'r'},
+  {"arrival",       required_argument,      NULL,           'a'},
+  {"writers",       required_argument,      NULL,           'W'},
+  {"splice",        no_argument,            NULL,           'z'},
+  {"event-loop",    required_argument,      NULL,           'e'},
   {"help",          no_argument,            NULL,           'h'},
   {NULL,            0,                      NULL,             0}
 };
@@ -37,47 +65,208 @@ static struct option gLongOptions[] =
 
 #define BUFFER_SIZE 		4096
 #define PATH_BUFF_SIZE	256
+#define CACHE_LINE		64
+#define MAX_PIPELINE	16
+#define MAX_SEGMENTS	64
+#define FIRST_SEGMENT	(1 << 20)	// bytes fetched before the file size is known
+#define MAX_BACKOFF_MS	10000		// upper bound of the retry delay
+#define NSEC_PER_SEC	1000000000ULL
+#define WRITE_CHUNK		(1 << 20)	// bytes handed to a writer thread at once
+#define WRITE_ALIGN		4096		// O_DIRECT alignment of buffers, file offsets and lengths
+#define WRITE_QUEUE_MAX	4			// chunks queued per writer thread before workers have to wait
+#define DIR_CACHE_SIZE	1024		// directories remembered as created, power of 2
 
 char 		    *server    = "localhost";
 unsigned short port 	   = 8080;
-int			   reqDoneCntr = 0;			// keeps track of the # of requests completed
+int			   keepAlive   = 0;			// reuse persistent connections to the server
+int			   pipeDepth   = 1;			// requests a worker pipelines on one connection
+int			   numSegments = 1;			// parallel range requests per file
+int			   maxRetries  = 0;			// resume attempts of an incomplete download, 0 discards it
+int			   backoffMs   = 100;		// delay before the first resume attempt
+double		   rate        = 0;			// open loop requests per second, 0 is closed loop
+int			   poisson     = 0;			// open loop arrivals are random instead of evenly spaced
+int			   numWriters  = 1;			// threads writing the downloads to disk
+int			   spliceMode  = 0;			// bodies go socket -> file in the kernel
+int			   multiConc   = 0;			// downloads a worker runs at once in an event loop, 0 blocks on each
 
 
 // for allocating and defining the worker thread pool
 pthread_t* 	  	 	 workerThreads;
 int*		  		 threadIDs;
-pthread_mutex_t gMutex    = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t gMutexReq = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t  gCond     = PTHREAD_COND_INITIALIZER;
+int					 numWorkers;
 
 // worker thread callback
 void *workerFunc(void *threadArgument);
 
-int  GetRequestCounter( void );
-void IncRequestCounter( void );
-
+//-------- externs from gfclient.c
+// requests a persistent connection that later requests to the same server can reuse
+extern void gfc_set_keepalive(gfcrequest_t *gfr, int keepAlive);
+// pipelines several requests to the same server on one persistent connection
+extern int  gfc_perform_batch(gfcrequest_t **gfrs, int count);
+// requests len bytes of the file starting at offset
+extern void gfc_set_range(gfcrequest_t *gfr, size_t offset, size_t len);
+// size of the whole file, when only a range of it was received
+extern size_t gfc_get_totallen(gfcrequest_t *gfr);
+// the body is written to fd at offset, spliced from the socket where possible
+extern void gfc_set_writefd(gfcrequest_t *gfr, int fd, off_t offset);
+// event loop running many requests on one thread
+typedef struct gfc_multi_t gfc_multi_t;
+extern gfc_multi_t*  gfc_multi_create();
+extern void          gfc_multi_cleanup(gfc_multi_t* multi);
+extern int           gfc_multi_add(gfc_multi_t* multi, gfcrequest_t* gfr, void* arg);
+extern int           gfc_multi_perform(gfc_multi_t* multi, int timeoutMs);
+extern gfcrequest_t* gfc_multi_next(gfc_multi_t* multi, int* result, void** arg);
+
+
+//----------------- Task Deque Type ------------------//
+// one deque per worker thread. The owner takes tasks off the front, idle workers 
+// steal from the back of a randomly chosen victim, so the owner and a thief rarely 
+// want the same end. Each deque has its own lock, there is no global queue lock.
+typedef struct task
+{
+	char*	reqPath;		// owned by the workload module
+	int		reqNum;			// request number, makes the local file name unique
+	uint64_t startNs;		// open loop: scheduled start, relative to runStartNs
+} task_t;
 
-//----------------- Queue Type ------------------//
-// items are added at the rear and popped off of the front
-// the data in this queue is specific to the client requirements. 
-typedef struct queue
+typedef struct deque
+{
+	_Alignas(CACHE_LINE) pthread_mutex_t lock;
+	task_t*	tasks;
+	int		front;			// next task for the owner
+	int		back;			// one past the last task, thieves take back - 1
+	int		capacity;
+} deque_t;
+static deque_t* theDeques;
+static void DequeInit( deque_t* dq, int size );
+static void DequePush( deque_t* dq, char* reqPath, int reqNum, uint64_t startNs );
+static int  DequePop( deque_t* dq, task_t* task );
+static int  DequeSteal( deque_t* dq, task_t* task );
+static int  DequeStealDue( deque_t* dq, task_t* task, uint64_t now, uint64_t* nextNs );
+static void DequeCleanup( deque_t* dq );
+static int  GetTask( int tID, unsigned int* seed, task_t* task, uint64_t* wakeNs );
+static int  GetDueTask( int tID, unsigned int* seed, task_t* task );
+static int  WaitTask( int tID, unsigned int* seed, task_t* task );
+
+
+//----------------- Countdown Latch Type ------------------//
+// main() sleeps on the latch until every request has been completed
+typedef struct latch
 {
-	char** reqPaths;
-	char** locPaths;
-	FILE** files;
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;
+	int				count;
+} latch_t;
+static latch_t reqLatch;
+static void LatchInit( latch_t* latch, int count );
+static void LatchCountDown( latch_t* latch );
+static void LatchWait( latch_t* latch );
+
+
+static histogram_t* theHists;		// request latencies per worker, merged by main() after the run
+static uint64_t     runStartNs;		// workers are started, the open loop schedule begins
+
+
+//----------------- Output Writer ------------------//
+// Workers don't write the downloads themselves. The body is copied into large aligned 
+// chunks, and full chunks go to a pool of writer threads that pwrite() them, so a 
+// worker is back on its socket right away. The file is only created once the header 
+// has told its length: it is sized up front and, where the file system allows it, 
+// written with O_DIRECT, bypassing the page cache.
+typedef struct outfile outfile_t;
+typedef struct chunk
+{
+	outfile_t*		file;
+	char*			buf;			// WRITE_ALIGN aligned
+	size_t			cap;			// multiple of WRITE_ALIGN
+	size_t			len;
+	off_t			offset;			// file position of buf[0]
+	struct chunk*	next;			// writer queue or free list
+} chunk_t;
+
+struct outfile
+{
+	char*			path;
+	gfcrequest_t*	gfr;			// tells the body length once the header is in
+	int				fd;				// -1 until the first body bytes
+	int				direct;			// fd is O_DIRECT, chunks are padded to WRITE_ALIGN
+	int				spliced;		// gfclient writes fd itself, no chunks
+	off_t			start;			// where the body goes, past the part kept by a resume
+	off_t			length;			// file length once every chunk is written
+	size_t			bodyLen;		// announced body length, 0 if unknown
+	chunk_t*		chunk;			// being filled
+	int				pending;		// chunks queued or being written, under writeLock
+	_Atomic int		error;			// errno of the first failed write, set by any writer thread
+};
 
-	int	front;
-	int rear;
-	int	numItem;
-	int capacity;
-} queue_t;
-static queue_t theQ;
-static void QueueInit( int size );
-static int  QueueDeq( void );
-static void QueueEnq( char* path, FILE* file, char* locPath );
-static int  isQueueEmpty( void );
-static int  isQueueFull( void );
-void		QueueCleanup( void );
+static pthread_mutex_t	writeLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	writeReady = PTHREAD_COND_INITIALIZER;	// chunks are queued
+static pthread_cond_t	writeDone  = PTHREAD_COND_INITIALIZER;	// a chunk has been written
+static chunk_t*	writeHead;
+static chunk_t*	writeTail;
+static int		numQueued;
+static chunk_t*	freeChunks;			// full size buffers for reuse
+static void  WriterStart( int count );
+static void  OutInit( outfile_t* out, char* path, gfcrequest_t* gfr, off_t start );
+static void  OutCreate( outfile_t* out );
+static void  OutSplice( outfile_t* out );
+static int   OutClose( outfile_t* out, int sync );
+static void  outcb( void* data, size_t data_len, void* arg );
+
+
+//----------------- Directory Cache ------------------//
+// directories this run has already made, so the parents of a local file 
+// are created once per directory rather than once per download
+static char*			dirCache[DIR_CACHE_SIZE];
+static int				numDirs;
+static pthread_mutex_t	dirLock = PTHREAD_MUTEX_INITIALIZER;
+static void MakeDirs( char* path );
+
+
+//----------------- Segment Type ------------------//
+// one range of a segmented download, written at its own place in the output file
+typedef struct segment
+{
+	char*	reqPath;
+	int		fd;				// output file, shared by all segments
+	size_t	offset;			// next write position
+	size_t	len;			// bytes requested
+	size_t	received;
+	size_t	total;			// file size reported by the server
+	int		status;			// gfstatus_t of the response, GF_ERROR if it couldn't be written
+	int		error;			// errno of the first failed write, the rest of the body is dropped
+} segment_t;
+static void* SegmentFunc( void* arg );
+static int   DownloadSegmented( char* reqPath, int fd, size_t* received, size_t* fileLen );
+
+
+//----------------- Resume Journal ------------------//
+// a partial download "<local>" keeps a sidecar "<local>.part" holding 
+// "<verifiedBytes> <fileLength>": the bytes that are known to be on disk, and the 
+// size of the complete file. A retry, or the next run, picks up from there.
+static int  JournalRead( const char* locPath, size_t* verified, size_t* total );
+static void JournalWrite( const char* locPath, size_t verified, size_t total );
+static void JournalRemove( const char* locPath );
+static int  ResumeDownload( char* reqPath, char* locPath, size_t* received, size_t* total );
+static int  RetryDownload( char* reqPath, char* locPath, size_t* received, size_t* total );
+
+
+//----------------- Downloads ------------------//
+// a download in a worker's event loop
+typedef struct download
+{
+	gfcrequest_t*	gfr;
+	outfile_t		out;
+	char*			reqPath;
+	char			locPath[PATH_BUFF_SIZE + 8];
+	uint64_t		taskStart;
+	struct download* next;			// free list
+} download_t;
+static gfcrequest_t* CreateRequest( char* reqPath, char* locPath, outfile_t* out );
+static int  ResumeJournaled( char* reqPath, char* locPath, uint64_t taskStart, histogram_t* hist );
+static void FinishDownload( gfcrequest_t* gfr, outfile_t* out, char* reqPath, char* locPath, 
+							uint64_t taskStart, histogram_t* hist );
+static void MultiLoop( int tID, unsigned int* seed, histogram_t* hist );
 
 
 //------------ Usage -------------//
@@ -87,142 +276,741 @@ static void Usage()
 }
 
 //------------ localPath -------------//
-static void localPath(char *req_path, char *local_path)
+static void localPath(char *req_path, char *local_path, int counter)
 {
-  static int counter = 0;
-
-  sprintf(local_path, "%s-%06d", &req_path[1], counter++);
+  sprintf(local_path, "%s-%06d", &req_path[1], counter);
 }
 
 //------------ openFile -------------//
-static FILE* openFile(char *path)
+// creates the file and any missing directories on its path; flags are added to O_WRONLY | O_CREAT
+static int openFile(char *path, int flags)
 {
-  	char *cur, *prev;
-  	FILE *ans;
+	int fd;
 
-  	/* Make the directory if it isn't there */
-  	prev = path;
-    while(NULL != (cur = strchr(prev+1, '/')))
-	{
-		*cur = '\0';
+	MakeDirs(path);
 
-    	if (0 > mkdir(&path[0], S_IRWXU))
-		{
-			if (errno != EEXIST)
-			{
-        		perror("Unable to create directory");
-        		exit(EXIT_FAILURE);
-			}
-    	}
-
-    	*cur = '/';
-    	prev = cur;
-  	}
-
-	if( NULL == (ans = fopen(&path[0], "w")))
+	if ( 0 > (fd = open(path, O_WRONLY | O_CREAT | flags, 0644)) )
 	{
+		// O_DIRECT isn't supported everywhere (tmpfs), let the caller know
+		if (errno == EINVAL && (flags & O_DIRECT))
+			return -1;
 		perror("Unable to open file");
     	exit(EXIT_FAILURE);
   	}
 
-  return ans;
+	return fd;
+}
+
+//------------ NowNs -------------//
+static uint64_t NowNs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+//------------ StartTask -------------//
+// returns the time the task's latency is measured from. In the open loop that is 
+// the scheduled start, not the time a worker got around to it, so a slow server 
+// shows up as latency instead of as fewer requests (no coordinated omission).
+static uint64_t StartTask( task_t* task )
+{
+	struct timespec ts;
+	uint64_t start;
+
+	if (rate <= 0)
+		return NowNs();
+
+	start = runStartNs + task->startNs;
+	ts.tv_sec  = start / NSEC_PER_SEC;
+	ts.tv_nsec = start % NSEC_PER_SEC;
+	while ( clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR )
+		;
+
+	return start;
 }
 
 /* Callbacks ========================================================= */
-static void writecb(void* data, size_t data_len, void *arg)
+
+
+//------------ pwritecb -------------//
+// segment writer, every segment owns a disjoint range of the file
+static void pwritecb(void* data, size_t data_len, void *arg)
+{
+	segment_t* seg = (segment_t*)arg;
+	ssize_t written;
+
+	while (data_len > 0 && seg->error == 0)
+	{
+		written = pwrite(seg->fd, data, data_len, seg->offset);
+		if (written < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			seg->error = errno;
+			fprintf(stderr, "%s @ %d: pwrite at %zu failed, %s\n", __FILE__, __LINE__, seg->offset, strerror(errno));
+			return;
+		}
+		data      = (char*)data + written;
+		data_len -= written;
+		seg->offset += written;
+	}
+}
+
+
+//------------ SegmentFunc -------------//
+// fetches one range of the file
+static void* SegmentFunc( void* arg )
+{
+	segment_t* seg = (segment_t*)arg;
+	gfcrequest_t* gfr = gfc_create();
+
+	gfc_set_server(gfr, server);
+	gfc_set_path(gfr, seg->reqPath);
+	gfc_set_port(gfr, port);
+	gfc_set_range(gfr, seg->offset, seg->len);
+	if (spliceMode)
+	{
+		gfc_set_writefd(gfr, seg->fd, seg->offset);
+	}
+	else
+	{
+		gfc_set_writefunc(gfr, pwritecb);
+		gfc_set_writearg(gfr, seg);
+	}
+	gfc_set_keepalive(gfr, keepAlive);
+
+	if ( 0 > gfc_perform(gfr) )
+	{
+		fprintf(stdout, "gfc_perform returned an error on segment at %zu\n", seg->offset);
+	}
+	seg->status   = (seg->error != 0) ? GF_ERROR : gfc_get_status(gfr);
+	seg->received = gfc_get_bytesreceived(gfr);
+	seg->total    = gfc_get_totallen(gfr);
+	gfc_cleanup(gfr);
+
+	return NULL;
+}
+
+
+//------------ DownloadSegmented -------------//
+// NOTE: the first segment also tells the file size. The output is then sized up front 
+// and the rest is split across numSegments parallel connections.
+// Returns the status of the download
+static int DownloadSegmented( char* reqPath, int fd, size_t* received, size_t* fileLen )
+{
+	segment_t seg[MAX_SEGMENTS];
+	pthread_t threads[MAX_SEGMENTS];
+	size_t total, rest, next;
+	int status = GF_OK;
+	int i = 0;
+
+	memset(seg, 0, sizeof(seg));
+	seg[0].reqPath = reqPath;
+	seg[0].fd      = fd;
+	seg[0].offset  = 0;
+	seg[0].len     = FIRST_SEGMENT;
+
+	// size unknown yet: fetch the first segment on its own
+	SegmentFunc( &seg[0] );
+	total = seg[0].total;
+
+	*received = seg[0].received;
+	*fileLen  = total;
+	if (seg[0].status != GF_OK || seg[0].received >= total)
+	{
+		return seg[0].status;
+	}
+
+	// reserve the whole file, so the segments never extend it concurrently
+	if (posix_fallocate(seg[0].fd, 0, total) != 0 && ftruncate(seg[0].fd, total) < 0)
+	{
+		perror("Unable to size the output file");
+	}
+
+	rest = total - seg[0].received;
+	next = seg[0].received;
+	for (i=0; i<numSegments; ++i)
+	{
+		seg[i].reqPath = reqPath;
+		seg[i].fd      = fd;
+		seg[i].offset  = next;
+		seg[i].len     = rest / numSegments + ( (size_t)i < rest % numSegments ? 1 : 0 );
+		seg[i].received = 0;
+		next += seg[i].len;
+		pthread_create( &threads[i], NULL, SegmentFunc, &seg[i] );
+	}
+
+	// every segment writes into fd and reads seg[], so all of them are joined before returning
+	for (i=0; i<numSegments; ++i)
+	{
+		pthread_join( threads[i], NULL );
+	}
+	for (i=0; i<numSegments; ++i)
+	{
+		*received += seg[i].received;
+		if ( status == GF_OK && (seg[i].status != GF_OK || seg[i].received != seg[i].len) )
+		{
+			status = (seg[i].status != GF_OK) ? seg[i].status : GF_ERROR;
+		}
+	}
+
+	return status;
+}
+
+
+//------------ JournalRead -------------//
+// returns 1 if locPath has a journal
+static int JournalRead( const char* locPath, size_t* verified, size_t* total )
+{
+	char  jPath[PATH_BUFF_SIZE + 16];
+	FILE* jFile;
+	int   found = 0;
+
+	snprintf(jPath, sizeof(jPath), "%s.part", locPath);
+	if ( NULL == (jFile = fopen(jPath, "r")) )
+		return 0;
+
+	found = ( fscanf(jFile, "%zu %zu", verified, total) == 2 && *verified <= *total ) ? 1 : 0;
+	fclose(jFile);
+
+	return found;
+}
+
+//------------ JournalWrite -------------//
+// NOTE: written aside and renamed over the old journal, so a crash leaves either one intact
+static void JournalWrite( const char* locPath, size_t verified, size_t total )
+{
+	char  jPath[PATH_BUFF_SIZE + 16];
+	char  tmpPath[PATH_BUFF_SIZE + 16];
+	FILE* jFile;
+
+	snprintf(jPath, sizeof(jPath), "%s.part", locPath);
+	snprintf(tmpPath, sizeof(tmpPath), "%s.part~", locPath);
+	if ( NULL == (jFile = fopen(tmpPath, "w")) )
+	{
+		perror("Unable to write the journal");
+		return;
+	}
+
+	fprintf(jFile, "%zu %zu\n", verified, total);
+	fflush(jFile);
+	fsync(fileno(jFile));
+	fclose(jFile);
+	rename(tmpPath, jPath);
+}
+
+//------------ JournalRemove -------------//
+static void JournalRemove( const char* locPath )
+{
+	char jPath[PATH_BUFF_SIZE + 16];
+
+	snprintf(jPath, sizeof(jPath), "%s.part", locPath);
+	unlink(jPath);
+}
+
+
+//------------ ResumeDownload -------------//
+// NOTE: one attempt to complete a journaled download. Bytes past the verified count may 
+// not have made it to disk, so they are cut off and fetched again.
+// Returns the status of the attempt; received/total describe the file afterwards
+static int ResumeDownload( char* reqPath, char* locPath, size_t* received, size_t* total )
+{
+	size_t verified = 0;
+	size_t fileLen  = 0;
+	int    status;
+	outfile_t out;
+	gfcrequest_t* gfr;
+
+	if ( !JournalRead(locPath, &verified, &fileLen) || access(locPath, F_OK) < 0 )
+	{
+		// nothing usable on disk, start over
+		verified = 0;
+		fileLen  = 0;
+	}
+	else if ( truncate(locPath, verified) < 0 )
+	{
+		perror("Unable to resume");
+		return GF_ERROR;
+	}
+
+	gfr = gfc_create();
+	OutInit(&out, locPath, gfr, verified);
+	gfc_set_server(gfr, server);
+	gfc_set_path(gfr, reqPath);
+	gfc_set_port(gfr, port);
+	gfc_set_writefunc(gfr, outcb);
+	gfc_set_writearg(gfr, &out);
+	gfc_set_keepalive(gfr, keepAlive);
+	if (spliceMode)
+		OutSplice(&out);
+	if (verified > 0)
+	{
+		gfc_set_range(gfr, verified, fileLen - verified);
+	}
+
+	fprintf(stdout, "Resuming %s%s at %zu\n", server, reqPath, verified);
+	gfc_perform(gfr);
+	status = gfc_get_status(gfr);
+	if ( OutClose(&out, 1) < 0 )
+	{
+		// nothing new is verified, the next attempt cuts the file back
+		status = GF_ERROR;
+	}
+
+	// the file changed on the server, what we have is useless
+	if ( verified > 0 && status == GF_OK && gfc_get_totallen(gfr) != fileLen )
+	{
+		verified = 0;
+		fileLen  = 0;
+		status   = GF_ERROR;
+	}
+	else if ( status == GF_OK || status == GF_INVALID )
+	{
+		verified += gfc_get_bytesreceived(gfr);
+		if (gfc_get_totallen(gfr) > 0)
+			fileLen = gfc_get_totallen(gfr);
+	}
+	gfc_cleanup(gfr);
+
+	*received = verified;
+	*total    = fileLen;
+	if (status == GF_FILE_NOT_FOUND)
+	{
+		unlink(locPath);
+		JournalRemove(locPath);
+	}
+	else if (status == GF_OK && verified == fileLen)
+	{
+		JournalRemove(locPath);
+	}
+	else if (status == GF_OK || status == GF_INVALID || status == GF_ERROR)
+	{
+		JournalWrite(locPath, verified, fileLen);
+	}
+
+	return status;
+}
+
+
+//------------ RetryDownload -------------//
+// resumes a journaled download up to maxRetries times, with exponential backoff
+static int RetryDownload( char* reqPath, char* locPath, size_t* received, size_t* total )
 {
-  FILE *file = (FILE*) arg;
+	struct timespec delay;
+	long waitMs = backoffMs;
+	int  status = GF_ERROR;
+	int  i = 0;
 
-  fwrite(data, 1, data_len, file);
+	for (i=0; i<maxRetries; ++i)
+	{
+		delay.tv_sec  = waitMs / 1000;
+		delay.tv_nsec = (waitMs % 1000) * 1000000;
+		nanosleep(&delay, NULL);
+		waitMs = (waitMs * 2 < MAX_BACKOFF_MS) ? waitMs * 2 : MAX_BACKOFF_MS;
+
+		status = ResumeDownload(reqPath, locPath, received, total);
+		if ( (status == GF_OK && *received == *total) || status == GF_FILE_NOT_FOUND )
+			break;
+	}
+
+	return status;
+}
+
+
+//----------- GetTask ---------------//
+// NOTE: all tasks are distributed before the workers start, so a worker that finds 
+// its own deque and every victim empty is done. In the open loop a thief only takes 
+// tasks that are already overdue, a task due later would just sleep in the thief.
+// Returns 0 if there is nothing to take now; *wakeNs is then the time the earliest 
+// task still scheduled is due, or 0 once every deque is empty.
+static int GetTask( int tID, unsigned int* seed, task_t* task, uint64_t* wakeNs )
+{
+	uint64_t nextNs = UINT64_MAX;
+	int i = 0;
+	int victim;
+
+	*wakeNs = 0;
+	if ( DequePop(&theDeques[tID], task) )
+		return 1;
+
+	if (rate > 0)
+	{
+		victim = rand_r(seed) % numWorkers;
+		for (i=0; i<numWorkers; ++i)
+		{
+			if ( victim != tID && DequeStealDue(&theDeques[victim], task, NowNs() - runStartNs, &nextNs) )
+				return 1;
+			victim = (victim + 1) % numWorkers;
+		}
+		if (nextNs != UINT64_MAX)
+			*wakeNs = runStartNs + nextNs;
+		return 0;
+	}
+
+	// start at a random victim, then sweep the others once
+	victim = rand_r(seed) % numWorkers;
+	for (i=0; i<numWorkers; ++i)
+	{
+		if ( victim != tID && DequeSteal(&theDeques[victim], task) )
+			return 1;
+		victim = (victim + 1) % numWorkers;
+	}
+
+	return 0;
 }
 
 
-//----------- GetRequestCounter ---------------//
-int GetRequestCounter( void )
+//----------- GetDueTask ---------------//
+// open loop, the worker's own next task or a victim's, only if it is due by now
+static int GetDueTask( int tID, unsigned int* seed, task_t* task )
 {
-	static int count;
+	uint64_t nextNs = UINT64_MAX;
+	uint64_t now    = NowNs() - runStartNs;
+	int i = 0;
+	int victim;
+
+	if ( DequeStealDue(&theDeques[tID], task, now, &nextNs) )
+		return 1;
 
-	pthread_mutex_lock(&gMutexReq);
-	count = reqDoneCntr;
-	pthread_mutex_unlock(&gMutexReq);
+	victim = rand_r(seed) % numWorkers;
+	for (i=0; i<numWorkers; ++i)
+	{
+		if ( victim != tID && DequeStealDue(&theDeques[victim], task, now, &nextNs) )
+			return 1;
+		victim = (victim + 1) % numWorkers;
+	}
 
-	return count;
+	return 0;
 }
 
-//----------- IncRequestCounter ---------------//
-void IncRequestCounter( void )
+
+//----------- WaitTask ---------------//
+// GetTask for workers that block; an idle worker sleeps until the earliest task 
+// still scheduled, then tries again. Returns 0 once every deque is empty.
+static int WaitTask( int tID, unsigned int* seed, task_t* task )
 {
-	pthread_mutex_lock(&gMutexReq);
-	++reqDoneCntr;
-	pthread_mutex_unlock(&gMutexReq);
+	struct timespec ts;
+	uint64_t wakeNs;
+
+	while ( !GetTask(tID, seed, task, &wakeNs) )
+	{
+		if (wakeNs == 0)
+			return 0;
+
+		ts.tv_sec  = wakeNs / NSEC_PER_SEC;
+		ts.tv_nsec = wakeNs % NSEC_PER_SEC;
+		while ( clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR )
+			;
+	}
+
+	return 1;
 }
 
 
 //----------- Worker Thread: workerFunc ---------------//
+// NOTE: with pipelining, a worker takes up to pipeDepth tasks at once and 
+// sends them back-to-back on one connection
 void *workerFunc(void *threadArgument)
 {
 	int   tID 	  = *( (int*)threadArgument );
-	int   pathIdx = 0;
-	char  path[PATH_BUFF_SIZE] = {0};
-	char  locPath[PATH_BUFF_SIZE] = {0};
-	FILE* curFile;
+	unsigned int seed = (unsigned int)tID + 1;
+	task_t task;
+	char* path;
+	char* reqPath[MAX_PIPELINE];
+	char  locPath[MAX_PIPELINE][PATH_BUFF_SIZE + 8];
+	outfile_t out[MAX_PIPELINE];
+	int   fd;
 	int   returncode;
+	int   status;
+	int   numReq = 0;
+	int   i = 0;
+	size_t received = 0;
+	size_t fileLen  = 0;
+	uint64_t taskStart[MAX_PIPELINE];
+	histogram_t* hist = &theHists[tID];
 
-	gfcrequest_t* gfr;
+	gfcrequest_t* gfr[MAX_PIPELINE];
 
 	fprintf(stdout, "Thread %d\n", tID);
 
-	while(1)
+	// segmented downloads have their own connections, the event loop is for whole files
+	if (multiConc > 0 && numSegments == 1)
 	{
-		//------ dequeue the current task with a mutex lock for the queue access
-		pthread_mutex_lock(&gMutex);
+		MultiLoop(tID, &seed, hist);
+		pthread_exit(0);
+	}
 
-		while ( isQueueEmpty() )
-			pthread_cond_wait( &gCond, &gMutex );
+	while (1)
+	{
+		// one file at a time, spread over several connections
+		if (numSegments > 1)
+		{
+			if ( !WaitTask(tID, &seed, &task) )
+				break;
+			taskStart[0] = StartTask(&task);
+
+			localPath(task.reqPath, locPath[0], task.reqNum);
+			fd = openFile(locPath[0], O_TRUNC);
+			fprintf(stdout, "Requesting %s%s\n", server, task.reqPath);
 
-		pathIdx = QueueDeq();
-		strcpy(path, theQ.reqPaths[pathIdx]);	
-		strcpy(locPath, theQ.locPaths[pathIdx]);	
-		curFile = theQ.files[pathIdx];
+			status = DownloadSegmented(task.reqPath, fd, &received, &fileLen);
+			close(fd);
+	    	if ( status != GF_OK || received != fileLen )
+			{
+				if ( 0 > unlink(locPath[0]) )
+					fprintf(stderr, "unlink failed on %s\n", locPath[0]);
+	    	}
 
-		pthread_mutex_unlock(&gMutex);
+	    	fprintf(stdout, "Status: %s\n", gfc_strstatus(status));
+	    	fprintf(stdout, "Received %zu of %zu bytes\n", received, fileLen);
 
-		//------ create the client requester
-    	gfr = gfc_create();
-    	gfc_set_server(gfr, server);
-    	gfc_set_path(gfr, path);
-    	gfc_set_port(gfr, port);
-		gfc_set_writefunc(gfr, writecb);
-    	gfc_set_writearg(gfr, curFile);
+			HistRecord(hist, (NowNs() - taskStart[0]) / 1000);
+			LatchCountDown(&reqLatch);
+			continue;
+		}
 
-		fprintf(stdout, "Requesting %s%s\n", server, path);
-    	if ( 0 > (returncode = gfc_perform(gfr)))
+		for (numReq = 0; numReq < pipeDepth; ++numReq)
+		{
+			// in the open loop a request goes out when it is due, only tasks that are 
+			// overdue by then share its connection
+			if (numReq == 0 || rate <= 0)
+			{
+				if ( !WaitTask(tID, &seed, &task) )
+					break;
+			}
+			else if ( !GetDueTask(tID, &seed, &task) )
+			{
+				break;
+			}
+			taskStart[numReq] = StartTask(&task);
+
+			path = task.reqPath;
+			reqPath[numReq] = path;
+	    	localPath(path, locPath[numReq], task.reqNum);
+
+			// left over from an earlier run, pick it up where it stopped
+			if ( ResumeJournaled(path, locPath[numReq], taskStart[numReq], hist) )
+			{
+				--numReq;
+				continue;
+			}
+
+	    	gfr[numReq] = CreateRequest(path, locPath[numReq], &out[numReq]);
+			fprintf(stdout, "Requesting %s%s\n", server, path);
+		}
+		if (numReq == 0)
+			break;
+
+		if (numReq == 1)
+			returncode = gfc_perform(gfr[0]);
+		else
+			returncode = gfc_perform_batch(gfr, numReq);
+
+		if ( 0 > returncode )
 		{
 			fprintf(stdout, "gfc_perform returned an error %d\n", returncode);
-			fclose(curFile);
-			if ( 0 > unlink(locPath) )
-				fprintf(stderr, "unlink failed on %s\n", locPath);
 		}
-		else 
+
+		for (i=0; i<numReq; ++i)
 		{
-			fclose(curFile);
-    	}
+			FinishDownload(gfr[i], &out[i], reqPath[i], locPath[i], taskStart[i], hist);
+		}
+	}
+
+	pthread_exit(0);
+}
+
+
+//----------- CreateRequest ---------------//
+// the client requester of a download, the file is created when the body starts
+static gfcrequest_t* CreateRequest( char* reqPath, char* locPath, outfile_t* out )
+{
+	gfcrequest_t* gfr = gfc_create();
+
+	OutInit(out, locPath, gfr, 0);
+	gfc_set_server(gfr, server);
+	gfc_set_path(gfr, reqPath);
+	gfc_set_port(gfr, port);
+	gfc_set_writefunc(gfr, outcb);
+	gfc_set_writearg(gfr, out);
+	gfc_set_keepalive(gfr, keepAlive);
+	if (spliceMode)
+		OutSplice(out);
+
+	return gfr;
+}
+
 
-    	if ( gfc_get_status(gfr) != GF_OK)
+//----------- ResumeJournaled ---------------//
+// completes a download left over from an earlier run; returns 0 if there is none
+static int ResumeJournaled( char* reqPath, char* locPath, uint64_t taskStart, histogram_t* hist )
+{
+	size_t received = 0;
+	size_t fileLen  = 0;
+	int    status;
+
+	if ( maxRetries == 0 || !JournalRead(locPath, &received, &fileLen) )
+		return 0;
+
+	status = ResumeDownload(reqPath, locPath, &received, &fileLen);
+	if ( status != GF_FILE_NOT_FOUND && (status != GF_OK || received != fileLen) )
+		status = RetryDownload(reqPath, locPath, &received, &fileLen);
+	fprintf(stdout, "Status: %s\n", gfc_strstatus(status));
+	fprintf(stdout, "Received %zu of %zu bytes\n", received, fileLen);
+	HistRecord(hist, (NowNs() - taskStart) / 1000);
+	LatchCountDown(&reqLatch);
+
+	return 1;
+}
+
+
+//----------- FinishDownload ---------------//
+// NOTE: gets the file on disk once the request is over, and keeps an interrupted one 
+// for resuming if asked to, or removes it. Releases the request.
+static void FinishDownload( gfcrequest_t* gfr, outfile_t* out, char* reqPath, char* locPath, 
+							uint64_t taskStart, histogram_t* hist )
+{
+	int    status   = gfc_get_status(gfr);
+	size_t received = gfc_get_bytesreceived(gfr);
+	size_t fileLen  = gfc_get_filelen(gfr);
+	int    broken   = ( status != GF_FILE_NOT_FOUND && (status != GF_OK || received != fileLen) );
+
+	// an empty file has no body bytes to create it
+	if (status == GF_OK)
+		OutCreate(out);
+	// a broken transfer has to be on disk before the journal says so
+	if ( OutClose(out, maxRetries > 0 && broken) < 0 )
+	{
+		status   = GF_ERROR;
+		received = 0;
+		broken   = 1;
+	}
+	gfc_cleanup(gfr);
+
+	// an interrupted transfer is kept and resumed, if asked to
+	if ( maxRetries > 0 && broken )
+	{
+		JournalWrite(locPath, received, fileLen);
+		status = RetryDownload(reqPath, locPath, &received, &fileLen);
+	}
+
+	if ( status == GF_FILE_NOT_FOUND || (maxRetries == 0 && (status != GF_OK || received != fileLen)) )
+	{
+		if ( 0 > unlink(locPath) && errno != ENOENT )
+			fprintf(stderr, "unlink failed on %s\n", locPath);
+	}
+
+	fprintf(stdout, "Status: %s\n", gfc_strstatus(status));
+	fprintf(stdout, "Received %zu of %zu bytes\n", received, fileLen);
+
+	HistRecord(hist, (NowNs() - taskStart) / 1000);
+	LatchCountDown(&reqLatch);	// report that this current task is done
+}
+
+
+//----------- MultiLoop ---------------//
+// NOTE: the worker runs up to multiConc downloads at once in one gfc_multi event loop 
+// instead of blocking on each. In the open loop a task that isn't due yet is held back 
+// and its start time becomes the loop's timeout, as does the earliest task still scheduled 
+// for another worker when there is nothing to take. Resumes and retries still block the 
+// loop while they run, they are the rare case.
+static void MultiLoop( int tID, unsigned int* seed, histogram_t* hist )
+{
+	download_t*   slots = (download_t*)calloc( multiConc, sizeof(download_t) );
+	download_t*   freeSlots = NULL;
+	download_t*   dl;
+	gfc_multi_t*  multi = gfc_multi_create();
+	gfcrequest_t* gfr;
+	task_t   task;
+	int      haveTask  = 0;			// taken, but not due yet
+	int      drained   = 0;			// no tasks left to take
+	int      running   = 0;
+	int      timeoutMs = -1;
+	int      result    = 0;
+	int      i = 0;
+	uint64_t now, due, wakeNs;
+
+	if (slots == NULL || multi == NULL)
+	{
+		fprintf(stderr, "Unable to set up the event loop\n");
+		exit(EXIT_FAILURE);
+	}
+	for (i=multiConc-1; i>=0; --i)
+	{
+		slots[i].next = freeSlots;
+		freeSlots = &slots[i];
+	}
+
+	while (1)
+	{
+		// start downloads while there are free slots and due tasks
+		timeoutMs = -1;
+		while (freeSlots != NULL)
 		{
-			if ( 0 > unlink(locPath) )
-				fprintf(stderr, "unlink failed on %s\n", locPath);
-    	}
+			if (!haveTask)
+			{
+				if (drained)
+					break;
+				if ( !GetTask(tID, seed, &task, &wakeNs) )
+				{
+					// nothing due anywhere, look again when the earliest task is
+					if (wakeNs == 0)
+						drained = 1;
+					else
+						timeoutMs = (int)((wakeNs > NowNs()) ? (wakeNs - NowNs() + 999999) / 1000000 : 0);
+					break;
+				}
+				haveTask = 1;
+			}
 
-    	fprintf(stdout, "Status: %s\n", gfc_strstatus(gfc_get_status(gfr)));
-    	fprintf(stdout, "Received %zu of %zu bytes\n", gfc_get_bytesreceived(gfr), gfc_get_filelen(gfr));
+			now = NowNs();
+			due = (rate > 0) ? runStartNs + task.startNs : now;
+			if (due > now)
+			{
+				timeoutMs = (int)((due - now + 999999) / 1000000);
+				break;
+			}
+			haveTask = 0;
+
+			dl = freeSlots;
+			localPath(task.reqPath, dl->locPath, task.reqNum);
+			if ( ResumeJournaled(task.reqPath, dl->locPath, due, hist) )
+				continue;
+
+			freeSlots = dl->next;
+			dl->reqPath   = task.reqPath;
+			dl->taskStart = due;
+			dl->gfr = CreateRequest(task.reqPath, dl->locPath, &dl->out);
+			fprintf(stdout, "Requesting %s%s\n", server, task.reqPath);
+			gfc_multi_add(multi, dl->gfr, dl);		// a failure comes back through gfc_multi_next
+			running++;
+		}
+		if (running == 0 && !haveTask && drained)
+			break;
 
-    	gfc_cleanup(gfr);
+		if ( gfc_multi_perform(multi, timeoutMs) < 0 )
+		{
+			fprintf(stderr, "Event loop failed\n");
+			exit(EXIT_FAILURE);
+		}
 
-		IncRequestCounter();	// report that this this current tasks
+		while ( NULL != (gfr = gfc_multi_next(multi, &result, (void**)&dl)) )
+		{
+			if ( 0 > result )
+			{
+				fprintf(stdout, "gfc_perform returned an error %d\n", result);
+			}
+			FinishDownload(gfr, &dl->out, dl->reqPath, dl->locPath, dl->taskStart, hist);
+			dl->next  = freeSlots;
+			freeSlots = dl;
+			running--;
+		}
 	}
 
-	pthread_exit(0);
+	gfc_multi_cleanup(multi);
+	free(slots);
 }
 
 
@@ -236,12 +1024,15 @@ int main(int argc, char **argv)
   	int nrequests 	= 1;
   	int nthreads 	= 1;
 	int numReqTotal = 0;
-  	FILE *file;
   	char *req_path;
-  	char local_path[512];
+	unsigned int arrivalSeed = 1;
+	double   schedNs = 0;
+	double   elapsed;
+	histogram_t* allHist;
+	struct rlimit fileLimit;
 
   	// Parse and set command line arguments
-  	while ( (option_char = getopt_long(argc, argv, "s:p:w:n:t:h", gLongOptions, NULL)) != -1 ) 
+  	while ( (option_char = getopt_long(argc, argv, "s:p:w:n:t:kd:x:R:B:r:a:W:ze:h", gLongOptions, NULL)) != -1 ) 
 	{
 	    switch (option_char) 
 		{
@@ -260,6 +1051,62 @@ int main(int argc, char **argv)
       	case 't': // nthreads
 			nthreads = atoi(optarg);
 			break;
+      	case 'k': // keep-alive
+			keepAlive = 1;
+			break;
+      	case 'd': // pipeline depth
+			pipeDepth = atoi(optarg);
+			if (pipeDepth < 1)
+				pipeDepth = 1;
+			if (pipeDepth > MAX_PIPELINE)
+				pipeDepth = MAX_PIPELINE;
+			break;
+      	case 'x': // segments per file
+			numSegments = atoi(optarg);
+			if (numSegments < 1)
+				numSegments = 1;
+			if (numSegments > MAX_SEGMENTS)
+				numSegments = MAX_SEGMENTS;
+			break;
+      	case 'R': // resume retries
+			maxRetries = atoi(optarg);
+			if (maxRetries < 0)
+				maxRetries = 0;
+			break;
+      	case 'B': // retry backoff
+			backoffMs = atoi(optarg);
+			if (backoffMs < 0)
+				backoffMs = 0;
+			break;
+      	case 'r': // open loop rate
+			rate = atof(optarg);
+			if (rate < 0)
+				rate = 0;
+			break;
+      	case 'a': // open loop arrivals
+			if ( strcmp(optarg, "poisson") == 0 )
+				poisson = 1;
+			else if ( strcmp(optarg, "const") == 0 )
+				poisson = 0;
+			else
+			{
+				Usage();
+				exit(1);
+			}
+			break;
+      	case 'W': // writer threads
+			numWriters = atoi(optarg);
+			if (numWriters < 1)
+				numWriters = 1;
+			break;
+      	case 'z': // splice
+			spliceMode = 1;
+			break;
+      	case 'e': // event loop
+			multiConc = atoi(optarg);
+			if (multiConc < 0)
+				multiConc = 0;
+			break;
       	case 'h': // help
 			Usage();
 			exit(0);
@@ -276,22 +1123,29 @@ int main(int argc, char **argv)
     	exit(EXIT_FAILURE);
   	}
 
+	// an event loop holds a connection and a file open per download, go as far as allowed
+	if (multiConc > 0 && getrlimit(RLIMIT_NOFILE, &fileLimit) == 0 && fileLimit.rlim_cur < fileLimit.rlim_max)
+	{
+		fileLimit.rlim_cur = fileLimit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &fileLimit);
+	}
+
   	gfc_global_init();
+	WriterStart( numWriters );
 
 	numReqTotal = nrequests * nthreads;
+	numWorkers  = nthreads;
 
-	//------- initialize the pool of worker threads
-	QueueInit( nthreads + 2 );
-	workerThreads = (pthread_t*)malloc( nthreads*sizeof(pthread_t) );
-	threadIDs     = (int*)malloc( nthreads*sizeof(int) );
+  	//------ Boss Thread: deal every request out to the worker deques up front
+	theDeques = (deque_t*)aligned_alloc( CACHE_LINE, nthreads*sizeof(deque_t) );
+	theHists  = (histogram_t*)malloc( nthreads*sizeof(histogram_t) );
 	for (i=0; i<nthreads; ++i)
 	{
-		threadIDs[i] = i;
-		pthread_create( &workerThreads[i], NULL, workerFunc, &threadIDs[i] );
+		DequeInit( &theDeques[i], nrequests );
+		HistInit( &theHists[i] );
 	}
+	LatchInit( &reqLatch, numReqTotal );
 
-
-  	//------ Boss Thread: enqueues requests for worker threads
   	for (i = 0; i < numReqTotal; ++i)
 	{
 		req_path = workload_get_path();
@@ -302,108 +1156,503 @@ int main(int argc, char **argv)
 			exit(EXIT_FAILURE);
     	}
 
-    	localPath(req_path, local_path);
-    	file = openFile(local_path);
+		DequePush( &theDeques[i % nthreads], req_path, i, (uint64_t)schedNs );
 
-		// enqueue the request
-		pthread_mutex_lock(&gMutex);
-		QueueEnq( req_path, file, local_path );
-		pthread_mutex_unlock(&gMutex);
+		// open loop: the next start is 1/rate later, or exponentially distributed 
+		// with that mean for Poisson arrivals
+		if (rate > 0)
+		{
+			if (poisson)
+				schedNs += -log( 1.0 - (double)rand_r(&arrivalSeed) / ((double)RAND_MAX + 1) ) * NSEC_PER_SEC / rate;
+			else
+				schedNs += NSEC_PER_SEC / rate;
+		}
+	}
 
-		while ( isQueueFull() );
-		pthread_cond_signal(&gCond);
+	//------ initialize the pool of worker threads
+	workerThreads = (pthread_t*)malloc( nthreads*sizeof(pthread_t) );
+	threadIDs     = (int*)malloc( nthreads*sizeof(int) );
+	runStartNs    = NowNs();
+	for (i=0; i<nthreads; ++i)
+	{
+		threadIDs[i] = i;
+		pthread_create( &workerThreads[i], NULL, workerFunc, &threadIDs[i] );
+	}
+
+	//------ sleep until every request has been completed
+	LatchWait( &reqLatch );
+	elapsed = (double)(NowNs() - runStartNs) / NSEC_PER_SEC;
+
+	// every worker has to be gone before any deque goes away, idle ones still look for tasks to steal
+	for (i=0; i<nthreads; ++i)
+	{
+		pthread_join( workerThreads[i], NULL );
 	}
 
-	//------ wait for the number of requests to be completed. 
-	while ( numReqTotal > GetRequestCounter() );
+	allHist = (histogram_t*)malloc( sizeof(histogram_t) );
+	HistInit( allHist );
+	for (i=0; i<nthreads; ++i)
+	{
+		DequeCleanup( &theDeques[i] );
+		HistMerge( allHist, &theHists[i] );
+	}
 
+	if (rate > 0)
+	{
+		fprintf(stdout, "Open loop, %s arrivals at %.1f req/s\n", poisson ? "poisson" : "const", rate);
+	}
+	fprintf(stdout, "%llu requests in %.3f s, %.1f req/s\n", (unsigned long long)allHist->total, elapsed, allHist->total / elapsed);
+	fprintf(stdout, "Latency (us): mean %.1f  p50 %llu  p90 %llu  p99 %llu  p99.9 %llu  max %llu\n", 
+			(allHist->total > 0) ? allHist->sum / allHist->total : 0.0,
+			(unsigned long long)HistPercentile(allHist, 50.0), (unsigned long long)HistPercentile(allHist, 90.0),
+			(unsigned long long)HistPercentile(allHist, 99.0), (unsigned long long)HistPercentile(allHist, 99.9),
+			(unsigned long long)allHist->max);
+	free( allHist );
+	free( theHists );
+	free( theDeques );
+	free( workerThreads );
+	free( threadIDs );
 
   	gfc_global_cleanup();
-	//QueueCleanup();
 	
 	return 0;
 }  
 
 
-//-------- GetNextIdx --------//
-static int GetNextIdx( int curIdx, int size )
+//-------- DequeInit --------//
+static void DequeInit( deque_t* dq, int size )
 {
-	return ( (curIdx + 1) % size );
+	pthread_mutex_init( &dq->lock, NULL );
+	dq->tasks    = (task_t*)malloc( size*sizeof(task_t) );
+	dq->front    = 0;
+	dq->back     = 0;
+	dq->capacity = size;
 }
 
-//-------- QueueInit --------//
-static void QueueInit( int size )
+//-------- DequePush --------//
+static void DequePush( deque_t* dq, char* reqPath, int reqNum, uint64_t startNs )
 {
-	int i = 0;
+	pthread_mutex_lock( &dq->lock );
+	dq->tasks[dq->back].reqPath = reqPath;
+	dq->tasks[dq->back].reqNum  = reqNum;
+	dq->tasks[dq->back].startNs = startNs;
+	dq->back++;
+	pthread_mutex_unlock( &dq->lock );
+}
+
+//-------- DequePop --------//
+// owner side, returns 0 if the deque is empty
+static int DequePop( deque_t* dq, task_t* task )
+{
+	int found = 0;
+
+	pthread_mutex_lock( &dq->lock );
+	if (dq->front < dq->back)
+	{
+		*task = dq->tasks[dq->front++];
+		found = 1;
+	}
+	pthread_mutex_unlock( &dq->lock );
 
-	theQ.front	  = 0;
-	theQ.rear  	  = size - 1;
-	theQ.capacity = size; 
-	theQ.numItem  = 0;
+	return found;
+}
 
-	theQ.reqPaths = (char**)malloc(size*sizeof(char*));
-	theQ.locPaths = (char**)malloc(size*sizeof(char*));
-	theQ.files    = (FILE**)malloc(size*sizeof(FILE*));
+//-------- DequeSteal --------//
+// thief side, returns 0 if the deque is empty
+static int DequeSteal( deque_t* dq, task_t* task )
+{
+	int found = 0;
 
-	for (i=0; i<size; ++i)
+	pthread_mutex_lock( &dq->lock );
+	if (dq->front < dq->back)
 	{
-		theQ.reqPaths[i] = (char*)malloc(PATH_BUFF_SIZE*sizeof(char));
-		theQ.locPaths[i] = (char*)malloc(PATH_BUFF_SIZE*sizeof(char));
+		*task = dq->tasks[--dq->back];
+		found = 1;
 	}
+	pthread_mutex_unlock( &dq->lock );
+
+	return found;
 }
 
-//-------- QueueEnq --------//
-static void QueueEnq( char* path, FILE* file, char* locPath )
+//-------- DequeStealDue --------//
+// open loop thief side, takes the owner's next task only if it is due by now.
+// Tasks are in schedule order, so the front is the most overdue one. If it isn't 
+// due yet, *nextNs is lowered to its start.
+static int DequeStealDue( deque_t* dq, task_t* task, uint64_t now, uint64_t* nextNs )
 {
-	theQ.rear = GetNextIdx( theQ.rear, theQ.capacity );
-	strcpy( theQ.reqPaths[theQ.rear], path ); 
-	strcpy( theQ.locPaths[theQ.rear], locPath ); 
-	theQ.files[theQ.rear] = file;
-	theQ.numItem++;
+	int found = 0;
+
+	pthread_mutex_lock( &dq->lock );
+	if (dq->front < dq->back)
+	{
+		if (dq->tasks[dq->front].startNs <= now)
+		{
+			*task = dq->tasks[dq->front++];
+			found = 1;
+		}
+		else if (dq->tasks[dq->front].startNs < *nextNs)
+		{
+			*nextNs = dq->tasks[dq->front].startNs;
+		}
+	}
+	pthread_mutex_unlock( &dq->lock );
+
+	return found;
 }
 
-//-------- QueueDeq --------//
-static int QueueDeq( void )
+//-------- DequeCleanup --------//
+static void DequeCleanup( deque_t* dq )
 {
-	int idx    = theQ.front;
-	theQ.front = GetNextIdx(theQ.front, theQ.capacity);
-	theQ.numItem--;
+	pthread_mutex_destroy( &dq->lock );
+	free( dq->tasks );
+}
+
 
-	return idx;
+//-------- LatchInit --------//
+static void LatchInit( latch_t* latch, int count )
+{
+	pthread_mutex_init( &latch->lock, NULL );
+	pthread_cond_init( &latch->cond, NULL );
+	latch->count = count;
 }
 
-//-------- isQueueEmpty --------//
-static int isQueueEmpty( void )
+//-------- LatchCountDown --------//
+static void LatchCountDown( latch_t* latch )
 {
-	if (theQ.numItem == 0)
-		return 1;
+	pthread_mutex_lock( &latch->lock );
+	if (--latch->count <= 0)
+		pthread_cond_broadcast( &latch->cond );
+	pthread_mutex_unlock( &latch->lock );
+}
 
-	return 0;
+//-------- LatchWait --------//
+static void LatchWait( latch_t* latch )
+{
+	pthread_mutex_lock( &latch->lock );
+	while (latch->count > 0)
+		pthread_cond_wait( &latch->cond, &latch->lock );
+	pthread_mutex_unlock( &latch->lock );
 }
 
-//-------- isQueueFull --------//
-static int isQueueFull( void )
+
+
+
+//-------- WriterFunc --------//
+// writer thread, writes queued chunks at their place in the file
+static void* WriterFunc( void* arg )
 {
-	if (theQ.numItem >= theQ.capacity)
-		return 1;
+	chunk_t*   chunk;
+	outfile_t* out;
+	ssize_t    written;
+	size_t     done;
+	int        noError;
 
-	return 0;
+	while (1)
+	{
+		pthread_mutex_lock( &writeLock );
+		while (writeHead == NULL)
+			pthread_cond_wait( &writeReady, &writeLock );
+		chunk     = writeHead;
+		writeHead = chunk->next;
+		if (writeHead == NULL)
+			writeTail = NULL;
+		numQueued--;
+		pthread_mutex_unlock( &writeLock );
+
+		out  = chunk->file;
+		done = 0;
+		while (done < chunk->len && atomic_load_explicit(&out->error, memory_order_relaxed) == 0)
+		{
+			written = pwrite(out->fd, &chunk->buf[done], chunk->len - done, chunk->offset + done);
+			if (written < 0 && errno == EINTR)
+				continue;
+			if (written < 0 && errno == EINVAL && out->direct)
+			{
+				// the file system took O_DIRECT at open(), but not this write
+				fcntl(out->fd, F_SETFL, fcntl(out->fd, F_GETFL) & ~O_DIRECT);
+				continue;
+			}
+			if (written <= 0)
+			{
+				// NOTE: writers of other chunks of the file may fail too, the first errno is kept
+				noError = 0;
+				atomic_compare_exchange_strong( &out->error, &noError, (written < 0) ? errno : EIO );
+				break;
+			}
+			done += written;
+		}
+
+		pthread_mutex_lock( &writeLock );
+		out->pending--;
+		if (chunk->cap == WRITE_CHUNK)
+		{
+			chunk->next = freeChunks;
+			freeChunks  = chunk;
+			chunk = NULL;
+		}
+		pthread_cond_broadcast( &writeDone );
+		pthread_mutex_unlock( &writeLock );
+
+		if (chunk != NULL)
+		{
+			free( chunk->buf );
+			free( chunk );
+		}
+	}
+
+	return NULL;
 }
 
-//-------- QueueCleanup --------//
-void QueueCleanup( void )
+//-------- WriterStart --------//
+static void WriterStart( int count )
 {
-	free( *theQ.reqPaths );
-	free( theQ.reqPaths );
-	free( *theQ.locPaths );
-	free( theQ.locPaths );
-	free( theQ.files );
+	pthread_t thread;
+	int i = 0;
+
+	for (i=0; i<count; ++i)
+	{
+		pthread_create( &thread, NULL, WriterFunc, NULL );
+		pthread_detach( thread );
+	}
 }
 
+//-------- ChunkGet --------//
+// a buffer for the next part of the file; files smaller than WRITE_CHUNK get one just big enough
+static chunk_t* ChunkGet( outfile_t* out )
+{
+	chunk_t* chunk = NULL;
+	size_t   cap   = WRITE_CHUNK;
+	size_t   rest;
+
+	if (out->bodyLen > 0)
+	{
+		rest = out->start + out->bodyLen - out->length;
+		if (rest < WRITE_CHUNK)
+			cap = (rest + WRITE_ALIGN - 1) / WRITE_ALIGN * WRITE_ALIGN;
+		if (cap == 0)
+			cap = WRITE_ALIGN;		// more than announced, the server is wrong
+	}
+
+	if (cap == WRITE_CHUNK)
+	{
+		pthread_mutex_lock( &writeLock );
+		if ( (chunk = freeChunks) != NULL )
+			freeChunks = chunk->next;
+		pthread_mutex_unlock( &writeLock );
+	}
+	if (chunk == NULL)
+	{
+		chunk = (chunk_t*)malloc( sizeof(chunk_t) );
+		chunk->buf = (char*)aligned_alloc( WRITE_ALIGN, cap );
+		chunk->cap = cap;
+	}
+
+	chunk->file   = out;
+	chunk->len    = 0;
+	chunk->offset = out->length;
+	chunk->next   = NULL;
+
+	return chunk;
+}
 
+//-------- ChunkSubmit --------//
+// queues the chunk for the writers, waits while the queue is full
+static void ChunkSubmit( outfile_t* out, chunk_t* chunk )
+{
+	pthread_mutex_lock( &writeLock );
+	while (numQueued >= WRITE_QUEUE_MAX * numWriters)
+		pthread_cond_wait( &writeDone, &writeLock );
+
+	if (writeTail != NULL)
+		writeTail->next = chunk;
+	else
+		writeHead = chunk;
+	writeTail = chunk;
+	numQueued++;
+	out->pending++;
+	pthread_cond_signal( &writeReady );
+	pthread_mutex_unlock( &writeLock );
+}
 
+//-------- OutInit --------//
+// no file yet; start is where the body goes, the file is kept up to there
+static void OutInit( outfile_t* out, char* path, gfcrequest_t* gfr, off_t start )
+{
+	memset( out, 0, sizeof(outfile_t) );
+	out->path   = path;
+	out->gfr    = gfr;
+	out->fd     = -1;
+	out->start  = start;
+	out->length = start;
+}
 
+//-------- OutCreate --------//
+// opens the file once the header is in, and reserves room for the announced body.
+// O_DIRECT needs aligned file offsets, so a resume from an odd position goes through the page cache.
+static void OutCreate( outfile_t* out )
+{
+	int flags = (out->start == 0) ? O_TRUNC : 0;
 
+	if (out->fd >= 0)
+		return;
 
+	out->bodyLen = gfc_get_filelen(out->gfr);
+	if (out->start % WRITE_ALIGN == 0)
+	{
+		out->fd     = openFile(out->path, flags | O_DIRECT);
+		out->direct = (out->fd >= 0) ? 1 : 0;
+	}
+	if (out->fd < 0)
+	{
+		out->fd = openFile(out->path, flags);
+	}
 
+	if (out->bodyLen > 0)
+	{
+		posix_fallocate(out->fd, out->start, out->bodyLen);
+	}
+}
 
+//-------- OutSplice --------//
+// NOTE: the file is opened up front and handed to gfclient, which splices the body into 
+// it past start. The kernel does the copy, so the writer threads and O_DIRECT are out of the 
+// picture, and the length is only known from the bytes received once the transfer is over.
+static void OutSplice( outfile_t* out )
+{
+	out->fd      = openFile(out->path, (out->start == 0) ? O_TRUNC : 0);
+	out->spliced = 1;
+	gfc_set_writefd(out->gfr, out->fd, out->start);
+}
+
+//-------- outcb --------//
+// write callback, copies the body into chunks
+static void outcb( void* data, size_t data_len, void* arg )
+{
+	outfile_t* out = (outfile_t*)arg;
+	chunk_t*   chunk;
+	size_t     n;
+
+	OutCreate(out);
+
+	while (data_len > 0)
+	{
+		if (out->chunk == NULL)
+			out->chunk = ChunkGet(out);
+		chunk = out->chunk;
+
+		n = chunk->cap - chunk->len;
+		if (n > data_len)
+			n = data_len;
+		memcpy( &chunk->buf[chunk->len], data, n );
+		chunk->len  += n;
+		out->length += n;
+		data      = (char*)data + n;
+		data_len -= n;
+
+		if (chunk->len == chunk->cap)
+		{
+			ChunkSubmit(out, chunk);
+			out->chunk = NULL;
+		}
+	}
+}
+
+//-------- OutClose --------//
+// writes what is left, waits for the writers and closes the file; returns -1 if a write failed.
+// The file is cut to the bytes received, which also drops the O_DIRECT padding and any
+// space reserved for a body that didn't arrive.
+static int OutClose( outfile_t* out, int sync )
+{
+	chunk_t* chunk = out->chunk;
+	size_t   padded;
+
+	if (out->fd < 0)
+		return 0;
+
+	if (out->spliced)
+		out->length = out->start + gfc_get_bytesreceived(out->gfr);
+
+	// a chunk is only taken for data, so one that is left isn't empty
+	if (chunk != NULL)
+	{
+		if (out->direct)
+		{
+			padded = (chunk->len + WRITE_ALIGN - 1) / WRITE_ALIGN * WRITE_ALIGN;
+			memset( &chunk->buf[chunk->len], 0, padded - chunk->len );
+			chunk->len = padded;
+		}
+		ChunkSubmit(out, chunk);
+	}
+	out->chunk = NULL;
+
+	pthread_mutex_lock( &writeLock );
+	while (out->pending > 0)
+		pthread_cond_wait( &writeDone, &writeLock );
+	pthread_mutex_unlock( &writeLock );
+
+	if (ftruncate(out->fd, out->length) < 0 && out->error == 0)
+		out->error = errno;
+	if (sync && fdatasync(out->fd) < 0 && out->error == 0)
+		out->error = errno;
+	close(out->fd);
+	out->fd = -1;
+
+	if (out->error != 0)
+	{
+		fprintf(stderr, "Unable to write %s: %s\n", out->path, strerror(out->error));
+		return -1;
+	}
+
+	return 0;
+}
+
+
+//-------- MakeDirs --------//
+// creates the directories on path that this run hasn't made yet
+static void MakeDirs( char* path )
+{
+	char* cur;
+	char* prev = path;
+	uint32_t hash;
+	int i, slot;
+	int known;
+
+	pthread_mutex_lock( &dirLock );
+	while ( NULL != (cur = strchr(prev + 1, '/')) )
+	{
+		*cur = '\0';
+
+		// FNV-1a of the directory, linear probing
+		hash = 2166136261u;
+		for (i=0; path[i]; ++i)
+			hash = (hash ^ (unsigned char)path[i]) * 16777619u;
+		known = 0;
+		for (slot = hash & (DIR_CACHE_SIZE - 1); dirCache[slot] != NULL; slot = (slot + 1) & (DIR_CACHE_SIZE - 1))
+		{
+			if ( strcmp(dirCache[slot], path) == 0 )
+			{
+				known = 1;
+				break;
+			}
+		}
+
+		if (!known)
+		{
+			if (0 > mkdir(path, S_IRWXU) && errno != EEXIST)
+			{
+				perror("Unable to create directory");
+				exit(EXIT_FAILURE);
+			}
+			// a full cache just means more mkdir() calls
+			if (numDirs < DIR_CACHE_SIZE / 2)
+			{
+				dirCache[slot] = strdup(path);
+				numDirs++;
+			}
+		}
+
+		*cur = '/';
+		prev = cur;
+	}
+	pthread_mutex_unlock( &dirLock );
+}
@@ -0,0 +1,328 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+
+#include "workload.h"
+#include "gfclient.h"
+
+#define USAGE                                                                 \
+"usage:\n"                                                                    \
+"  gfclient_stress [options]\n"                                               \
+"options:\n"                                                                  \
+"  -h                  Show this help message\n"                              \
+"  -s [server_addr]    Server address (Default: localhost)\n"                 \
+"  -p [server_port]    Server port (Default: 8080)\n"                         \
+"  -w [workload_path]  Path to workload file (Default: workload.txt)\n"       \
+"  -c [content_file]   The server's content file, request path to source file (Default: content.txt)\n" \
+"  -t [nthreads]       Number of threads (Default: 64)\n"                     \
+"  -n [num_requests]   Requests per thread (Default: 100)\n"                  \
+"  -k                  Keep connections to the server open between requests\n"
+
+/* OPTIONS DESCRIPTOR ====================================================== */
+static struct option gLongOptions[] =
+{
+  {"server",        required_argument,      NULL,           's'},
+  {"port",          required_argument,      NULL,           'p'},
+  {"workload-path", required_argument,      NULL,           'w'},
+  {"content",       required_argument,      NULL,           'c'},
+  {"nthreads",      required_argument,      NULL,           't'},
+  {"nrequests",     required_argument,      NULL,           'n'},
+  {"keep-alive",    no_argument,            NULL,           'k'},
+  {"help",          no_argument,            NULL,           'h'},
+  {NULL,            0,                      NULL,             0}
+};
+
+
+#define MAX_PATHS		1024		// workload paths loaded up front
+#define PATH_BUFF_SIZE	512
+
+char 		    *server    = "localhost";
+unsigned short port 	   = 8080;
+int			   keepAlive   = 0;			// reuse persistent connections to the server
+int			   numRequests = 100;
+
+//-------- externs from gfclient.c
+// requests a persistent connection that later requests to the same server can reuse
+extern void gfc_set_keepalive(gfcrequest_t *gfr, int keepAlive);
+
+// Many threads run gfc_perform() at the same time and every body is compared byte
+// for byte with the file the server sends it from, as the content file maps it.
+// Paths that aren't in the content file have to come back FILE_NOT_FOUND.
+
+
+//----------------- Source Type ------------------//
+// the expected body of a workload path, mapped from the source file
+typedef struct source
+{
+	char*		path;
+	char*		data;			// NULL if the server doesn't have the path
+	size_t		length;
+} source_t;
+
+static source_t		sources[MAX_PATHS];
+static int			numSources;
+
+//----------------- Check Type ------------------//
+// what one request has received so far
+typedef struct check
+{
+	source_t*	source;
+	size_t		received;
+	int			mismatch;		// a byte differs, or there are more than the source has
+} check_t;
+
+static _Atomic uint64_t	numOk;
+static _Atomic uint64_t	numFailed;
+
+
+//------------ Usage -------------//
+static void Usage()
+{
+	fprintf(stdout, "%s", USAGE);
+}
+
+//------------ MapSource -------------//
+// returns -1 if the source file can't be read
+static int MapSource( source_t* source, char* localPath )
+{
+	struct stat st;
+	int fd;
+
+	if ( (fd = open(localPath, O_RDONLY)) < 0 )
+		return -1;
+	if (fstat(fd, &st) < 0)
+	{
+		close(fd);
+		return -1;
+	}
+
+	source->length = st.st_size;
+	source->data   = "";
+	if (st.st_size > 0)
+	{
+		source->data = (char*)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (source->data == MAP_FAILED)
+		{
+			close(fd);
+			return -1;
+		}
+	}
+	close(fd);
+
+	return 0;
+}
+
+//------------ LoadSources -------------//
+// looks every workload path up in the content file, lines of "<request path> <local file>"
+static int LoadSources( char* contentPath )
+{
+	char  line[2 * PATH_BUFF_SIZE];
+	char  reqPath[PATH_BUFF_SIZE];
+	char  localPath[PATH_BUFF_SIZE];
+	FILE* content;
+	int   i = 0;
+
+	if ( (content = fopen(contentPath, "r")) == NULL )
+		return -1;
+
+	while ( fgets(line, sizeof(line), content) != NULL )
+	{
+		if (sscanf(line, "%511s %511s", reqPath, localPath) != 2)
+			continue;
+
+		for (i=0; i<numSources; ++i)
+		{
+			if (sources[i].data != NULL || strcmp(sources[i].path, reqPath) != 0)
+				continue;
+			if (MapSource(&sources[i], localPath) < 0)
+			{
+				fprintf(stderr, "%s @ %d: unable to read %s for %s, %s\n", __FILE__, __LINE__, localPath, reqPath, strerror(errno));
+				fclose(content);
+				return -1;
+			}
+		}
+	}
+	fclose(content);
+
+	return 0;
+}
+
+/* Callbacks ========================================================= */
+static void writecb(void* data, size_t data_len, void *arg)
+{
+	check_t* check = (check_t*)arg;
+	source_t* source = check->source;
+
+	if ( source->data == NULL || check->received + data_len > source->length ||
+		 memcmp(&source->data[check->received], data, data_len) != 0 )
+	{
+		check->mismatch = 1;
+	}
+	check->received += data_len;
+}
+
+
+//----------- Worker Thread: workerFunc ---------------//
+static void* workerFunc( void* arg )
+{
+	int tID = (int)(intptr_t)arg;
+	gfcrequest_t* gfr;
+	source_t* source;
+	check_t check;
+	gfstatus_t status;
+	int returncode;
+	int i = 0;
+
+	for (i=0; i<numRequests; ++i)
+	{
+		// neighbouring threads start at different paths, so every path is in flight at once
+		source = &sources[ (tID + i) % numSources ];
+		memset( &check, 0, sizeof(check) );
+		check.source = source;
+
+		gfr = gfc_create();
+		gfc_set_server(gfr, server);
+		gfc_set_path(gfr, source->path);
+		gfc_set_port(gfr, port);
+		gfc_set_writefunc(gfr, writecb);
+		gfc_set_writearg(gfr, &check);
+		gfc_set_keepalive(gfr, keepAlive);
+
+		returncode = gfc_perform(gfr);
+		status     = gfc_get_status(gfr);
+
+		if (source->data == NULL)
+		{
+			check.mismatch |= (status != GF_FILE_NOT_FOUND);
+		}
+		else
+		{
+			check.mismatch |= (returncode < 0 || status != GF_OK || check.received != source->length ||
+								gfc_get_filelen(gfr) != source->length);
+		}
+
+		if (check.mismatch)
+		{
+			if (source->data == NULL)
+				fprintf(stderr, "thread %d: %s returned %s, not FILE_NOT_FOUND\n", tID, source->path, gfc_strstatus(status));
+			else
+				fprintf(stderr, "thread %d: %s returned %s, %zu of %zu bytes%s\n", tID, source->path,
+						gfc_strstatus(status), check.received, source->length,
+						(check.received == source->length) ? ", content differs" : "");
+			atomic_fetch_add( &numFailed, 1 );
+		}
+		else
+		{
+			atomic_fetch_add( &numOk, 1 );
+		}
+		gfc_cleanup(gfr);
+	}
+
+	return NULL;
+}
+
+
+//------------------------------- Main --------------------------------------//
+int main(int argc, char **argv)
+{
+	char *workload_path = "workload.txt";
+	char *content_path  = "content.txt";
+	pthread_t* threads;
+	char* path;
+	int nthreads = 64;
+
+  	int i, j;
+  	int option_char = 0;
+
+  	// Parse and set command line arguments
+  	while ( (option_char = getopt_long(argc, argv, "s:p:w:c:t:n:kh", gLongOptions, NULL)) != -1 )
+	{
+	    switch (option_char)
+		{
+		case 's': // server
+			server = optarg;
+			break;
+   	    case 'p': // port
+			port = atoi(optarg);
+			break;
+      	case 'w': // workload-path
+			workload_path = optarg;
+			break;
+      	case 'c': // content file
+			content_path = optarg;
+			break;
+      	case 't': // nthreads
+			nthreads = atoi(optarg);
+			if (nthreads < 1)
+				nthreads = 1;
+			break;
+      	case 'n': // nrequests
+			numRequests = atoi(optarg);
+			break;
+      	case 'k': // keep-alive
+			keepAlive = 1;
+			break;
+      	case 'h': // help
+			Usage();
+			exit(0);
+			break;
+      	default:
+			Usage();
+			exit(1);
+    	}
+  	}
+
+	if( EXIT_SUCCESS != workload_init(workload_path))
+	{
+		fprintf(stderr, "Unable to load workload file %s.\n", workload_path);
+    	exit(EXIT_FAILURE);
+  	}
+
+	// the workload module isn't thread-safe, take its distinct paths up front
+	for (i=0; i<MAX_PATHS; ++i)
+	{
+		path = workload_get_path();
+		for (j=0; j<numSources; ++j)
+		{
+			if (strcmp(sources[j].path, path) == 0)
+				break;
+		}
+		if (j == numSources)
+			sources[numSources++].path = path;
+	}
+
+	if (LoadSources(content_path) < 0)
+	{
+		fprintf(stderr, "Unable to load content file %s.\n", content_path);
+		exit(EXIT_FAILURE);
+	}
+
+  	gfc_global_init();
+
+	threads = (pthread_t*)malloc( nthreads*sizeof(pthread_t) );
+	for (i=0; i<nthreads; ++i)
+	{
+		pthread_create( &threads[i], NULL, workerFunc, (void*)(intptr_t)i );
+	}
+	for (i=0; i<nthreads; ++i)
+	{
+		pthread_join( threads[i], NULL );
+	}
+	free( threads );
+
+  	gfc_global_cleanup();
+
+	fprintf(stdout, "%d threads x %d requests: %llu ok, %llu failed\n", nthreads, numRequests,
+			(unsigned long long)atomic_load(&numOk), (unsigned long long)atomic_load(&numFailed));
+
+	return (atomic_load(&numFailed) == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,102 @@
+#include <string.h>
+
+#include "histogram.h"
+
+static int      HistIndex( uint64_t value );
+static uint64_t HistValue( int index );
+
+
+//-------- HistInit --------//
+void HistInit( histogram_t* hist )
+{
+	memset( hist, 0, sizeof(histogram_t) );
+	hist->min = UINT64_MAX;
+}
+
+//-------- HistIndex --------//
+static int HistIndex( uint64_t value )
+{
+	int msb = 63 - __builtin_clzll( value | 1 );
+	int shift;
+
+	if (value < HIST_SUB_COUNT)
+		return (int)value;
+	if (msb >= HIST_MAX_BITS)
+		return HIST_BUCKETS - 1;
+
+	// value >> shift is in [HIST_HALF_COUNT, HIST_SUB_COUNT)
+	shift = msb - HIST_SUB_BITS + 1;
+	return HIST_SUB_COUNT + (shift - 1) * HIST_HALF_COUNT + (int)(value >> shift) - HIST_HALF_COUNT;
+}
+
+//-------- HistValue --------//
+// middle of the value range covered by a bucket
+static uint64_t HistValue( int index )
+{
+	int shift;
+	uint64_t sub;
+
+	if (index < HIST_SUB_COUNT)
+		return index;
+
+	shift = (index - HIST_SUB_COUNT) / HIST_HALF_COUNT + 1;
+	sub   = (index - HIST_SUB_COUNT) % HIST_HALF_COUNT + HIST_HALF_COUNT;
+
+	return (sub << shift) + ( (1ULL << shift) >> 1 );
+}
+
+//-------- HistRecord --------//
+void HistRecord( histogram_t* hist, uint64_t value )
+{
+	hist->counts[ HistIndex(value) ]++;
+	hist->total++;
+	hist->sum += value;
+	if (value < hist->min)
+		hist->min = value;
+	if (value > hist->max)
+		hist->max = value;
+}
+
+//-------- HistMerge --------//
+void HistMerge( histogram_t* dst, const histogram_t* src )
+{
+	int i = 0;
+
+	for (i=0; i<HIST_BUCKETS; ++i)
+	{
+		dst->counts[i] += src->counts[i];
+	}
+	dst->total += src->total;
+	dst->sum   += src->sum;
+	if (src->min < dst->min)
+		dst->min = src->min;
+	if (src->max > dst->max)
+		dst->max = src->max;
+}
+
+//-------- HistPercentile --------//
+uint64_t HistPercentile( const histogram_t* hist, double percentile )
+{
+	uint64_t target;
+	uint64_t seen = 0;
+	uint64_t value;
+	int i = 0;
+
+	if (hist->total == 0)
+		return 0;
+
+	target = (uint64_t)( percentile / 100.0 * hist->total + 0.5 );
+	if (target < 1)
+		target = 1;
+
+	for (i=0; i<HIST_BUCKETS; ++i)
+	{
+		seen += hist->counts[i];
+		if (seen >= target)
+			break;
+	}
+
+	// never report more than was actually measured
+	value = HistValue(i);
+	return (value > hist->max) ? hist->max : value;
+}
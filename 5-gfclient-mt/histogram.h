@@ -0,0 +1,31 @@
+#ifndef __HISTOGRAM_H__
+#define __HISTOGRAM_H__
+
+#include <stdint.h>
+
+#define HIST_SUB_BITS	7			// 2^7 sub-buckets per power of 2, < 1% error
+#define HIST_SUB_COUNT	(1 << HIST_SUB_BITS)
+#define HIST_HALF_COUNT	(HIST_SUB_COUNT / 2)
+#define HIST_MAX_BITS	40			// latencies up to 2^40 us
+#define HIST_BUCKETS	(HIST_SUB_COUNT + (HIST_MAX_BITS - HIST_SUB_BITS) * HIST_HALF_COUNT)
+
+//----------------- Histogram Type ------------------//
+// log-linear latency histogram in microseconds (HDR histogram layout): values below
+// HIST_SUB_COUNT have a bucket each, above that every power of 2 is split into
+// HIST_HALF_COUNT buckets, so the relative error stays below 1/HIST_HALF_COUNT.
+// One per client thread, merged once the run is over.
+typedef struct histogram
+{
+	uint64_t	counts[HIST_BUCKETS];
+	uint64_t	total;
+	uint64_t	min;
+	uint64_t	max;
+	double		sum;
+} histogram_t;
+
+void		HistInit( histogram_t* hist );
+void		HistRecord( histogram_t* hist, uint64_t value );
+void		HistMerge( histogram_t* dst, const histogram_t* src );
+uint64_t	HistPercentile( const histogram_t* hist, double percentile );
+
+#endif // __HISTOGRAM_H__
@@ -0,0 +1,68 @@
+#!/bin/sh
+# Compares the server's connection engines under the same gfbench load.
+#
+# usage: engine_bench.sh <gfserver_main> <gfbench> <content_file> <workload_file>
+#
+# Every engine in ENGINES is started in turn and loaded with gfbench, once per
+# connection count in CONNS, with and without keep-alive. Set BLOCKING_SERVER to
+# a gfserver_main built from the blocking accept/recv server (before the epoll
+# reactor) to run it as engine "blocking" with the same load.
+#
+#   ENGINES      engines to compare (Default: "epoll uring")
+#   CONNS        gfbench connection counts (Default: "1 16 64 256")
+#   THREADS      server worker threads (Default: 8)
+#   DURATION     seconds per run (Default: 10)
+#   PORT         listen port (Default: 18080)
+#   SERVER_ARGS  extra server options, i.e. "-m 0" to take the cache out
+
+if [ $# -ne 4 ]; then
+	sed -n '4p' "$0" | cut -c3-
+	exit 1
+fi
+
+SERVER=$1
+BENCH=$2
+CONTENT=$3
+WORKLOAD=$4
+ENGINES=${ENGINES:-"epoll uring"}
+CONNS=${CONNS:-"1 16 64 256"}
+THREADS=${THREADS:-8}
+DURATION=${DURATION:-10}
+PORT=${PORT:-18080}
+
+if [ -n "$BLOCKING_SERVER" ]; then
+	ENGINES="blocking $ENGINES"
+fi
+
+#------------ run_engine -------------#
+# starts the server with engine $1 and runs every load against it
+run_engine()
+{
+	if [ "$1" = "blocking" ]; then
+		"$BLOCKING_SERVER" -p "$PORT" -t "$THREADS" -c "$CONTENT" >/dev/null 2>&1 &
+	else
+		"$SERVER" -p "$PORT" -t "$THREADS" -c "$CONTENT" -e "$1" $SERVER_ARGS >/dev/null 2>&1 &
+	fi
+	pid=$!
+	sleep 1
+	if ! kill -0 "$pid" 2>/dev/null; then
+		echo "engine $1: server didn't start" >&2
+		return
+	fi
+
+	for keep in "" "-k"; do
+		for conns in $CONNS; do
+			printf "%-8s " "$1"
+			# a server that stops answering would leave gfbench waiting forever
+			timeout $((DURATION + 30)) "$BENCH" -p "$PORT" -w "$WORKLOAD" -c "$conns" -D "$DURATION" $keep -j ||
+				echo "{\"connections\": $conns, \"failed\": true}"
+		done
+	done
+
+	kill "$pid"
+	wait "$pid" 2>/dev/null
+}
+
+for engine in $ENGINES; do
+	run_engine "$engine"
+done
@@ -17,7 +17,12 @@
 "  -h                  Show this help message.\n"                             \
 "  -c [content_file]   Content file mapping keys to content files\n"          \
 "  -p [listen_port]    Listen port (Default: 8080)\n"                         \
-"  -t [nthreads]       Number of threads (Default: 1)\n"
+"  -t [nthreads]       Number of threads (Default: 1)\n"                    \
+"  -m [cache_mb]       Content cache size in MB, 0 disables it (Default: 64)\n"\
+"  -z                  Serve files from shared mmap'd regions\n"              \
+"  -e [engine]         Connection engine, epoll or uring (Default: epoll)\n"   \
+"  -a [nacceptors]     Number of acceptor threads (Default: 1)\n"           \
+"  -S                  Answer GETFILE GET /__stats with the server statistics\n"
 
 /* OPTIONS DESCRIPTOR ====================================================== */
 static struct option gLongOptions[] = 
@@ -25,6 +30,11 @@ static struct option gLongOptions[] =
 	{"port",          required_argument,      NULL,           'p'},
 	{"content",       required_argument,      NULL,           'c'},
     {"nthreads",      required_argument,      NULL,           't'},
+    {"cache",         required_argument,      NULL,           'm'},
+    {"mmap",          no_argument,            NULL,           'z'},
+    {"engine",        required_argument,      NULL,           'e'},
+    {"acceptors",     required_argument,      NULL,           'a'},
+    {"stats",         no_argument,            NULL,           'S'},
     {"help",          no_argument,            NULL,           'h'},
     {NULL,            0,                      NULL,             0}
 };
@@ -37,9 +47,25 @@ extern void 	*workerFunc(void *threadArgument);
 // boss thread callback
 extern ssize_t boss_handler(gfcontext_t* ctx, char* path, void* arg);
 // initialization of the global thread queue
-extern void 	QueueInit( int size );
+extern int 		QueueInit( int size );
 // cleans up queue dynamic memory
 extern void		QueueCleanup( void );
+// sets up the content cache, capacity in bytes; useMmap maps files instead of reading them
+extern void		CacheInit( size_t capacity, int useMmap );
+// appends the queue and cache counters to the /__stats report
+extern size_t	HandlerStats( char* buf, size_t size );
+
+//-------- externs from gfserver.c
+// selects the connection engine by name, -1 if unknown
+extern int		gfserver_set_engine( gfserver_t* gfs, const char* name );
+// number of acceptor/reactor threads sharing the port
+extern void		gfserver_set_acceptors( gfserver_t* gfs, int numAcceptors );
+// answers /__stats with the server statistics
+extern void		gfserver_set_stats( gfserver_t* gfs, int enable );
+// adds the handler's statistics to the report
+extern void		gfserver_set_statsfunc( gfserver_t* gfs, size_t (*statsFunc)(char*, size_t) );
+// most connections served at once
+extern int		gfserver_get_maxconnections( gfserver_t* gfs );
 
 // for allocating and defining the worker thread pool
 pthread_t* 	  workerThreads;
@@ -62,8 +88,13 @@ int main(int argc, char **argv)
 	int option_char  = 0;
 	int i 			 = 0;
 	int nthreads 	 = 1;	
+	int cacheMB 	 = 64;
+	int useMmap 	 = 0;
+	int nacceptors 	 = 1;
+	int stats 		 = 0;
 	unsigned short port = 8080;
   	char *content = "content.txt";
+  	char *engine  = "epoll";
   	gfserver_t *gfs;	
 
     if (signal(SIGINT, _sig_handler) == SIG_ERR)
@@ -79,7 +110,7 @@ int main(int argc, char **argv)
   	}
 
   	// Parse and set command line arguments
-  	while ((option_char = getopt_long(argc, argv, "p:t:c:h", gLongOptions, NULL)) != -1) 
+  	while ((option_char = getopt_long(argc, argv, "p:t:c:m:ze:a:Sh", gLongOptions, NULL)) != -1) 
 	{
 		switch (option_char) 
 		{
@@ -92,6 +123,21 @@ int main(int argc, char **argv)
       	case 'c': // file-path
         	content = optarg;
         	break;                                          
+      	case 'm': // cache size
+        	cacheMB = atoi(optarg);
+        	break;                                          
+      	case 'z': // mmap mode
+        	useMmap = 1;
+        	break;                                          
+      	case 'e': // connection engine
+        	engine = optarg;
+        	break;                                          
+      	case 'a': // acceptor threads
+        	nacceptors = atoi(optarg);
+        	break;                                          
+      	case 'S': // statistics
+        	stats = 1;
+        	break;                                          
       	case 'h': // help
         	fprintf(stdout, "%s", USAGE);
         	exit(0);
@@ -114,12 +160,36 @@ int main(int argc, char **argv)
   	gfs = gfserver_create();
   	gfserver_set_port(gfs, port);
   	gfserver_set_maxpending(gfs, 100);
+  	gfserver_set_acceptors(gfs, nacceptors);
+  	if (gfserver_set_engine(gfs, engine) < 0)
+	{
+		fprintf(stderr, "unknown engine %s\n%s", engine, USAGE);
+		exit(1);
+	}
   	//gfserver_set_handler(gfs, handler_get);
   	gfserver_set_handler(gfs, boss_handler);
   	gfserver_set_handlerarg(gfs, NULL);
+  	gfserver_set_stats(gfs, stats);
+  	gfserver_set_statsfunc(gfs, HandlerStats);
 
-	// Initialize global pthreads resources
-	QueueInit( nthreads + 2 );
+	if (cacheMB < 0)
+	{
+		cacheMB = 0;
+	}
+	if (useMmap && cacheMB == 0)
+	{
+		fprintf(stderr, "mmap mode needs a cache size > 0\n");
+		exit(1);
+	}
+	CacheInit( (size_t)cacheMB << 20, useMmap );
+
+	// Initialize global pthreads resources; the queue can hold every connection the server accepts,
+	// so the boss never blocks on a full queue
+	if (QueueInit( gfserver_get_maxconnections(gfs) ) < 0)
+	{
+		fprintf(stderr, "Unable to allocate the request queue\n");
+		exit(1);
+	}
 	workerThreads = (pthread_t*)malloc( nthreads*sizeof(pthread_t) );
 	threadIDs     = (int*)malloc( nthreads*sizeof(int) );
 	for (i=0; i<nthreads; ++i)
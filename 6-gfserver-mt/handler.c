@@ -5,102 +5,444 @@
 #include <unistd.h>
 #include <errno.h>
 #include <pthread.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <inttypes.h>
 
 #include "gfserver.h"
 #include "content.h"
+#include "ring.h"
+#include "../4-gfserver/gfs_log.h"
 
-#define BUFFER_SIZE 	4096
-#define PATH_BUFF_SIZE	128
+#define CACHE_LINE		64
+#define CACHE_SHARDS	16		// independently locked parts of the content cache, power of 2
+#define CACHE_BUCKETS	256		// hash chains per shard, power of 2
+#define CACHE_REVALIDATE_MS	1000	// a cached file is checked for changes at most this often
 
 ssize_t handler_get(gfcontext_t* ctx, char* path, void* arg);
 
+//-------- externs from gfserver.c
+// zero-copy transfer of a file region as the response body
+extern ssize_t gfs_sendfile(gfcontext_t* ctx, int fileFD, off_t offset, size_t len);
+// part of the file the client asked for; 0 if it wants all of it
+extern int     gfs_get_range(gfcontext_t* ctx, size_t* offset, size_t* len);
+// response header for a range, len body bytes out of total, starting at offset
+extern ssize_t gfs_sendheader_range(gfcontext_t* ctx, gfstatus_t status, size_t len, size_t offset, size_t total);
+// times how long the request waited for a worker
+extern void    gfs_mark_dequeued(gfcontext_t* ctx);
 
-//------------ Global PThread Resources -------------//
-pthread_mutex_t gMutex    = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t gMutexCtx = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t  gCond     = PTHREAD_COND_INITIALIZER;
 
-//----------------- Queue Type ------------------//
-// items are added at the rear and poppoed off of the front
-typedef struct queue
+//----------------- Queue ------------------//
+// requests travel from the boss to the workers through a ring (see ring.c);
+// the boss parks while it is full, idle workers park while it is empty
+static ring_t theQ;
+
+//-------- QueueInit --------//
+// NOTE: size is rounded up to the next power of 2; returns -1 if it can't be allocated
+int QueueInit( int size )
 {
-	char** 		  paths;
-	gfcontext_t** ctx;
-	int		front;
-	int 	rear;
-	int		numItem;
-	int   	capacity;
-} queue_t;
-static queue_t theQ;
+	return RingInit( &theQ, size );
+}
 
-//-------- GetNextIdx --------//
-int GetNextIdx( int curIdx, int size )
+//-------- QueueEnq --------//
+// blocks while the queue is full
+static void QueueEnq( char* path, gfcontext_t* ctx )
 {
-	return ( (curIdx + 1) % size );
+	RingEnq( &theQ, path, ctx );
 }
 
-//-------- QueueInit --------//
-void QueueInit( int size )
+//-------- QueueDeq --------//
+// blocks while the queue is empty
+static void QueueDeq( char** path, gfcontext_t** ctx )
+{
+	void* arg;
+
+	RingDeq( &theQ, path, &arg );
+	*ctx = (gfcontext_t*)arg;
+}
+
+//-------- QueueCleanup --------//
+void QueueCleanup( void )
+{
+	RingCleanup( &theQ );
+}
+
+
+//----------------- Cache Type ------------------//
+// size-bounded content cache in front of content_get(), keyed by request path.
+// Paths are hashed onto CACHE_SHARDS shards, each with its own lock, hash chains and 
+// LRU list, so workers serving different files rarely meet on the same lock.
+// Entries are reference counted: an evicted or invalidated entry stays valid 
+// until the last worker sending it lets go.
+// In mmap mode the entries map their files instead of holding a copy, so every 
+// connection fetching a file sends from the same page-cache pages.
+// NOTE: the response header isn't kept, it depends on the connection (KEEPALIVE)
+typedef struct cache_entry
 {
-	int i = 0 ;
+	char*				path;
+	uint32_t			hash;
+	char*				data;			// file contents, malloc'd or mapped
+	size_t				len;
+	struct timespec		mtime;			// modification time when data was read
+	uint64_t			checked;		// monotonic ms of the last change check
+	_Atomic int			refs;			// the cache holds one reference while the entry is linked
+	struct cache_entry*	hashNext;
+	struct cache_entry*	lruPrev;		// towards the most recently used
+	struct cache_entry*	lruNext;
+} cache_entry_t;
+
+typedef struct cache_shard
+{
+	_Alignas(CACHE_LINE) pthread_mutex_t	lock;
+	cache_entry_t*	buckets[CACHE_BUCKETS];
+	cache_entry_t*	lruHead;		// most recently used
+	cache_entry_t*	lruTail;		// next to be evicted
+	size_t			bytes;			// file bytes held by the shard
+	size_t			capacity;		// the shard's share of cacheCapacity, all of it in mmap mode
+} cache_shard_t;
+
+static cache_shard_t	theCache[CACHE_SHARDS];
+static size_t			cacheCapacity = 0;		// 0 disables the cache
+static int				cacheMmap     = 0;		// entries are mmap'd, not read
+static _Atomic size_t	cacheBytes;				// file bytes of all shards, plus entries about to be linked
+static _Atomic unsigned	cacheNextEvict;			// round robin over the shards when the total is over capacity
+static _Atomic uint64_t	cacheHits;
+static _Atomic uint64_t	cacheMisses;
+static _Atomic uint64_t	cacheEvictions;
+
+
+//-------- CacheNowMs --------//
+static uint64_t CacheNowMs( void )
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
 
-	theQ.front	  = 0;
-	theQ.rear  	  = size - 1;
-	theQ.capacity = size; 
-	theQ.numItem  = 0;
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-	theQ.paths = (char**)malloc(size*sizeof(char*));
-	theQ.ctx   = (gfcontext_t**)malloc(size*sizeof(gfcontext_t*));
+//-------- CacheHash --------//
+// FNV-1a
+static uint32_t CacheHash( const char* path )
+{
+	uint32_t hash = 2166136261u;
 
-	for (i=0; i<size; ++i)
+	while (*path)
 	{
-		theQ.paths[i] = (char*)malloc(PATH_BUFF_SIZE*sizeof(char));
+		hash ^= (unsigned char)*path++;
+		hash *= 16777619u;
 	}
+
+	return hash;
 }
 
-//-------- QueueEnq --------//
-void QueueEnq( char* path, gfcontext_t* ctx )
+//-------- CacheInit --------//
+// capacity is the total number of file bytes cached, 0 turns the cache off.
+// With useMmap the files are mapped, and a single file may take up the whole capacity;
+// the shards then share the capacity instead of getting a fixed part of it each.
+void CacheInit( size_t capacity, int useMmap )
+{
+	int i = 0;
+
+	cacheCapacity = capacity;
+	cacheMmap     = useMmap;
+	for (i=0; i<CACHE_SHARDS; ++i)
+	{
+		pthread_mutex_init( &theCache[i].lock, NULL );
+		memset( theCache[i].buckets, 0, sizeof(theCache[i].buckets) );
+		theCache[i].lruHead  = NULL;
+		theCache[i].lruTail  = NULL;
+		theCache[i].bytes    = 0;
+		theCache[i].capacity = useMmap ? capacity : capacity / CACHE_SHARDS;
+	}
+	atomic_init( &cacheBytes, 0 );
+	atomic_init( &cacheNextEvict, 0 );
+	atomic_init( &cacheHits, 0 );
+	atomic_init( &cacheMisses, 0 );
+	atomic_init( &cacheEvictions, 0 );
+}
+
+//-------- CacheStats --------//
+void CacheStats( uint64_t* hits, uint64_t* misses, uint64_t* evictions )
 {
-	theQ.rear = GetNextIdx( theQ.rear, theQ.capacity );
-	strcpy( theQ.paths[theQ.rear], path ); 
-	theQ.ctx[theQ.rear] = ctx;
-	theQ.numItem++;
+	*hits      = atomic_load( &cacheHits );
+	*misses    = atomic_load( &cacheMisses );
+	*evictions = atomic_load( &cacheEvictions );
 }
 
-//-------- QueueDeq --------//
-int QueueDeq( void )
+//-------- CacheFree --------//
+static void CacheFree( cache_entry_t* entry )
+{
+	if (cacheMmap)
+	{
+		if (entry->data != NULL)
+			munmap( entry->data, entry->len );
+	}
+	else
+	{
+		free( entry->data );
+	}
+	free( entry->path );
+	free( entry );
+}
+
+//-------- CacheRelease --------//
+static void CacheRelease( cache_entry_t* entry )
 {
-	int idx    = theQ.front;
-	theQ.front = GetNextIdx(theQ.front, theQ.capacity);
-	theQ.numItem--;
+	if ( atomic_fetch_sub( &entry->refs, 1 ) == 1 )
+	{
+		CacheFree( entry );
+	}
+}
 
-	return idx;
+//-------- CacheUnlink --------//
+// NOTE: the shard must be locked; drops the cache's reference
+static void CacheUnlink( cache_shard_t* shard, cache_entry_t* entry )
+{
+	cache_entry_t** link = &shard->buckets[ (entry->hash / CACHE_SHARDS) & (CACHE_BUCKETS - 1) ];
+
+	while (*link != entry)
+		link = &(*link)->hashNext;
+	*link = entry->hashNext;
+
+	if (entry->lruPrev != NULL)
+		entry->lruPrev->lruNext = entry->lruNext;
+	else
+		shard->lruHead = entry->lruNext;
+	if (entry->lruNext != NULL)
+		entry->lruNext->lruPrev = entry->lruPrev;
+	else
+		shard->lruTail = entry->lruPrev;
+
+	shard->bytes -= entry->len;
+	atomic_fetch_sub( &cacheBytes, entry->len );
+	CacheRelease( entry );
 }
 
-//-------- isQueueEmpty --------//
-int isQueueEmpty( void )
+//-------- CacheEvictAny --------//
+// evicts the least recently used entry of the next non-empty shard, returns 0 if all are empty
+// NOTE: no shard may be locked by the caller
+static int CacheEvictAny( void )
 {
-	if (theQ.numItem == 0)
-		return 1;
+	cache_shard_t* shard;
+	int i = 0;
+
+	for (i=0; i<CACHE_SHARDS; ++i)
+	{
+		shard = &theCache[ atomic_fetch_add( &cacheNextEvict, 1 ) & (CACHE_SHARDS - 1) ];
+		pthread_mutex_lock( &shard->lock );
+		if (shard->lruTail != NULL)
+		{
+			CacheUnlink( shard, shard->lruTail );
+			pthread_mutex_unlock( &shard->lock );
+			atomic_fetch_add( &cacheEvictions, 1 );
+			return 1;
+		}
+		pthread_mutex_unlock( &shard->lock );
+	}
 
 	return 0;
 }
 
-//-------- isQueueFull --------//
-int isQueueFull( void )
+//-------- CacheTouch --------//
+// NOTE: the shard must be locked; moves entry to the front of the LRU list
+static void CacheTouch( cache_shard_t* shard, cache_entry_t* entry )
 {
-	if (theQ.numItem >= theQ.capacity)
-		return 1;
+	if (shard->lruHead == entry)
+		return;
 
-	return 0;
+	// unlink, unless the entry is new
+	if (entry->lruPrev != NULL)
+	{
+		entry->lruPrev->lruNext = entry->lruNext;
+		if (entry->lruNext != NULL)
+			entry->lruNext->lruPrev = entry->lruPrev;
+		else
+			shard->lruTail = entry->lruPrev;
+	}
+
+	entry->lruPrev = NULL;
+	entry->lruNext = shard->lruHead;
+	if (shard->lruHead != NULL)
+		shard->lruHead->lruPrev = entry;
+	shard->lruHead = entry;
+	if (shard->lruTail == NULL)
+		shard->lruTail = entry;
 }
 
-//-------- QueueCleanup --------//
-void QueueCleanup( void )
+//-------- CacheLookup --------//
+// NOTE: the shard must be locked; returns the entry without taking a reference
+static cache_entry_t* CacheLookup( cache_shard_t* shard, const char* path, uint32_t hash )
+{
+	cache_entry_t* entry = shard->buckets[ (hash / CACHE_SHARDS) & (CACHE_BUCKETS - 1) ];
+
+	for ( ; entry != NULL; entry = entry->hashNext)
+	{
+		if (entry->hash == hash && strcmp(entry->path, path) == 0)
+			break;
+	}
+
+	return entry;
+}
+
+//-------- CacheFill --------//
+// reads a file into a new entry (holding one reference for the caller); NULL if it 
+// can't be read or is too big to be cached
+static cache_entry_t* CacheFill( char* path, uint32_t hash, int fildes, struct stat* info, size_t maxLen )
+{
+	cache_entry_t* entry;
+	ssize_t readLen = 0;
+	size_t  total   = 0;
+
+	if ( !S_ISREG(info->st_mode) || (size_t)info->st_size > maxLen )
+		return NULL;
+
+	entry = (cache_entry_t*)calloc( 1, sizeof(cache_entry_t) );
+	if (entry == NULL)
+		return NULL;
+	entry->len  = info->st_size;
+	entry->path = strdup( path );
+	if (entry->path == NULL)
+	{
+		free( entry );
+		return NULL;
+	}
+
+	entry->hash    = hash;
+	entry->mtime   = info->st_mtim;
+	entry->checked = CacheNowMs();
+	atomic_init( &entry->refs, 1 );
+
+	// map the file; an empty file can't be mapped and has nothing to send anyway
+	if (cacheMmap)
+	{
+		if (entry->len > 0)
+		{
+			entry->data = (char*)mmap( NULL, entry->len, PROT_READ, MAP_SHARED, fildes, 0 );
+			if (entry->data == MAP_FAILED)
+			{
+				entry->data = NULL;
+				CacheFree( entry );
+				return NULL;
+			}
+			madvise( entry->data, entry->len, MADV_WILLNEED );
+		}
+		return entry;
+	}
+
+	entry->data = (char*)malloc( entry->len > 0 ? entry->len : 1 );
+	if (entry->data == NULL)
+	{
+		CacheFree( entry );
+		return NULL;
+	}
+	while (total < entry->len)
+	{
+		readLen = pread( fildes, &entry->data[total], entry->len - total, total );
+		if (readLen < 0 && errno == EINTR)
+			continue;
+		if (readLen <= 0)
+		{
+			CacheFree( entry );
+			return NULL;
+		}
+		total += readLen;
+	}
+
+	return entry;
+}
+
+//-------- CacheGet --------//
+// returns a referenced entry holding the contents of path, reading the file on a miss;
+// release it with CacheRelease(). NULL means the file has to be served from disk.
+static cache_entry_t* CacheGet( char* path )
 {
-	free( *theQ.paths );
-	free( theQ.paths );
-	free( theQ.ctx );
+	uint32_t hash = CacheHash( path );
+	cache_shard_t* shard = &theCache[ hash & (CACHE_SHARDS - 1) ];
+	cache_entry_t* entry;
+	cache_entry_t* found;
+	struct stat info;
+	uint64_t now = CacheNowMs();
+	int fildes;
+
+	pthread_mutex_lock( &shard->lock );
+	entry = CacheLookup( shard, path, hash );
+	if (entry != NULL && now - entry->checked < CACHE_REVALIDATE_MS)
+	{
+		CacheTouch( shard, entry );
+		atomic_fetch_add( &entry->refs, 1 );
+		pthread_mutex_unlock( &shard->lock );
+		atomic_fetch_add( &cacheHits, 1 );
+		return entry;
+	}
+	pthread_mutex_unlock( &shard->lock );
+
+	// not cached, or due for a check of the file's modification time
+	if ( 0 > (fildes = content_get(path)) || fstat(fildes, &info) < 0 )
+		return NULL;
+
+	pthread_mutex_lock( &shard->lock );
+	entry = CacheLookup( shard, path, hash );
+	if (entry != NULL)
+	{
+		if ( entry->mtime.tv_sec == info.st_mtim.tv_sec && entry->mtime.tv_nsec == info.st_mtim.tv_nsec && 
+			 entry->len == (size_t)info.st_size )
+		{
+			entry->checked = now;
+			CacheTouch( shard, entry );
+			atomic_fetch_add( &entry->refs, 1 );
+			pthread_mutex_unlock( &shard->lock );
+			atomic_fetch_add( &cacheHits, 1 );
+			return entry;
+		}
+		// the file changed
+		CacheUnlink( shard, entry );
+	}
+	pthread_mutex_unlock( &shard->lock );
+
+	atomic_fetch_add( &cacheMisses, 1 );
+	entry = CacheFill( path, hash, fildes, &info, shard->capacity );
+	if (entry == NULL)
+		return NULL;
+
+	// the entry's bytes count against the total before it is linked, so workers filling
+	// different shards at once can't overshoot the capacity together
+	atomic_fetch_add( &cacheBytes, entry->len );
+	while ( atomic_load( &cacheBytes ) > cacheCapacity && CacheEvictAny() )
+		;
+	if ( atomic_load( &cacheBytes ) > cacheCapacity )
+	{
+		// the rest is taken by entries other workers are linking, serve this one uncached
+		atomic_fetch_sub( &cacheBytes, entry->len );
+		return entry;
+	}
+
+	pthread_mutex_lock( &shard->lock );
+	found = CacheLookup( shard, path, hash );
+	if (found != NULL)
+	{
+		// another worker read the same file meanwhile, serve ours and keep theirs
+		pthread_mutex_unlock( &shard->lock );
+		atomic_fetch_sub( &cacheBytes, entry->len );
+		return entry;
+	}
+
+	while (shard->bytes + entry->len > shard->capacity && shard->lruTail != NULL)
+	{
+		CacheUnlink( shard, shard->lruTail );
+		atomic_fetch_add( &cacheEvictions, 1 );
+	}
+	entry->hashNext = shard->buckets[ (hash / CACHE_SHARDS) & (CACHE_BUCKETS - 1) ];
+	shard->buckets[ (hash / CACHE_SHARDS) & (CACHE_BUCKETS - 1) ] = entry;
+	shard->bytes += entry->len;
+	CacheTouch( shard, entry );
+	atomic_fetch_add( &entry->refs, 1 );	// the cache's reference
+	pthread_mutex_unlock( &shard->lock );
+
+	return entry;
 }
 
 
@@ -108,27 +450,21 @@ void QueueCleanup( void )
 void *workerFunc(void *threadArgument) 
 {
 	int tID 	 	= *( (int*)threadArgument );
-	int pathIdx = 0;
-	char buffer[PATH_BUFF_SIZE] = {0};
+	char* path;
 	int  result = 0;
+	gfcontext_t* ctx;
 
 	fprintf(stdout, "Thread %d\n", tID);
 
 	while(1)
 	{
-		pthread_mutex_lock(&gMutex);
-
-		while ( isQueueEmpty() )
-			pthread_cond_wait( &gCond, &gMutex );
+		QueueDeq( &path, &ctx );
+		gfs_mark_dequeued( ctx );
 
-		pathIdx = QueueDeq();
-		strcpy(buffer, theQ.paths[pathIdx]);		
-		pthread_mutex_unlock(&gMutex);		
-
-		result = handler_get( theQ.ctx[pathIdx], buffer, NULL);
+		result = handler_get( ctx, path, NULL);
 		if (result < 0)
 		{
-			printf("handle error\n");
+			GFS_LOG(LOG_WARN, "handle error");
 		}
 
 	}
@@ -137,59 +473,91 @@ void *workerFunc(void *threadArgument)
 }
 
 
+//-------------- HandlerStats  ------------------//
+// appends the cache counters and the current queue length to the server statistics
+size_t HandlerStats( char* buf, size_t size )
+{
+	uint64_t hits, misses, evictions;
+	size_t   queued = RingCount( &theQ );
+	int      len;
+
+	CacheStats( &hits, &misses, &evictions );
+	len = snprintf( buf, size, "queued %zu\ncache_hits %" PRIu64 "\ncache_misses %" PRIu64 "\ncache_evictions %" PRIu64 "\n",
+					queued, hits, misses, evictions );
+
+	return (len < 0) ? 0 : ( ((size_t)len < size) ? (size_t)len : size - 1 );
+}
+
+
 //-------------- boss_handler  ------------------//
 ssize_t boss_handler(gfcontext_t* ctx, char* path, void* arg)
 {
-	//fprintf(stdout, "The Boss\n");
-	// enqueue the request
-	pthread_mutex_lock(&gMutex);
+	// enqueue the request, parks the boss only if every slot is taken
 	QueueEnq(path, ctx);
-	pthread_mutex_unlock(&gMutex);
-
-	while ( isQueueFull() );
-	pthread_cond_signal(&gCond);
 
 	return 0;
 }
 
 
+//-------------- SendHeader  ------------------//
+// sends the OK header for a file of total bytes, and determines which part of it 
+// goes into the body: all of it, or the range the client asked for (clamped to the file)
+static void SendHeader(gfcontext_t* ctx, size_t total, size_t* offset, size_t* len)
+{
+	if ( !gfs_get_range(ctx, offset, len) )
+	{
+		*offset = 0;
+		*len    = total;
+		gfs_sendheader(ctx, GF_OK, total);
+		return;
+	}
+
+	if (*offset > total)
+		*offset = total;
+	if (*len > total - *offset)
+		*len = total - *offset;
+	gfs_sendheader_range(ctx, GF_OK, *len, *offset, total);
+}
+
+
 //-------------- single_threaded handler  ------------------//
 ssize_t handler_get(gfcontext_t* ctx, char* path, void* arg)
 {
 	int fildes;
-	size_t file_len, bytes_transferred;
-	ssize_t read_len, write_len;
-	char buffer[BUFFER_SIZE];
+	size_t file_len;
+	size_t offset;
+	ssize_t write_len;
+	cache_entry_t* entry;
+
+	// serve from memory (or the shared mapping) when possible
+	if (cacheCapacity > 0 && (entry = CacheGet(path)) != NULL)
+	{
+		SendHeader(ctx, entry->len, &offset, &file_len);
+		write_len = gfs_send(ctx, &entry->data[offset], file_len);
+		CacheRelease(entry);
+		if (write_len < 0 || (size_t)write_len != file_len)
+		{
+			GFS_LOG(LOG_WARN, "handle_with_cache send error, %zd, %zu", write_len, file_len);
+			gfs_abort(ctx);
+			return -1;
+		}
+		return write_len;
+	}
 
 	if( 0 > (fildes = content_get(path)))
 		return gfs_sendheader(ctx, GF_FILE_NOT_FOUND, 0);
 
 	/* Calculating the file size */
-	file_len = lseek(fildes, 0, SEEK_END);
+	SendHeader(ctx, lseek(fildes, 0, SEEK_END), &offset, &file_len);
 
-	gfs_sendheader(ctx, GF_OK, file_len);
-
-	/* Sending the file contents chunk by chunk. */
-	bytes_transferred = 0;
-	while(bytes_transferred < file_len)
+	/* Sending the file contents straight from the page cache. */
+	write_len = gfs_sendfile(ctx, fildes, offset, file_len);
+	if (write_len < 0 || (size_t)write_len != file_len)
 	{
-		read_len = pread(fildes, buffer, BUFFER_SIZE, bytes_transferred);
-		if (read_len <= 0)
-		{
-			fprintf(stderr, "handle_with_file read error, %zd, %zu, %zu", read_len, bytes_transferred, file_len );
-			gfs_abort(ctx);
-			return -1;
-		}
-		write_len = gfs_send(ctx, buffer, read_len);
-		if (write_len != read_len)
-		{
-			fprintf(stderr, "handle_with_file write error");
-			gfs_abort(ctx);
-			return -1;
-		}
-		bytes_transferred += write_len;
+		GFS_LOG(LOG_WARN, "handle_with_file sendfile error, %zd, %zu", write_len, file_len);
+		gfs_abort(ctx);
+		return -1;
 	}
 
-	return bytes_transferred;
+	return write_len;
 }
-
@@ -0,0 +1,383 @@
+#include <errno.h>
+#include <getopt.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "ring.h"
+
+#define USAGE                                                                 \
+"usage:\n"                                                                    \
+"  queue_bench [options]\n"                                                   \
+"options:\n"                                                                  \
+"  -h                  Show this help message\n"                              \
+"  -n [items]          Items passed through the queue per run (Default: 2000000)\n" \
+"  -t [max_threads]    Largest worker count, doubled from 1 (Default: 64)\n"  \
+"  -P [producers]      Producer (boss) threads (Default: 1)\n"                \
+"  -q [queue_size]     Queue capacity (Default: 1024)\n"                      \
+"  -w [work_ns]        Busy work per item in a worker (Default: 0)\n"
+
+/* OPTIONS DESCRIPTOR ====================================================== */
+static struct option gLongOptions[] =
+{
+  {"items",         required_argument,      NULL,           'n'},
+  {"threads",       required_argument,      NULL,           't'},
+  {"producers",     required_argument,      NULL,           'P'},
+  {"queue-size",    required_argument,      NULL,           'q'},
+  {"work",          required_argument,      NULL,           'w'},
+  {"help",          no_argument,            NULL,           'h'},
+  {NULL,            0,                      NULL,             0}
+};
+
+
+#define PATH_BUFF_SIZE	128
+#define NSEC_PER_SEC	1000000000ULL
+
+// Boss -> worker hand-off of the multithreaded server, without the server around it:
+// producers push paths, workers pop them, a NULL path tells a worker to stop.
+// "mutex" is the queue the server started out with, one lock and condition variables
+// around a circular array of path copies; "ring" is ring.c as handler.c uses it.
+// NOTE: the original boss spun on isQueueFull(), here it waits on notFull instead,
+// which only flatters the old queue
+
+//----------------- Mutex Queue ------------------//
+typedef struct mutex_queue
+{
+	pthread_mutex_t	lock;
+	pthread_cond_t	notEmpty;
+	pthread_cond_t	notFull;
+	char**			paths;
+	void**			args;
+	int				front;
+	int				rear;
+	int				numItem;
+	int				capacity;
+} mutex_queue_t;
+
+typedef struct bench
+{
+	int				useRing;
+	mutex_queue_t	mq;
+	ring_t			ring;
+	long			items;			// per producer
+	int				workers;
+	int				producers;
+	long			workNs;
+	pthread_barrier_t	start;
+} bench_t;
+
+static char gPath[] = "/courses/ud923/filecorpus/road.jpg";
+
+
+//------------ Usage -------------//
+static void Usage()
+{
+	fprintf(stdout, "%s", USAGE);
+}
+
+//------------ NowNs -------------//
+static uint64_t NowNs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+//------------ Spin -------------//
+// stands in for the work a worker does per request
+static void Spin( long ns )
+{
+	uint64_t until;
+
+	if (ns <= 0)
+		return;
+
+	until = NowNs() + ns;
+	while (NowNs() < until)
+		;
+}
+
+//-------- MutexQueueInit --------//
+// returns -1 if the queue can't be allocated
+static int MutexQueueInit( mutex_queue_t* q, int size )
+{
+	int i = 0;
+
+	pthread_mutex_init( &q->lock, NULL );
+	pthread_cond_init( &q->notEmpty, NULL );
+	pthread_cond_init( &q->notFull, NULL );
+	q->front	= 0;
+	q->rear		= size - 1;
+	q->capacity	= size;
+	q->numItem	= 0;
+	q->paths	= (char**)malloc( size*sizeof(char*) );
+	q->args		= (void**)malloc( size*sizeof(void*) );
+	if (q->paths == NULL || q->args == NULL)
+		return -1;
+
+	for (i=0; i<size; ++i)
+	{
+		if ( (q->paths[i] = (char*)malloc( PATH_BUFF_SIZE*sizeof(char) )) == NULL )
+			return -1;
+	}
+
+	return 0;
+}
+
+//-------- MutexQueueEnq --------//
+static void MutexQueueEnq( mutex_queue_t* q, char* path, void* arg )
+{
+	pthread_mutex_lock( &q->lock );
+	while (q->numItem >= q->capacity)
+		pthread_cond_wait( &q->notFull, &q->lock );
+
+	q->rear = (q->rear + 1) % q->capacity;
+	if (path)
+		strcpy( q->paths[q->rear], path );
+	else
+		q->paths[q->rear][0] = '\0';
+	q->args[q->rear] = arg;
+	q->numItem++;
+
+	pthread_cond_signal( &q->notEmpty );
+	pthread_mutex_unlock( &q->lock );
+}
+
+//-------- MutexQueueDeq --------//
+// copies the path out into buffer, returns 0 for a stop item
+static int MutexQueueDeq( mutex_queue_t* q, char* buffer, void** arg )
+{
+	int idx;
+
+	pthread_mutex_lock( &q->lock );
+	while (q->numItem == 0)
+		pthread_cond_wait( &q->notEmpty, &q->lock );
+
+	idx      = q->front;
+	q->front = (q->front + 1) % q->capacity;
+	q->numItem--;
+	strcpy( buffer, q->paths[idx] );
+	*arg = q->args[idx];
+
+	pthread_cond_signal( &q->notFull );
+	pthread_mutex_unlock( &q->lock );
+
+	return buffer[0] != '\0';
+}
+
+//-------- MutexQueueCleanup --------//
+static void MutexQueueCleanup( mutex_queue_t* q )
+{
+	int i = 0;
+
+	for (i=0; i<q->capacity; ++i)
+	{
+		free( q->paths[i] );
+	}
+	free( q->paths );
+	free( q->args );
+	pthread_cond_destroy( &q->notFull );
+	pthread_cond_destroy( &q->notEmpty );
+	pthread_mutex_destroy( &q->lock );
+}
+
+//------------ ProducerFunc -------------//
+static void* ProducerFunc( void* arg )
+{
+	bench_t* b = (bench_t*)arg;
+	long i;
+
+	pthread_barrier_wait( &b->start );
+
+	for (i=0; i<b->items; ++i)
+	{
+		if (b->useRing)
+			RingEnq( &b->ring, gPath, b );
+		else
+			MutexQueueEnq( &b->mq, gPath, b );
+	}
+
+	return NULL;
+}
+
+//------------ WorkerFunc -------------//
+static void* WorkerFunc( void* arg )
+{
+	bench_t* b = (bench_t*)arg;
+	char  buffer[PATH_BUFF_SIZE];
+	char* path;
+	void* item;
+	long  count = 0;
+
+	pthread_barrier_wait( &b->start );
+
+	while (1)
+	{
+		if (b->useRing)
+		{
+			RingDeq( &b->ring, &path, &item );
+			if (path == NULL)
+				break;
+		}
+		else if ( !MutexQueueDeq( &b->mq, buffer, &item ) )
+		{
+			break;
+		}
+
+		Spin( b->workNs );
+		++count;
+	}
+
+	return (void*)count;
+}
+
+//------------ RunBench -------------//
+// returns the wall time in ns from the start of the producers to the last worker done
+static uint64_t RunBench( bench_t* b, int queueSize )
+{
+	pthread_t* producers = (pthread_t*)malloc( b->producers*sizeof(pthread_t) );
+	pthread_t* workers   = (pthread_t*)malloc( b->workers*sizeof(pthread_t) );
+	uint64_t   started, elapsed;
+	long       total = 0;
+	void*      count;
+	int        i;
+
+	if ( 0 > (b->useRing ? RingInit( &b->ring, queueSize ) : MutexQueueInit( &b->mq, queueSize )) )
+	{
+		fprintf(stderr, "%s @ %d: unable to allocate a %s queue of %d\n", __FILE__, __LINE__,
+				b->useRing ? "ring" : "mutex", queueSize);
+		exit(1);
+	}
+	pthread_barrier_init( &b->start, NULL, b->producers + b->workers + 1 );
+
+	for (i=0; i<b->workers; ++i)
+	{
+		pthread_create( &workers[i], NULL, WorkerFunc, b );
+	}
+	for (i=0; i<b->producers; ++i)
+	{
+		pthread_create( &producers[i], NULL, ProducerFunc, b );
+	}
+
+	pthread_barrier_wait( &b->start );
+	started = NowNs();
+
+	for (i=0; i<b->producers; ++i)
+	{
+		pthread_join( producers[i], NULL );
+	}
+	// every item is in, one stop item per worker goes behind them
+	for (i=0; i<b->workers; ++i)
+	{
+		if (b->useRing)
+			RingEnq( &b->ring, NULL, NULL );
+		else
+			MutexQueueEnq( &b->mq, NULL, NULL );
+	}
+	for (i=0; i<b->workers; ++i)
+	{
+		pthread_join( workers[i], &count );
+		total += (long)count;
+	}
+	elapsed = NowNs() - started;
+
+	if (total != b->items * b->producers)
+	{
+		fprintf(stderr, "%s @ %d: %s queue lost items, %ld of %ld\n", __FILE__, __LINE__,
+				b->useRing ? "ring" : "mutex", total, b->items * b->producers);
+		exit(1);
+	}
+
+	pthread_barrier_destroy( &b->start );
+	if (b->useRing)
+		RingCleanup( &b->ring );
+	else
+		MutexQueueCleanup( &b->mq );
+	free( workers );
+	free( producers );
+
+	return elapsed;
+}
+
+
+//------------------------------- Main --------------------------------------//
+int main(int argc, char **argv)
+{
+	bench_t  b;
+	long     items      = 2000000;
+	int      maxThreads = 64;
+	int      queueSize  = 1024;
+	uint64_t ns[2];
+
+  	int i;
+  	int option_char = 0;
+
+	memset( &b, 0, sizeof(b) );
+	b.producers = 1;
+
+  	// Parse and set command line arguments
+  	while ( (option_char = getopt_long(argc, argv, "n:t:P:q:w:h", gLongOptions, NULL)) != -1 )
+	{
+	    switch (option_char)
+		{
+		case 'n': // items
+			items = atol(optarg);
+			if (items < 1)
+				items = 1;
+			break;
+   	    case 't': // threads
+			maxThreads = atoi(optarg);
+			if (maxThreads < 1)
+				maxThreads = 1;
+			break;
+   	    case 'P': // producers
+			b.producers = atoi(optarg);
+			if (b.producers < 1)
+				b.producers = 1;
+			break;
+      	case 'q': // queue-size
+			queueSize = atoi(optarg);
+			if (queueSize < 2)
+				queueSize = 2;
+			break;
+      	case 'w': // work per item
+			b.workNs = atol(optarg);
+			break;
+      	case 'h': // help
+			Usage();
+			exit(0);
+			break;
+      	default:
+			Usage();
+			exit(1);
+    	}
+  	}
+
+	b.items = items / b.producers;
+
+	fprintf(stdout, "%d producer(s), %ld items, queue %d, %ld ns work per item\n",
+			b.producers, b.items * b.producers, queueSize, b.workNs);
+	fprintf(stdout, "%8s %14s %10s %14s %10s %8s\n", "workers", "mutex ops/s", "ns/op", "ring ops/s", "ns/op", "speedup");
+
+	for (b.workers = 1; b.workers <= maxThreads; b.workers *= 2)
+	{
+		for (i=0; i<2; ++i)
+		{
+			b.useRing = i;
+			ns[i] = RunBench( &b, queueSize );
+		}
+
+		fprintf(stdout, "%8d %14.0f %10.1f %14.0f %10.1f %7.2fx\n", b.workers,
+				(double)(b.items * b.producers) * NSEC_PER_SEC / ns[0], (double)ns[0] / (b.items * b.producers),
+				(double)(b.items * b.producers) * NSEC_PER_SEC / ns[1], (double)ns[1] / (b.items * b.producers),
+				(double)ns[0] / ns[1]);
+		fflush(stdout);
+	}
+
+	return 0;
+}
@@ -0,0 +1,226 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#include "ring.h"
+
+#define RING_SPIN	256		// failed tries before a thread parks on the futex
+
+
+//-------- FutexWait --------//
+// sleeps as long as *addr still holds val, returns 0 if it never slept or was interrupted
+static int FutexWait( _Atomic uint32_t* addr, uint32_t val )
+{
+	return syscall( SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0 ) == 0;
+}
+
+//-------- FutexWake --------//
+static void FutexWake( _Atomic uint32_t* addr, int count )
+{
+	syscall( SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0 );
+}
+
+//-------- CpuRelax --------//
+static inline void CpuRelax( void )
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ __volatile__( "yield" );
+#endif
+}
+
+//-------- ClaimWaiter --------//
+// takes one parked thread off the waiter count, returns 0 if there is none.
+// The waker does the decrement so a thread that is woken but not yet running 
+// isn't woken again by every following enqueue/dequeue.
+static int ClaimWaiter( _Atomic uint32_t* waiters )
+{
+	uint32_t count = atomic_load( waiters );
+
+	while (count > 0)
+	{
+		if ( atomic_compare_exchange_weak( waiters, &count, count - 1 ) )
+			return 1;
+	}
+
+	return 0;
+}
+
+//-------- RingInit --------//
+int RingInit( ring_t* ring, int size )
+{
+	size_t capacity = 2;
+	size_t i = 0;
+
+	while (capacity < (size_t)size)
+		capacity <<= 1;
+
+	ring->cells = (ring_cell_t*)aligned_alloc( RING_CACHE_LINE, 
+						( (capacity*sizeof(ring_cell_t) + RING_CACHE_LINE - 1) / RING_CACHE_LINE ) * RING_CACHE_LINE );
+	if (ring->cells == NULL)
+		return -1;
+	ring->mask  = capacity - 1;
+	// spinning only pays off if the other side can run meanwhile
+	ring->spin  = ( sysconf(_SC_NPROCESSORS_ONLN) > 1 ) ? RING_SPIN : 0;
+
+	for (i=0; i<capacity; ++i)
+	{
+		atomic_init( &ring->cells[i].seq, i );
+	}
+	atomic_init( &ring->enqPos, 0 );
+	atomic_init( &ring->deqPos, 0 );
+	atomic_init( &ring->notEmpty, 0 );
+	atomic_init( &ring->emptyWaiters, 0 );
+	atomic_init( &ring->notFull, 0 );
+	atomic_init( &ring->fullWaiters, 0 );
+
+	return 0;
+}
+
+//-------- RingTryEnq --------//
+int RingTryEnq( ring_t* ring, char* path, void* arg )
+{
+	ring_cell_t* cell;
+	size_t   seq;
+	intptr_t diff;
+	size_t   pos = atomic_load_explicit( &ring->enqPos, memory_order_relaxed );
+
+	while (1)
+	{
+		cell = &ring->cells[pos & ring->mask];
+		seq  = atomic_load_explicit( &cell->seq, memory_order_acquire );
+		diff = (intptr_t)seq - (intptr_t)pos;
+		if (diff == 0)
+		{
+			// the cell is free for this lap, claim it
+			if ( atomic_compare_exchange_weak_explicit( &ring->enqPos, &pos, pos + 1, 
+														memory_order_relaxed, memory_order_relaxed ) )
+				break;
+		}
+		else if (diff < 0)
+		{
+			return 0;
+		}
+		else
+		{
+			pos = atomic_load_explicit( &ring->enqPos, memory_order_relaxed );
+		}
+	}
+
+	cell->path = path;
+	cell->arg  = arg;
+	atomic_store_explicit( &cell->seq, pos + 1, memory_order_release );
+
+	return 1;
+}
+
+//-------- RingTryDeq --------//
+int RingTryDeq( ring_t* ring, char** path, void** arg )
+{
+	ring_cell_t* cell;
+	size_t   seq;
+	intptr_t diff;
+	size_t   pos = atomic_load_explicit( &ring->deqPos, memory_order_relaxed );
+
+	while (1)
+	{
+		cell = &ring->cells[pos & ring->mask];
+		seq  = atomic_load_explicit( &cell->seq, memory_order_acquire );
+		diff = (intptr_t)seq - (intptr_t)(pos + 1);
+		if (diff == 0)
+		{
+			// the cell holds an item for this lap, claim it
+			if ( atomic_compare_exchange_weak_explicit( &ring->deqPos, &pos, pos + 1, 
+														memory_order_relaxed, memory_order_relaxed ) )
+				break;
+		}
+		else if (diff < 0)
+		{
+			return 0;
+		}
+		else
+		{
+			pos = atomic_load_explicit( &ring->deqPos, memory_order_relaxed );
+		}
+	}
+
+	*path = cell->path;
+	*arg  = cell->arg;
+	// hand the cell to the producer of the next lap
+	atomic_store_explicit( &cell->seq, pos + ring->mask + 1, memory_order_release );
+
+	return 1;
+}
+
+//-------- RingEnq --------//
+void RingEnq( ring_t* ring, char* path, void* arg )
+{
+	uint32_t seen;
+	int      spin = 0;
+
+	while ( !RingTryEnq(ring, path, arg) )
+	{
+		// a slot usually frees up within a few hundred ns, parking costs two syscalls
+		if (++spin < ring->spin)
+		{
+			CpuRelax();
+			continue;
+		}
+
+		// read the futex word before re-checking, so a dequeue in between is never missed
+		seen = atomic_load( &ring->notFull );
+		if ( RingTryEnq(ring, path, arg) )
+			break;
+
+		atomic_fetch_add( &ring->fullWaiters, 1 );
+		if ( !FutexWait( &ring->notFull, seen ) )
+			ClaimWaiter( &ring->fullWaiters );		// nobody woke us, take our count back
+	}
+
+	atomic_fetch_add( &ring->notEmpty, 1 );
+	if ( ClaimWaiter( &ring->emptyWaiters ) )
+		FutexWake( &ring->notEmpty, 1 );
+}
+
+//-------- RingDeq --------//
+void RingDeq( ring_t* ring, char** path, void** arg )
+{
+	uint32_t seen;
+	int      spin = 0;
+
+	while ( !RingTryDeq(ring, path, arg) )
+	{
+		if (++spin < ring->spin)
+		{
+			CpuRelax();
+			continue;
+		}
+
+		seen = atomic_load( &ring->notEmpty );
+		if ( RingTryDeq(ring, path, arg) )
+			break;
+
+		atomic_fetch_add( &ring->emptyWaiters, 1 );
+		if ( !FutexWait( &ring->notEmpty, seen ) )
+			ClaimWaiter( &ring->emptyWaiters );
+	}
+
+	atomic_fetch_add( &ring->notFull, 1 );
+	if ( ClaimWaiter( &ring->fullWaiters ) )
+		FutexWake( &ring->notFull, 1 );
+}
+
+//-------- RingCount --------//
+size_t RingCount( ring_t* ring )
+{
+	return atomic_load( &ring->enqPos ) - atomic_load( &ring->deqPos );
+}
+
+//-------- RingCleanup --------//
+void RingCleanup( ring_t* ring )
+{
+	free( ring->cells );
+	ring->cells = NULL;
+}
@@ -0,0 +1,52 @@
+#ifndef __RING_H__
+#define __RING_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define RING_CACHE_LINE		64
+
+//----------------- Ring Type ------------------//
+// bounded multi-producer/multi-consumer ring (D. Vyukov's sequenced cells).
+// Each cell's sequence number tells producers and consumers whose turn it is, so 
+// enqueue/dequeue only contend on a single CAS of their own position counter.
+// Threads that find the ring empty (consumers) or full (producers) park on a futex 
+// word that the other side bumps, instead of spinning.
+typedef struct ring_cell
+{
+	_Atomic size_t	seq;
+	char*			path;		// owned by the producer, the ring only passes it on
+	void*			arg;
+} ring_cell_t;
+
+typedef struct ring
+{
+	ring_cell_t*	cells;
+	size_t			mask;		// capacity - 1, capacity is a power of 2
+	int				spin;		// failed tries before a thread parks, 0 on a single CPU
+
+	_Alignas(RING_CACHE_LINE) _Atomic size_t	enqPos;
+	_Alignas(RING_CACHE_LINE) _Atomic size_t	deqPos;
+
+	_Alignas(RING_CACHE_LINE) _Atomic uint32_t	notEmpty;		// futex word, bumped after every enqueue
+	_Atomic uint32_t							emptyWaiters;	// # of consumers parked on notEmpty and not yet woken
+	_Alignas(RING_CACHE_LINE) _Atomic uint32_t	notFull;		// futex word, bumped after every dequeue
+	_Atomic uint32_t							fullWaiters;	// # of producers parked on notFull and not yet woken
+} ring_t;
+
+// NOTE: size is rounded up to the next power of 2; returns -1 if the cells can't be allocated
+int		RingInit( ring_t* ring, int size );
+// returns 0 if the ring is full
+int		RingTryEnq( ring_t* ring, char* path, void* arg );
+// returns 0 if the ring is empty
+int		RingTryDeq( ring_t* ring, char** path, void** arg );
+// blocks while the ring is full
+void	RingEnq( ring_t* ring, char* path, void* arg );
+// blocks while the ring is empty
+void	RingDeq( ring_t* ring, char** path, void** arg );
+// # of items currently queued, a snapshot
+size_t	RingCount( ring_t* ring );
+void	RingCleanup( ring_t* ring );
+
+#endif // __RING_H__